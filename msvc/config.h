@@ -35,10 +35,12 @@
 /* #undef HAVE_GETOPT_LONG */
 #define HAVE_MAPVIEWOFFILE 1
 /* #undef HAVE_DLADDR */
+/* #undef HAVE_DIRENT_H */
 /* #undef HAVE_DLFCN_H */
 #define HAVE_DUP 1
 #define HAVE_DUP2 1
 /* #undef HAVE_ENDIAN_H */
+/* #undef HAVE_EPOLL_CREATE1 */
 #define HAVE_FCNTL_H 1
 /* #undef HAVE_FGETC_UNLOCKED */
 /* #undef HAVE_FGETLN */
@@ -52,6 +54,7 @@
 /* #undef HAVE_FSEEKO */
 /* #undef HAVE_FSEEKO64 */
 /* #undef HAVE_FSETPOS64 */
+/* #undef HAVE_FSTATFS */
 /* #undef HAVE_FTELLO */
 /* #undef HAVE_FTELLO64 */
 /* #undef HAVE_GETCHAR_UNLOCKED */
@@ -68,21 +71,29 @@
 #define HAVE_IO_H 1
 /* #undef HAVE_KILL */
 /* #undef HAVE_LIBC_H */
+/* #undef HAVE_LINUX_FUTEX_H */
+/* #undef HAVE_LINUX_USERFAULTFD_H */
 /* #undef HAVE_LSEEK64 */
 /* #undef HAVE_MACH_TASK_H */
 #define HAVE_MALLOC_H 1
 /* #undef HAVE_MAP_FD */
 /* #undef HAVE_MEMALIGN */
+/* #undef HAVE_MEMFD_CREATE */
 #define HAVE_MEMORY_H 1
 /* #undef HAVE_MMAP */
 /* #undef HAVE_MMAP64 */
+/* #undef HAVE_MREMAP */
 /* #undef HAVE_NETINET_IN_H */
 /* #undef HAVE_OPEN64 */
 /* #undef HAVE_PIPE */
+/* #undef HAVE_POLL_H */
 /* #undef HAVE_POSIX_MEMALIGN */
+/* #undef HAVE_POSIX_SPAWNP */
 /* #undef HAVE_PRAGMA_INIT */
 /* #undef HAVE_PREAD */
+/* #undef HAVE_PRLIMIT */
 #define HAVE_PROCESS_H 1
+/* #undef HAVE_PTHREAD_H */
 #define HAVE_READFILE 1
 #define HAVE_READFILEEX 1
 /* #undef HAVE_READV */
@@ -93,6 +104,8 @@
 #define HAVE_REGEX_H 1
 #define HAVE_REGWEXEC 1
 #define HAVE_REOPENFILE 1
+/* #undef HAVE_SCHED_YIELD */
+/* #undef HAVE_SENDMSG */
 #define HAVE_SETCONSOLEMODE 1
 /* #undef HAVE_SETENV */
 /* #undef HAVE_SETRLIMIT */
@@ -102,19 +115,26 @@
 #define HAVE_SOCKET 1
 /* #undef HAVE_SOCKLEN_T */
 /* #undef HAVE_SOLARIS_FILE */
+/* #undef HAVE_SPAWN_H */
 #define HAVE_STDINT_H 1
+#define HAVE_STDIO_H 1
 #define HAVE_STDLIB_H 1
 #define HAVE_STRINGS_H 1
 #define HAVE_STRING_H 1
 /* #undef HAVE_SYS_CDEFS_H */
+/* #undef HAVE_SYS_EPOLL_H */
 /* #undef HAVE_SYS_MMAN_H */
 /* #undef HAVE_SYS_RESOURCE_H */
 /* #undef HAVE_SYS_SOCKET_H */
 #define HAVE_SYS_STAT_H 1
+/* #undef HAVE_SYS_SYSCALL_H */
+/* #undef HAVE_SYS_TIMERFD_H */
 /* #undef HAVE_SYS_TIME_H */
 #define HAVE_SYS_TYPES_H 1
 /* #undef HAVE_SYS_UIO_H */
+/* #undef HAVE_SYS_VFS_H */
 /* #undef HAVE_SYS_WAIT_H */
+/* #undef HAVE_TIMERFD_CREATE */
 /* #undef HAVE_UNISTD_H */
 /* #undef HAVE_VALLOC */
 /* #undef HAVE_WAITPID */
@@ -122,6 +142,7 @@
 #define HAVE_WINSOCK2_H 1
 #define HAVE_WRITECONSOLEOUTPUTA 1
 #define HAVE_WRITECONSOLEOUTPUTW 1
+/* #undef HAVE_X86_DISPATCH */
 /* #undef HAVE__IO_GETC */
 #define HAVE__PIPE 1
 /* #undef HAVE___FGETS_CHK */
@@ -38,17 +38,83 @@
 /* We use file descriptor 17 as the debug channel on Unix */
 #define DEBUG_FILENO 17
 
+/* The fork server needs fork(), waitpid() and a way to pass file
+ * descriptors between processes */
+#if defined HAVE_FORK && defined HAVE_WAITPID \
+     && defined HAVE_SENDMSG && defined HAVE_RECVMSG
+#   define ZZUF_FORKSERVER 1
+#endif
+
+/* A fork server request: zzuf sends this along with the debug, stderr
+ * and stdout descriptors of the new child. The server answers with the
+ * child's PID, then with its waitpid() status once it has exited. */
+struct fork_request
+{
+    uint32_t seed;
+    double minratio, maxratio;
+};
+
+/* Persistent mode children share the seed they are running with zzuf
+ * through a small file that libzzuf maps in memory, so that zzuf knows
+ * which seed crashed without any per-iteration system call. */
+#if defined HAVE_FORK && defined HAVE_WAITPID \
+     && defined HAVE_MMAP && defined HAVE_PREAD
+#   define ZZUF_PERSISTENT 1
+#endif
+
+/* Each file descriptor keeps the bitmasks of the last few chunks it
+ * used, so that programs seeking back and forth in a file do not
+ * generate them again and again. */
+#define DEFAULT_CHUNK_CACHE 4
+#define MAX_CHUNK_CACHE 64
+
+struct fuzz_chunk
+{
+    int64_t index;
+    /* Sparse bitmask: the offsets of the altered bytes in ascending
+     * order, and the bits to alter in each of them. */
+    int nflips;
+    uint16_t flipoff[CHUNKBYTES];
+    uint8_t flipmask[CHUNKBYTES];
+    /* Full bitmask, only valid if “dense” is set */
+    int dense;
+    uint8_t data[CHUNKBYTES];
+};
+
+/* The offsets of the bytes that fuzzing may have altered, for callers
+ * that want to undo it. “count” becomes -1 when there are more than
+ * “max” of them, and the list is then useless. */
+struct fuzz_record
+{
+    int64_t *offsets;
+    int64_t count, size, max;
+};
+
+typedef struct fuzz_record fuzz_record_t;
+
+#include "util/mutex.h"
+
 struct fuzz_context
 {
     uint32_t seed;
     double ratio;
-    int64_t cur;
 #ifdef HAVE_FGETLN
     char *tmp;
 #endif
     int uflag; int64_t upos; uint8_t uchar; /* ungetc stuff */
-    uint8_t data[CHUNKBYTES];
+    /* Chunk cache, most recently used first. Threads reading the same
+     * file share it, so it is only used with “lock” held; an all-zero
+     * lock is a valid unnamed lock. */
+    zzuf_mutex_t lock;
+    int nchunks;
+    struct fuzz_chunk *chunks[MAX_CHUNK_CACHE];
+    int64_t hits, misses;
+    /* If not NULL, where to log the bytes being altered */
+    fuzz_record_t *record;
 };
 
 typedef struct fuzz_context fuzz_context_t;
 
+/* Per file descriptor state, opaque outside fd.c */
+typedef struct files fd_handle_t;
+
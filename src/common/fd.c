@@ -57,31 +57,84 @@ static int has_include = 0, has_exclude = 0;
 static int64_t *list = NULL;
 static int64_t static_list[512];
 
-/* File descriptor stuff. When program is launched, we use the static array of
- * 32 structures, which ought to be enough for most programs. If it happens
- * not to be the case, ie. if the process opens more than 32 file descriptors
- * at the same time, a bigger array is malloc()ed and replaces the static one.
+/* File descriptor stuff. Each watched file descriptor points to a
+ * struct files slot. When the program is launched, we use the static
+ * array of 32 slots, which ought to be enough for most programs. If it
+ * happens not to be the case, more slots are malloc()ed in blocks, each
+ * block being as large as all the previous ones together. Unused slots
+ * are kept in a free list, oldest first. Slots never move or get freed
+ * once allocated, so that a thread that looked up a file descriptor just
+ * before it was unregistered still accesses valid memory. Slots are also
+ * reference counted by _zz_fd_acquire() and _zz_fd_release(), and are
+ * neither cleaned up nor reused while they are held.
  */
 #define STATIC_FILES 32
-static struct files
+struct files
 {
-    int managed, locked, active, already_fuzzed;
+    int fd, managed, active, already_fuzzed;
+    volatile int locked, refs;
     int64_t pos, already_pos;
     /* Public stuff */
     fuzz_context_t fuzz;
+    /* Next slot in the free list */
+    struct files *next_free;
+};
+
+static struct files static_files[STATIC_FILES];
+
+static struct file_block
+{
+    int nfiles;
+    struct files *files;
+    struct file_block *next;
 }
-*files, static_files[STATIC_FILES];
-static int *fds, static_fds[STATIC_FILES];
-static int maxfd, nfiles;
+static_block = { STATIC_FILES, static_files, NULL };
+
+static struct files *free_head, *free_tail;
+static int nfree, nfiles;
+
+/* The file descriptor table. File descriptors are split into leaves of
+ * 1024 entries, which are only allocated when a file descriptor in their
+ * range gets registered, so that sockets with very high numbers do not
+ * require a huge array.
+ *
+ * Lookups do not take any lock: they load the current table, the leaf and
+ * the slot pointer with acquire semantics. Writers hold fds_mutex, fully
+ * initialise a slot before publishing it, and publish a bigger copy of the
+ * table when a file descriptor does not fit. Retired tables may still be
+ * in use by readers, so they are only freed by _zz_fd_fini(); since their
+ * sizes double, they never use more memory than the current table. Leaves
+ * are shared by all tables and are never freed either. */
+#define LEAF_BITS 10
+#define LEAF_SIZE (1 << LEAF_BITS)
+#define STATIC_LEAVES 64
+
+struct fd_leaf
+{
+    struct files *volatile fds[LEAF_SIZE];
+};
+
+struct fd_table
+{
+    int nleaves;
+    struct fd_leaf *volatile *leaves;
+    struct fd_table *retired;
+};
 
-/* Spinlock. This variable protects the fds variable. */
-static zzuf_mutex_t fds_mutex = 0;
+static struct fd_leaf static_leaf;
+static struct fd_leaf *volatile static_leaves[STATIC_LEAVES] = { &static_leaf };
+static struct fd_table static_table = { STATIC_LEAVES, static_leaves, NULL };
+static struct fd_table *volatile table = &static_table;
+
+/* Writer lock. It serialises writers to the table and slots; contended
+ * writers sleep instead of spinning, see util/mutex.h. */
+static zzuf_mutex_t fds_mutex = ZZUF_MUTEX_INIT("fds");
 
 /* Create lock. This lock variable is used to disable file descriptor
  * creation wrappers. For instance on Mac OS X, fopen() calls open()
  * and we don’t want open() to do any zzuf-related stuff: fopen() takes
  * care of everything. */
-static int create_lock = 0;
+static volatile int create_lock = 0;
 
 static int32_t seed = DEFAULT_SEED;
 static double  minratio = DEFAULT_RATIO;
@@ -118,6 +171,11 @@ void zzuf_set_seed(int32_t s)
     seed = s;
 }
 
+int32_t zzuf_get_seed(void)
+{
+    return seed;
+}
+
 void zzuf_set_ratio(double r0, double r1)
 {
     if (r0 == 0.0 && r1 == 0.0)
@@ -163,30 +221,43 @@ void zzuf_set_auto_increment(void)
     autoinc = 1;
 }
 
+static void init_files(struct files *files, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        files[i].managed = 0;
+        files[i].refs = 0;
+        files[i].fuzz.lock = (zzuf_mutex_t)ZZUF_MUTEX_INIT(NULL);
+        files[i].fuzz.nchunks = 0;
+#if defined HAVE_FGETLN
+        files[i].fuzz.tmp = NULL;
+#endif
+        files[i].next_free = i + 1 < count ? &files[i + 1] : NULL;
+    }
+}
+
 void _zz_fd_init(void)
 {
     /* We start with 32 file descriptors. This is to reduce the number of
      * calls to malloc() that we do, so we get better chances that memory
      * corruption errors are reproducible */
-    files = static_files;
-    for (nfiles = 0; nfiles < 32; ++nfiles)
-        files[nfiles].managed = 0;
-
-    fds = static_fds;
-    for (maxfd = 0; maxfd < 32; ++maxfd)
-        fds[maxfd] = -1;
+    init_files(static_files, STATIC_FILES);
+    free_head = &static_files[0];
+    free_tail = &static_files[STATIC_FILES - 1];
+    nfree = nfiles = STATIC_FILES;
+
+    for (int i = 0; i < LEAF_SIZE; ++i)
+        static_leaf.fds[i] = NULL;
+    for (int i = 1; i < STATIC_LEAVES; ++i)
+        static_leaves[i] = NULL;
+    table = &static_table;
 }
 
 void _zz_fd_fini(void)
 {
-    for (int i = 0; i < maxfd; ++i)
-    {
-        if (!files[fds[i]].managed)
-            continue;
-
-        /* XXX: What are we supposed to do? If filedescriptors weren't
-         * closed properly, there's a leak, but it's not our problem. */
-    }
+    /* XXX: What are we supposed to do about slots that are still managed?
+     * If filedescriptors weren't closed properly, there's a leak, but
+     * it's not our problem. */
 
 #if defined HAVE_REGEX_H
     if (has_include)
@@ -195,10 +266,26 @@ void _zz_fd_fini(void)
         regfree(&re_exclude);
 #endif
 
-    if (files != static_files)
-       free(files);
-    if (fds != static_fds)
-        free(fds);
+    while (static_block.next)
+    {
+        struct file_block *block = static_block.next;
+        static_block.next = block->next;
+        free(block->files);
+        free(block);
+    }
+
+    for (int i = 1; i < table->nleaves; ++i)
+        if (table->leaves[i])
+            free(table->leaves[i]);
+
+    while (table != &static_table)
+    {
+        struct fd_table *t = table;
+        table = t->retired;
+        free((void *)(uintptr_t)t->leaves);
+        free(t);
+    }
+
     if (list != static_list)
         free(list);
 }
@@ -233,93 +320,204 @@ int _zz_mustwatchw(wchar_t const *file)
     return 1; /* default */
 }
 
-int _zz_iswatched(int fd)
+/* Lock-free lookup of the slot associated with a file descriptor */
+static inline struct files *get_file(int fd)
 {
-    int ret = 0;
-    zzuf_mutex_lock(&fds_mutex);
+    struct fd_table *t = zzuf_atomic_load_ptr((void *volatile *)&table);
 
-    if (fd < 0 || fd >= maxfd || fds[fd] == -1)
-        goto early_exit;
+    if (fd < 0 || (fd >> LEAF_BITS) >= t->nleaves)
+        return NULL;
 
-    ret = 1;
+    struct fd_leaf *leaf
+        = zzuf_atomic_load_ptr((void *volatile *)&t->leaves[fd >> LEAF_BITS]);
+    if (!leaf)
+        return NULL;
 
-early_exit:
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+    return zzuf_atomic_load_ptr(
+                (void *volatile *)&leaf->fds[fd & (LEAF_SIZE - 1)]);
 }
 
-void _zz_register(int fd)
+int _zz_iswatched(int fd)
 {
-    int i;
+    return get_file(fd) != NULL;
+}
 
-    zzuf_mutex_lock(&fds_mutex);
+/* Return the table entry for fd, growing the table and allocating a new
+ * leaf if necessary, or NULL if memory is exhausted. Must be called with
+ * fds_mutex held. */
+static struct files *volatile *get_entry(int fd)
+{
+    struct fd_table *t = table;
 
-    if (fd < 0 || fd > 65535 || (fd < maxfd && fds[fd] != -1))
-        goto early_exit;
+    if ((fd >> LEAF_BITS) >= t->nleaves)
+    {
+        struct fd_table *n = malloc(sizeof(*n));
+        if (!n)
+            return NULL;
 
-#if defined LIBZZUF
-    if (autoinc)
-        debug2("using seed %li", (long int)seed);
-#endif
+        n->nleaves = t->nleaves;
+        while ((fd >> LEAF_BITS) >= n->nleaves)
+            n->nleaves *= 2;
 
-    /* If filedescriptor is outside our bounds */
-    while (fd >= maxfd)
-    {
-        if (fds == static_fds)
+        n->leaves = malloc(n->nleaves * sizeof(*n->leaves));
+        if (!n->leaves)
         {
-            fds = malloc(2 * maxfd * sizeof(*fds));
-            memcpy(fds, static_fds, maxfd * sizeof(*fds));
+            free(n);
+            return NULL;
         }
-        else
-            fds = realloc(fds, 2 * maxfd * sizeof(*fds));
-        for (i = maxfd; i < maxfd * 2; ++i)
-            fds[i] = -1;
-        maxfd *= 2;
+        for (int i = 0; i < t->nleaves; ++i)
+            n->leaves[i] = t->leaves[i];
+        for (int i = t->nleaves; i < n->nleaves; ++i)
+            n->leaves[i] = NULL;
+        n->retired = t;
+
+        zzuf_atomic_store_ptr((void *volatile *)&table, n);
+        t = n;
     }
 
-    /* Find an empty slot */
-    for (i = 0; i < nfiles; ++i)
-        if (files[i].managed == 0)
-            break;
+    struct fd_leaf *leaf = t->leaves[fd >> LEAF_BITS];
+    if (!leaf)
+    {
+        leaf = malloc(sizeof(*leaf));
+        if (!leaf)
+            return NULL;
+        for (int i = 0; i < LEAF_SIZE; ++i)
+            leaf->fds[i] = NULL;
+
+        zzuf_atomic_store_ptr((void *volatile *)&t->leaves[fd >> LEAF_BITS],
+                              leaf);
+    }
+
+    return &leaf->fds[fd & (LEAF_SIZE - 1)];
+}
+
+/* Free the resources of an unregistered slot. Must be called with
+ * fds_mutex held, on a slot that nobody holds. */
+static void clean_file(struct files *f)
+{
+    fuzz_context_t *fuzz = &f->fuzz;
+
+#if defined HAVE_FGETLN
+    if (fuzz->tmp)
+        free(fuzz->tmp);
+    fuzz->tmp = NULL;
+#endif
+    for (int i = 0; i < fuzz->nchunks; ++i)
+        free(fuzz->chunks[i]);
+    fuzz->nchunks = 0;
+}
+
+static void push_free(struct files *f)
+{
+    f->next_free = NULL;
+    if (free_tail)
+        free_tail->next_free = f;
+    else
+        free_head = f;
+    free_tail = f;
+    ++nfree;
+}
+
+static struct files *pop_free(void)
+{
+    struct files *f = free_head;
+
+    free_head = f->next_free;
+    if (!free_head)
+        free_tail = NULL;
+    --nfree;
+
+    return f;
+}
 
-    /* No slot found, allocate memory */
-    if (i == nfiles)
+/* Get an unused slot from the free list, allocating a new block if
+ * necessary, or NULL if memory is exhausted. Must be called with
+ * fds_mutex held. */
+static struct files *alloc_file(void)
+{
+    /* Slots that are still held by another thread go back to the end of
+     * the list; this is rare, so we only look at each free slot once. */
+    for (int i = nfree; i > 0; --i)
     {
-        nfiles++;
-        if (files == static_files)
+        struct files *f = pop_free();
+        if (f->refs == 0)
         {
-            files = malloc(nfiles * sizeof(*files));
-            memcpy(files, static_files, nfiles * sizeof(*files));
+            clean_file(f);
+            return f;
         }
-        else
-            files = realloc(files, nfiles * sizeof(*files));
+        push_free(f);
     }
 
-    files[i].managed = 1;
-    files[i].locked = 0;
-    files[i].pos = 0;
-    files[i].fuzz.seed = seed;
-    files[i].fuzz.ratio = zzuf_get_ratio();
-    files[i].fuzz.cur = -1;
-#if defined HAVE_FGETLN
-    files[i].fuzz.tmp = NULL;
+    /* No slot found, allocate as many new slots as we already have */
+    struct file_block *n = malloc(sizeof(*n));
+    if (!n)
+        return NULL;
+    n->nfiles = nfiles;
+    n->files = malloc(n->nfiles * sizeof(*n->files));
+    if (!n->files)
+    {
+        free(n);
+        return NULL;
+    }
+    init_files(n->files, n->nfiles);
+    n->next = static_block.next;
+    static_block.next = n;
+
+    for (int i = 1; i < n->nfiles; ++i)
+        push_free(&n->files[i]);
+    nfiles += n->nfiles;
+
+    return &n->files[0];
+}
+
+void _zz_register(int fd)
+{
+    if (fd < 0)
+        return;
+
+    zzuf_mutex_lock(&fds_mutex);
+
+    /* Without memory, the descriptor is simply not watched */
+    struct files *volatile *entry = get_entry(fd);
+
+    if (!entry || *entry)
+        goto early_exit;
+
+#if defined LIBZZUF
+    if (autoinc)
+        debug2("using seed %li", (long int)seed);
 #endif
-    files[i].fuzz.uflag = 0;
+
+    struct files *f = alloc_file();
+    if (!f)
+        goto early_exit;
+
+    f->fd = fd;
+    f->managed = 1;
+    f->locked = 0;
+    f->pos = 0;
+    f->already_pos = 0;
+    f->already_fuzzed = 0;
+    f->fuzz.seed = seed;
+    f->fuzz.ratio = zzuf_get_ratio();
+    f->fuzz.hits = f->fuzz.misses = 0;
+    f->fuzz.record = NULL;
+    f->fuzz.uflag = 0;
 
     /* Check whether we should ignore the fd */
     if (list)
     {
         static int idx = 0;
 
-        files[i].active = _zz_isinrange(++idx, list);
+        f->active = _zz_isinrange(++idx, list);
     }
     else
-        files[i].active = 1;
+        f->active = 1;
 
     if (autoinc)
         seed++;
 
-    fds[fd] = i;
+    zzuf_atomic_store_ptr((void *volatile *)entry, f);
 
 early_exit:
     zzuf_mutex_unlock(&fds_mutex);
@@ -327,175 +525,221 @@ early_exit:
 
 void _zz_unregister(int fd)
 {
+    if (!get_file(fd))
+        return;
+
     zzuf_mutex_lock(&fds_mutex);
 
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
+    struct files *volatile *entry = get_entry(fd);
+    struct files *f = entry ? *entry : NULL;
+
+    if (f)
     {
-        files[fds[fd]].managed = 0;
-#if defined HAVE_FGETLN
-        if (files[fds[fd]].fuzz.tmp)
-            free(files[fds[fd]].fuzz.tmp);
+        zzuf_atomic_store_ptr((void *volatile *)entry, NULL);
+
+#if defined LIBZZUF
+        if (f->fuzz.hits || f->fuzz.misses)
+            debug2("chunk cache for %i: %lli hits, %lli misses", fd,
+                   (long long int)f->fuzz.hits, (long long int)f->fuzz.misses);
 #endif
 
-        fds[fd] = -1;
+        /* The atomic addition is also a full barrier: either a thread in
+         * _zz_fd_acquire() sees that the slot was unpublished, or we see
+         * its reference and leave the cleanup to alloc_file(). */
+        if (zzuf_atomic_add(&f->refs, 0) == 0)
+            clean_file(f);
+
+        f->managed = 0;
+        push_free(f);
     }
 
     zzuf_mutex_unlock(&fds_mutex);
 }
 
-void _zz_lockfd(int fd)
+/* Give all registered descriptors the current seed and ratio, without
+ * changing their positions. Fork server children call this because the
+ * descriptors they inherited were registered with the server's seed. */
+void _zz_fd_reseed(void)
 {
     zzuf_mutex_lock(&fds_mutex);
 
-    if (fd >= -1 && fd < maxfd && fds[fd] != -1)
+    for (int i = 0; i < table->nleaves; ++i)
     {
-        if (fd == -1)
-            ++create_lock;
-        else
-            ++files[fds[fd]].locked;
+        struct fd_leaf *leaf = table->leaves[i];
+        if (!leaf)
+            continue;
+
+        for (int j = 0; j < LEAF_SIZE; ++j)
+        {
+            struct files *f = leaf->fds[j];
+            if (!f)
+                continue;
+
+            /* Cached chunks were computed with the old seed */
+            zzuf_mutex_lock(&f->fuzz.lock);
+            for (int n = 0; n < f->fuzz.nchunks; ++n)
+                free(f->fuzz.chunks[n]);
+            f->fuzz.nchunks = 0;
+
+            f->fuzz.seed = seed;
+            f->fuzz.ratio = zzuf_get_ratio();
+            zzuf_mutex_unlock(&f->fuzz.lock);
+
+            if (autoinc)
+                seed++;
+        }
     }
 
     zzuf_mutex_unlock(&fds_mutex);
 }
 
-void _zz_unlock(int fd)
+void _zz_lockfd(int fd)
 {
-    zzuf_mutex_lock(&fds_mutex);
+    struct files *f;
 
-    if (fd >= -1 && fd < maxfd && fds[fd] != -1)
-    {
-        if (fd == -1)
-            --create_lock;
-        else
-            --files[fds[fd]].locked;
-    }
+    if (fd == -1)
+        zzuf_atomic_add(&create_lock, 1);
+    else if ((f = get_file(fd)))
+        zzuf_atomic_add(&f->locked, 1);
+}
 
-    zzuf_mutex_unlock(&fds_mutex);
+void _zz_unlock(int fd)
+{
+    struct files *f;
+
+    if (fd == -1)
+        zzuf_atomic_add(&create_lock, -1);
+    else if ((f = get_file(fd)))
+        zzuf_atomic_add(&f->locked, -1);
 }
 
 int _zz_islocked(int fd)
 {
-    int ret = 0;
-    zzuf_mutex_lock(&fds_mutex);
+    struct files *f;
 
-    if (fd >= -1 && fd < maxfd && fds[fd] != -1)
-    {
-        if (fd == -1)
-            ret = create_lock;
-        else
-            ret = files[fds[fd]].locked;
-    }
+    if (fd == -1)
+        return create_lock;
 
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+    return (f = get_file(fd)) ? f->locked : 0;
 }
 
 int _zz_isactive(int fd)
 {
-    int ret = 1;
-    zzuf_mutex_lock(&fds_mutex);
-
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
-    {
-        ret = files[fds[fd]].active;
-    }
-
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+    struct files *f = get_file(fd);
+    return f ? f->active : 1;
 }
 
 int64_t _zz_getpos(int fd)
 {
-    int64_t ret = 0;
-    zzuf_mutex_lock(&fds_mutex);
-
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
-    {
-        ret = files[fds[fd]].pos;
-    }
-
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+    struct files *f = get_file(fd);
+    return f ? f->pos : 0;
 }
 
 void _zz_setpos(int fd, int64_t pos)
 {
-    zzuf_mutex_lock(&fds_mutex);
-
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
-    {
-        files[fds[fd]].pos = pos;
-    }
-
-    zzuf_mutex_unlock(&fds_mutex);
+    struct files *f = get_file(fd);
+    if (f)
+        f->pos = pos;
 }
 
 void _zz_addpos(int fd, int64_t off)
 {
-    zzuf_mutex_lock(&fds_mutex);
+    struct files *f = get_file(fd);
+    if (f)
+        f->pos += off;
+}
+
+/*
+ *  Handle API: acquire a file descriptor once, then work on its slot
+ *  without looking it up again. The slot cannot be reused for another
+ *  file until it is released, even if the descriptor is closed.
+ */
 
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
+fd_handle_t *_zz_fd_acquire(int fd)
+{
+    for (;;)
     {
-        files[fds[fd]].pos += off;
+        struct files *f = get_file(fd);
+        if (!f)
+            return NULL;
+
+        /* Make sure the slot was not unregistered before we pinned it */
+        zzuf_atomic_add(&f->refs, 1);
+        if (get_file(fd) == f)
+            return f;
+        zzuf_atomic_add(&f->refs, -1);
     }
+}
 
-    zzuf_mutex_unlock(&fds_mutex);
+void _zz_fd_release(fd_handle_t *f)
+{
+    zzuf_atomic_add(&f->refs, -1);
 }
 
-void _zz_setfuzzed(int fd, int count)
+int _zz_fd_getfd(fd_handle_t const *f)
 {
-    zzuf_mutex_lock(&fds_mutex);
+    return f->fd;
+}
 
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
-    {
-        /* FIXME: what if we just slightly advanced? */
-        if (files[fds[fd]].pos != files[fds[fd]].already_pos
-            || count > files[fds[fd]].already_fuzzed)
-        {
-#if defined LIBZZUF
-            debug2("setfuzzed(%i, %i)", fd, count);
-#endif
+void _zz_fd_lock(fd_handle_t *f)
+{
+    zzuf_atomic_add(&f->locked, 1);
+}
 
-            files[fds[fd]].already_pos = files[fds[fd]].pos;
-            files[fds[fd]].already_fuzzed = count;
-        }
-    }
+void _zz_fd_unlock(fd_handle_t *f)
+{
+    zzuf_atomic_add(&f->locked, -1);
+}
 
-    zzuf_mutex_unlock(&fds_mutex);
+int _zz_fd_islocked(fd_handle_t const *f)
+{
+    return f->locked;
 }
 
-int _zz_getfuzzed(int fd)
+int _zz_fd_isactive(fd_handle_t const *f)
 {
-    int ret = 0;
-    zzuf_mutex_lock(&fds_mutex);
+    return f->active;
+}
 
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
-    {
-        if (files[fds[fd]].pos >= files[fds[fd]].already_pos
-             && files[fds[fd]].pos < files[fds[fd]].already_pos
-                                      + files[fds[fd]].already_fuzzed)
-            ret = (int)(files[fds[fd]].already_fuzzed
-                      + files[fds[fd]].already_pos
-                      - files[fds[fd]].pos);
-    }
+int64_t _zz_fd_getpos(fd_handle_t const *f)
+{
+    return f->pos;
+}
 
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+void _zz_fd_setpos(fd_handle_t *f, int64_t pos)
+{
+    f->pos = pos;
 }
 
-/* FIXME: this is not safe because once we unlock fds_mutex the structure
- * may become invalid */
-fuzz_context_t *_zz_getfuzz(int fd)
+void _zz_fd_addpos(fd_handle_t *f, int64_t off)
 {
-    fuzz_context_t *ret = NULL;
-    zzuf_mutex_lock(&fds_mutex);
+    f->pos += off;
+}
 
-    if (fd >= 0 && fd < maxfd && fds[fd] != -1)
+void _zz_fd_setfuzzed(fd_handle_t *f, int count)
+{
+    /* FIXME: what if we just slightly advanced? */
+    if (f->pos != f->already_pos || count > f->already_fuzzed)
     {
-        ret = &files[fds[fd]].fuzz;
+#if defined LIBZZUF
+        debug2("setfuzzed(%i, %i)", f->fd, count);
+#endif
+
+        f->already_pos = f->pos;
+        f->already_fuzzed = count;
     }
+}
 
-    zzuf_mutex_unlock(&fds_mutex);
-    return ret;
+int _zz_fd_getfuzzed(fd_handle_t const *f)
+{
+    if (f->pos >= f->already_pos
+         && f->pos < f->already_pos + f->already_fuzzed)
+        return (int)(f->already_fuzzed + f->already_pos - f->pos);
+
+    return 0;
 }
 
+fuzz_context_t *_zz_fd_getfuzz(fd_handle_t *f)
+{
+    return &f->fuzz;
+}
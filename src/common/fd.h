@@ -18,16 +18,11 @@
  */
 
 #include "common/common.h"
+#include "libzzuf/zzuf.h"
 
 #include <stdint.h>
 #include <wchar.h>
 
-extern void zzuf_include_pattern(char const *);
-extern void zzuf_exclude_pattern(char const *);
-extern void zzuf_set_seed(int32_t);
-extern void zzuf_set_ratio(double, double);
-extern double zzuf_get_ratio(void);
-extern void zzuf_set_auto_increment(void);
 extern void _zz_fd_init(void);
 extern void _zz_fd_fini(void);
 
@@ -36,6 +31,7 @@ extern int _zz_mustwatchw(wchar_t const *);
 extern int _zz_iswatched(int);
 extern void _zz_register(int);
 extern void _zz_unregister(int);
+extern void _zz_fd_reseed(void);
 extern void _zz_lockfd(int);
 extern void _zz_unlock(int);
 extern int _zz_islocked(int);
@@ -43,8 +39,18 @@ extern int _zz_isactive(int);
 extern int64_t _zz_getpos(int);
 extern void _zz_setpos(int, int64_t);
 extern void _zz_addpos(int, int64_t);
-extern void _zz_setfuzzed(int, int);
-extern int _zz_getfuzzed(int);
 
-extern fuzz_context_t *_zz_getfuzz(int);
+extern fd_handle_t *_zz_fd_acquire(int);
+extern void _zz_fd_release(fd_handle_t *);
+extern int _zz_fd_getfd(fd_handle_t const *);
+extern void _zz_fd_lock(fd_handle_t *);
+extern void _zz_fd_unlock(fd_handle_t *);
+extern int _zz_fd_islocked(fd_handle_t const *);
+extern int _zz_fd_isactive(fd_handle_t const *);
+extern int64_t _zz_fd_getpos(fd_handle_t const *);
+extern void _zz_fd_setpos(fd_handle_t *, int64_t);
+extern void _zz_fd_addpos(fd_handle_t *, int64_t);
+extern void _zz_fd_setfuzzed(fd_handle_t *, int);
+extern int _zz_fd_getfuzzed(fd_handle_t const *);
+extern fuzz_context_t *_zz_fd_getfuzz(fd_handle_t *);
 
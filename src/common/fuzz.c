@@ -30,30 +30,65 @@
 #include "fuzz.h"
 #include "fd.h"
 #include "ranges.h"
+#include "kernel.h"
 #if defined LIBZZUF
 #   include "debug.h"
 #endif
+#include "util/mutex.h"
 
 #define MAGIC1 0x33ea84f7
 #define MAGIC2 0x783bc31f
 #define MAGIC3 0x9b5da2fb
 
+/* Above this many bit flips per chunk, building a full bitmask and
+ * scanning it is cheaper than keeping the flip list sorted. */
+#define SPARSE_FLIPS 64
+
 /* Fuzzing mode */
-static enum fuzzing
+static enum fuzzing fuzzing;
+
+/* Mask generator: the legacy one draws flips from zzuf_rand_r() one after
+ * the other, the counter one computes each flip from its index alone. */
+static enum generator
 {
-    FUZZING_XOR = 0, FUZZING_SET, FUZZING_UNSET
+    GENERATOR_LEGACY = 0, GENERATOR_COUNTER
 }
-fuzzing;
+generator;
 
-/* Per-offset byte protection */
+/* Per-offset byte protection, as sorted and merged ranges */
 static int64_t *ranges = NULL;
 static int64_t static_ranges[512];
+static int nranges = 0;
 
 /* Per-value byte protection */
 static unsigned char protect[256];
 static unsigned char refuse[256];
 
+/* Kernels for the current settings, chosen again whenever they change */
+typedef void (*sparse_kernel_t)(volatile uint8_t *,
+                                struct fuzz_chunk const *,
+                                int, int64_t, int64_t);
+static sparse_kernel_t sparse_kernel = NULL;
+static zzuf_kernel_t dense_kernel = NULL;
+/* Cleared with a release store once the kernels are selected, so that
+ * threads seeing it clear also see the kernels */
+static volatile int kernels_dirty = 1;
+static zzuf_mutex_t kernels_mutex = ZZUF_MUTEX_INIT("kernels");
+
+/* Number of chunks cached per file descriptor */
+static int chunk_cache = DEFAULT_CHUNK_CACHE;
+
 /* Local prototypes */
+static void fuzz_chunk_span(fuzz_context_t *, volatile uint8_t *, int64_t,
+                            int64_t, int64_t);
+static struct fuzz_chunk *get_chunk(fuzz_context_t *, int64_t);
+static void make_chunk(struct fuzz_chunk *, fuzz_context_t const *, int64_t);
+static void check_kernels(void);
+static void select_kernels(void);
+static void apply_span(volatile uint8_t *, struct fuzz_chunk const *,
+                       int64_t, int64_t);
+static void record_span(fuzz_record_t *, struct fuzz_chunk const *,
+                        int64_t, int64_t);
 static void add_char_range(unsigned char *, char const *);
 
 extern void _zz_fuzzing(char const *mode)
@@ -64,120 +99,517 @@ extern void _zz_fuzzing(char const *mode)
         fuzzing = FUZZING_SET;
     else if (!strcmp(mode, "unset"))
         fuzzing = FUZZING_UNSET;
+    zzuf_atomic_store_int(&kernels_dirty, 1);
+}
+
+void _zz_generator(char const *name)
+{
+    if (!strcmp(name, "legacy"))
+        generator = GENERATOR_LEGACY;
+    else if (!strcmp(name, "counter"))
+        generator = GENERATOR_COUNTER;
+}
+
+void _zz_chunk_cache(int count)
+{
+    chunk_cache = count < 1 ? 1
+                : count > MAX_CHUNK_CACHE ? MAX_CHUNK_CACHE : count;
 }
 
 void _zz_bytes(char const *list)
 {
     /* TODO: free(ranges) if ranges != static_ranges */
     ranges = _zz_allocrange(list, static_ranges);
+    nranges = _zz_mergerange(ranges);
 }
 
 void zzuf_protect_range(char const *list)
 {
     add_char_range(protect, list);
+    zzuf_atomic_store_int(&kernels_dirty, 1);
 }
 
 void zzuf_refuse_range(char const *list)
 {
     add_char_range(refuse, list);
+    zzuf_atomic_store_int(&kernels_dirty, 1);
 }
 
 void _zz_fuzz(int fd, volatile uint8_t *buf, int64_t len)
 {
-    int64_t pos = _zz_getpos(fd);
+    fd_handle_t *h = _zz_fd_acquire(fd);
+    if (!h)
+        return;
+
+    _zz_fd_fuzz(h, buf, len);
+    _zz_fd_release(h);
+}
+
+void _zz_fd_fuzz(fd_handle_t *h, volatile uint8_t *buf, int64_t len)
+{
+    int64_t pos = _zz_fd_getpos(h);
 
 #if defined LIBZZUF
-    debug2("... fuzz(%i, @%lli, %lli)", fd, (long long int)pos,
+    debug2("... fuzz(%i, @%lli, %lli)", _zz_fd_getfd(h), (long long int)pos,
            (long long int)len);
 #endif
 
+    fuzz_context_t *fuzz = _zz_fd_getfuzz(h);
+
+    _zz_fuzz_buffer(fuzz, pos, buf, len);
+
+    /* Handle ungetc() */
+    if (fuzz->uflag)
+    {
+        fuzz->uflag = 0;
+        if (fuzz->upos == pos)
+            buf[0] = fuzz->uchar;
+    }
+}
+
+/* Fuzz a buffer holding the data found at offset “pos” of a file, using
+ * the given context instead of looking up a file descriptor. */
+void _zz_fuzz_buffer(fuzz_context_t *fuzz, int64_t pos,
+                     volatile uint8_t *buf, int64_t len)
+{
     volatile uint8_t *aligned_buf = buf - pos;
-    fuzz_context_t *fuzz = _zz_getfuzz(fd);
 
-    for (int64_t i = pos / CHUNKBYTES;
-         i < (pos + len + CHUNKBYTES - 1) / CHUNKBYTES;
-         ++i)
+    check_kernels();
+
+    if (!ranges)
     {
-        /* Cache bitmask array */
-        if (fuzz->cur != (int)i)
+        for (int64_t i = pos / CHUNKBYTES;
+             i < (pos + len + CHUNKBYTES - 1) / CHUNKBYTES;
+             ++i)
         {
-            uint32_t chunkseed;
-
-            chunkseed = (uint32_t)i;
-            chunkseed ^= MAGIC2;
-            chunkseed += (uint32_t)(fuzz->ratio * MAGIC1);
-            chunkseed ^= fuzz->seed;
-            chunkseed += (uint32_t)(i * MAGIC3);
+            /* Apply our bitmask array to the buffer */
+            int64_t start = (i * CHUNKBYTES > pos) ? i * CHUNKBYTES : pos;
+            int64_t stop = ((i + 1) * CHUNKBYTES < pos + len)
+                          ? (i + 1) * CHUNKBYTES : pos + len;
 
-            zzuf_srand(chunkseed);
+            fuzz_chunk_span(fuzz, aligned_buf, i, start, stop);
+        }
+    }
+    else
+    {
+        /* Find the first range that ends after “pos” */
+        int r = 0, r1 = nranges;
+        while (r < r1)
+        {
+            int mid = (r + r1) / 2;
+            if (ranges[mid * 2 + 1] <= pos)
+                r = mid + 1;
+            else
+                r1 = mid;
+        }
 
-            memset(fuzz->data, 0, CHUNKBYTES);
+        /* Walk the ranges that intersect the buffer, and only generate
+         * bitmasks for the chunks they cover. */
+        for ( ; r < nranges && ranges[r * 2] < pos + len; ++r)
+        {
+            int64_t start = ranges[r * 2] > pos ? ranges[r * 2] : pos;
+            int64_t stop = ranges[r * 2 + 1] < pos + len
+                         ? ranges[r * 2 + 1] : pos + len;
 
-            /* Add some random dithering to handle ratio < 1.0/CHUNKBYTES */
-            int todo = (int)((fuzz->ratio * (8 * CHUNKBYTES) * 1000000.0
-                                + zzuf_rand(1000000)) / 1000000.0);
-            while (todo--)
+            while (start < stop)
             {
-                unsigned int idx = zzuf_rand(CHUNKBYTES);
-                uint8_t bit = (1 << zzuf_rand(8));
+                int64_t i = start / CHUNKBYTES;
+                int64_t end = (i + 1) * CHUNKBYTES < stop
+                            ? (i + 1) * CHUNKBYTES : stop;
 
-                fuzz->data[idx] ^= bit;
+                fuzz_chunk_span(fuzz, aligned_buf, i, start, end);
+                start = end;
             }
-
-            fuzz->cur = i;
         }
+    }
+}
 
-        /* Apply our bitmask array to the buffer */
-        int64_t start = (i * CHUNKBYTES > pos) ? i * CHUNKBYTES : pos;
-        int64_t stop = ((i + 1) * CHUNKBYTES < pos + len)
-                      ? (i + 1) * CHUNKBYTES : pos + len;
+/* Fill the chunk cache of a context ahead of time, so that fuzzing with it
+ * no longer allocates memory, e.g. from a signal handler. The new chunks
+ * have an index that no data has. Return -1 if memory is exhausted. */
+int _zz_fuzz_reserve(fuzz_context_t *fuzz)
+{
+    check_kernels();
 
-        for (int64_t j = start; j < stop; ++j)
-        {
-            uint8_t byte, fuzzbyte;
+    zzuf_mutex_lock(&fuzz->lock);
+    while (fuzz->nchunks < chunk_cache)
+    {
+        struct fuzz_chunk *chunk = malloc(sizeof(struct fuzz_chunk));
+        if (!chunk)
+            break;
 
-            if (ranges && !_zz_isinrange(j, ranges))
-                continue; /* Not in one of the ranges, skip byte */
+        chunk->index = -1;
+        fuzz->chunks[fuzz->nchunks++] = chunk;
+    }
+    zzuf_mutex_unlock(&fuzz->lock);
 
-            byte = aligned_buf[j];
+    return fuzz->nchunks < chunk_cache ? -1 : 0;
+}
 
-            if (protect[byte])
-                continue;
+/* Fuzz the bytes of the buffer between offsets “start” and “stop”, which
+ * must belong to chunk i. The context lock is held until the bitmask has
+ * been applied, because another thread may otherwise recycle it. */
+static void fuzz_chunk_span(fuzz_context_t *fuzz,
+                            volatile uint8_t *aligned_buf, int64_t i,
+                            int64_t start, int64_t stop)
+{
+    zzuf_mutex_lock(&fuzz->lock);
 
-            fuzzbyte = fuzz->data[j % CHUNKBYTES];
+    struct fuzz_chunk *chunk = get_chunk(fuzz, i);
+    if (chunk)
+    {
+        apply_span(aligned_buf, chunk, start, stop);
+        if (fuzz->record)
+            record_span(fuzz->record, chunk, start, stop);
+    }
 
-            if (!fuzzbyte)
-                continue;
+    zzuf_mutex_unlock(&fuzz->lock);
+}
+
+/* Apply a chunk bitmask to the bytes of the buffer between offsets
+ * “start” and “stop”, which must belong to the chunk. */
+static void apply_span(volatile uint8_t *aligned_buf,
+                       struct fuzz_chunk const *chunk,
+                       int64_t start, int64_t stop)
+{
+    int64_t base = chunk->index * CHUNKBYTES;
+
+    /* Dense chunks are processed a whole vector at a time */
+    if (chunk->dense && dense_kernel)
+    {
+        dense_kernel(aligned_buf + start, chunk->data + (start - base),
+                     stop - start);
+        return;
+    }
+
+    /* Otherwise only visit the altered bytes: look for the first one
+     * at or after “start”, then walk the list until we reach “stop”. */
+    int k = 0, k1 = chunk->nflips;
+    while (k < k1)
+    {
+        int mid = (k + k1) / 2;
+        if (base + chunk->flipoff[mid] < start)
+            k = mid + 1;
+        else
+            k1 = mid;
+    }
+
+    sparse_kernel(aligned_buf, chunk, k, base, stop);
+}
 
-            switch (fuzzing)
+/* Log the offsets of the bytes between “start” and “stop” that the chunk
+ * may have altered, growing the list as needed. */
+static void record_span(fuzz_record_t *record, struct fuzz_chunk const *chunk,
+                        int64_t start, int64_t stop)
+{
+    int64_t base = chunk->index * CHUNKBYTES;
+
+    for (int k = 0; k < chunk->nflips && record->count >= 0; ++k)
+    {
+        int64_t j = base + chunk->flipoff[k];
+
+        if (j < start)
+            continue;
+        if (j >= stop)
+            break;
+
+        if (record->count == record->size)
+        {
+            int64_t size = record->size ? record->size * 2 : 1024;
+            if (size > record->max)
+                size = record->max;
+
+            int64_t *tmp = NULL;
+            if (size > record->size)
+                tmp = realloc(record->offsets, size * sizeof(*tmp));
+
+            /* Too many offsets: give up */
+            if (!tmp)
             {
-            case FUZZING_XOR:
-                byte ^= fuzzbyte;
-                break;
-            case FUZZING_SET:
-                byte |= fuzzbyte;
-                break;
-            case FUZZING_UNSET:
-                byte &= ~fuzzbyte;
+                record->count = -1;
                 break;
             }
 
-            if (refuse[byte])
-                continue;
+            record->offsets = tmp;
+            record->size = size;
+        }
+
+        record->offsets[record->count++] = j;
+    }
+}
+
+/* Apply the flips of a chunk starting at list index k, until offset
+ * “stop” is reached. There is one such function for each combination
+ * of fuzzing mode, protected bytes and refused bytes, so that the
+ * settings are not checked again for every byte. */
+#define SPARSE_KERNEL(name, mode, has_protect, has_refuse) \
+    static void name(volatile uint8_t *aligned_buf, \
+                     struct fuzz_chunk const *chunk, int k, \
+                     int64_t base, int64_t stop) \
+    { \
+        for ( ; k < chunk->nflips; ++k) \
+        { \
+            int64_t j = base + chunk->flipoff[k]; \
+            uint8_t byte; \
+            \
+            if (j >= stop) \
+                break; \
+            \
+            byte = aligned_buf[j]; \
+            \
+            if (has_protect && protect[byte]) \
+                continue; \
+            \
+            switch (mode) \
+            { \
+            case FUZZING_XOR: \
+                byte ^= chunk->flipmask[k]; \
+                break; \
+            case FUZZING_SET: \
+                byte |= chunk->flipmask[k]; \
+                break; \
+            case FUZZING_UNSET: \
+                byte &= ~chunk->flipmask[k]; \
+                break; \
+            } \
+            \
+            if (has_refuse && refuse[byte]) \
+                continue; \
+            \
+            aligned_buf[j] = byte; \
+        } \
+    }
+
+#define SPARSE_VARIANTS(name, mode) \
+    SPARSE_KERNEL(sparse_##name##_00, mode, 0, 0) \
+    SPARSE_KERNEL(sparse_##name##_01, mode, 0, 1) \
+    SPARSE_KERNEL(sparse_##name##_10, mode, 1, 0) \
+    SPARSE_KERNEL(sparse_##name##_11, mode, 1, 1)
+
+#define SPARSE_TABLE(name) \
+    { { sparse_##name##_00, sparse_##name##_01 }, \
+      { sparse_##name##_10, sparse_##name##_11 } }
 
-            aligned_buf[j] = byte;
+SPARSE_VARIANTS(xor, FUZZING_XOR)
+SPARSE_VARIANTS(set, FUZZING_SET)
+SPARSE_VARIANTS(unset, FUZZING_UNSET)
+
+static sparse_kernel_t const sparse_kernels[3][2][2] =
+{
+    SPARSE_TABLE(xor),
+    SPARSE_TABLE(set),
+    SPARSE_TABLE(unset),
+};
+
+/* Select the fuzzing kernels if the settings changed since last time.
+ * Several threads may get here first at the same time. */
+static void check_kernels(void)
+{
+    if (zzuf_atomic_load_int(&kernels_dirty))
+    {
+        zzuf_mutex_lock(&kernels_mutex);
+        if (kernels_dirty)
+            select_kernels();
+        zzuf_mutex_unlock(&kernels_mutex);
+    }
+}
+
+static void select_kernels(void)
+{
+    int has_protect = 0, has_refuse = 0;
+
+    for (int i = 0; i < 256; ++i)
+    {
+        has_protect |= protect[i];
+        has_refuse |= refuse[i];
+    }
+
+    sparse_kernel = sparse_kernels[fuzzing][has_protect][has_refuse];
+    dense_kernel = _zz_dense_kernel(fuzzing, protect, refuse);
+
+    zzuf_atomic_store_int(&kernels_dirty, 0);
+}
+
+/* Return the bitmask of chunk i, from the cache if possible. The cache
+ * is a short list kept in most recently used order; on a miss, the
+ * least recently used chunk is recycled once the list is full or if
+ * memory is exhausted. Returns NULL if there is no chunk to recycle.
+ * Must be called with the context lock held. */
+static struct fuzz_chunk *get_chunk(fuzz_context_t *fuzz, int64_t i)
+{
+    struct fuzz_chunk *chunk;
+    int n;
+
+    for (n = 0; n < fuzz->nchunks; ++n)
+        if (fuzz->chunks[n]->index == i)
+            break;
+
+    if (n < fuzz->nchunks)
+    {
+        chunk = fuzz->chunks[n];
+        ++fuzz->hits;
+    }
+    else
+    {
+        chunk = fuzz->nchunks < chunk_cache
+              ? malloc(sizeof(struct fuzz_chunk)) : NULL;
+
+        if (chunk)
+        {
+            n = fuzz->nchunks++;
+            fuzz->chunks[n] = chunk;
+        }
+        else if (fuzz->nchunks)
+        {
+            n = fuzz->nchunks - 1;
+            chunk = fuzz->chunks[n];
         }
+        else
+            return NULL;
+
+        make_chunk(chunk, fuzz, i);
+        ++fuzz->misses;
     }
 
-    /* Handle ungetc() */
-    if (fuzz->uflag)
+    memmove(fuzz->chunks + 1, fuzz->chunks, n * sizeof(*fuzz->chunks));
+    fuzz->chunks[0] = chunk;
+
+    return chunk;
+}
+
+/* Get the byte and the bit altered by the nth flip of a chunk */
+static inline void get_flip(uint32_t *state, uint64_t key, int n,
+                            unsigned int *idx, uint8_t *bit)
+{
+    if (generator == GENERATOR_COUNTER)
     {
-        fuzz->uflag = 0;
-        if (fuzz->upos == pos)
-            buf[0] = fuzz->uchar;
+        uint64_t r = zzuf_crand(key, (uint64_t)n + 1);
+        *idx = (unsigned int)(r % CHUNKBYTES);
+        *bit = (uint8_t)(1 << ((r >> 32) & 7));
+    }
+    else
+    {
+        *idx = zzuf_rand_r(state, CHUNKBYTES);
+        *bit = (uint8_t)(1 << zzuf_rand_r(state, 8));
     }
 }
 
+/* Compute the list of bit flips for chunk i. The random sequence is the
+ * same as when the whole chunk bitmask was stored: pick a byte, pick a
+ * bit, toggle it. Flipping the same bit twice cancels out, so bytes that
+ * end up with an empty mask are not stored. */
+static void make_chunk(struct fuzz_chunk *chunk,
+                       fuzz_context_t const *fuzz, int64_t i)
+{
+    /* The generator state is local, so that threads fuzzing different
+     * files at the same time do not interfere. */
+    uint32_t state = 0;
+    uint64_t key = 0;
+    uint32_t dither;
+
+    if (generator == GENERATOR_COUNTER)
+    {
+        /* Each flip only depends on the seed, the ratio, the chunk
+         * index and its own index in the chunk. */
+        uint64_t ratiobits;
+
+        memcpy(&ratiobits, &fuzz->ratio, sizeof(ratiobits));
+        key = zzuf_crand(zzuf_crand(fuzz->seed, ratiobits), (uint64_t)i);
+        dither = (uint32_t)(zzuf_crand(key, 0) % 1000000);
+    }
+    else
+    {
+        uint32_t chunkseed;
+
+        chunkseed = (uint32_t)i;
+        chunkseed ^= MAGIC2;
+        chunkseed += (uint32_t)(fuzz->ratio * MAGIC1);
+        chunkseed ^= fuzz->seed;
+        chunkseed += (uint32_t)(i * MAGIC3);
+
+        zzuf_srand_r(&state, chunkseed);
+        dither = zzuf_rand_r(&state, 1000000);
+    }
+
+    /* Add some random dithering to handle ratio < 1.0/CHUNKBYTES */
+    int todo = (int)((fuzz->ratio * (8 * CHUNKBYTES) * 1000000.0
+                        + dither) / 1000000.0);
+    int n = 0;
+
+    if (todo > SPARSE_FLIPS)
+    {
+        /* Dense chunk: use a full bitmask, then list its nonzero bytes */
+        uint8_t *data = chunk->data;
+
+        memset(data, 0, CHUNKBYTES);
+
+        for (int f = 0; f < todo; ++f)
+        {
+            unsigned int idx;
+            uint8_t bit;
+
+            get_flip(&state, key, f, &idx, &bit);
+            data[idx] ^= bit;
+        }
+
+        for (int j = 0; j < CHUNKBYTES; ++j)
+        {
+            if (!data[j])
+                continue;
+            chunk->flipoff[n] = (uint16_t)j;
+            chunk->flipmask[n] = data[j];
+            ++n;
+        }
+
+        chunk->dense = 1;
+    }
+    else
+    {
+        /* Sparse chunk: keep the list sorted as we go */
+        for (int f = 0; f < todo; ++f)
+        {
+            unsigned int idx;
+            uint8_t bit;
+
+            get_flip(&state, key, f, &idx, &bit);
+
+            int j = n;
+            while (j > 0 && chunk->flipoff[j - 1] > idx)
+                --j;
+
+            if (j > 0 && chunk->flipoff[j - 1] == idx)
+            {
+                chunk->flipmask[j - 1] ^= bit;
+                continue;
+            }
+
+            memmove(chunk->flipoff + j + 1, chunk->flipoff + j,
+                    (n - j) * sizeof(*chunk->flipoff));
+            memmove(chunk->flipmask + j + 1, chunk->flipmask + j,
+                    (n - j) * sizeof(*chunk->flipmask));
+            chunk->flipoff[j] = (uint16_t)idx;
+            chunk->flipmask[j] = bit;
+            ++n;
+        }
+
+        /* Drop bytes whose flips cancelled each other */
+        int m = 0;
+        for (int j = 0; j < n; ++j)
+        {
+            if (!chunk->flipmask[j])
+                continue;
+            chunk->flipoff[m] = chunk->flipoff[j];
+            chunk->flipmask[m] = chunk->flipmask[j];
+            ++m;
+        }
+        n = m;
+        chunk->dense = 0;
+    }
+
+    chunk->index = i;
+    chunk->nflips = n;
+}
+
 static void add_char_range(unsigned char *table, char const *list)
 {
     static char const hex[] = "0123456789abcdef0123456789ABCDEF";
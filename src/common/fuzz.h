@@ -16,11 +16,18 @@
  *  fuzz.h: fuzz functions
  */
 
+#include "common/common.h"
+#include "libzzuf/zzuf.h"
+
 extern void _zz_fuzzing(char const *);
+extern void _zz_generator(char const *);
+extern void _zz_chunk_cache(int);
 extern void _zz_bytes(char const *);
 extern void _zz_list(char const *);
-extern void zzuf_protect_range(char const *);
-extern void zzuf_refuse_range(char const *);
 
 extern void _zz_fuzz(int, volatile uint8_t *, int64_t);
+extern void _zz_fd_fuzz(fd_handle_t *, volatile uint8_t *, int64_t);
+extern void _zz_fuzz_buffer(fuzz_context_t *, int64_t,
+                            volatile uint8_t *, int64_t);
+extern int _zz_fuzz_reserve(fuzz_context_t *);
 
@@ -0,0 +1,259 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  kernel.c: mask application kernels
+ */
+
+#include "config.h"
+
+#if defined HAVE_STDINT_H
+#   include <stdint.h>
+#elif defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#if defined HAVE_X86_DISPATCH
+#   include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "kernel.h"
+
+/* Byte classes, as a 256-entry table for scalar code and as a bit matrix
+ * for vector code: for a byte whose high nibble is h and low nibble is l,
+ * bit (h & 7) of lut[h >> 3][l] is set if the byte is in the class. */
+static uint8_t const *protect_table, *refuse_table;
+static uint8_t protect_lut[2][16], refuse_lut[2][16];
+
+static void build_lut(uint8_t lut[2][16], uint8_t const *table)
+{
+    memset(lut, 0, 2 * 16);
+    for (int i = 0; i < 256; ++i)
+        if (table[i])
+            lut[i >> 7][i & 0xf] |= 1 << ((i >> 4) & 7);
+}
+
+/* Apply a mask to a single byte; used for buffer tails */
+static inline void apply_byte(volatile uint8_t *p, uint8_t mask,
+                              enum fuzzing mode, int protect, int refuse)
+{
+    uint8_t byte = *p;
+
+    if (!mask || (protect && protect_table[byte]))
+        return;
+
+    switch (mode)
+    {
+    case FUZZING_XOR:
+        byte ^= mask;
+        break;
+    case FUZZING_SET:
+        byte |= mask;
+        break;
+    case FUZZING_UNSET:
+        byte &= ~mask;
+        break;
+    }
+
+    if (refuse && refuse_table[byte])
+        return;
+
+    *p = byte;
+}
+
+#if defined HAVE_X86_DISPATCH
+
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+/* Return 0xff for each byte of b that is in the class described by lut */
+static inline TARGET_SSSE3 __m128i lookup_ssse3(__m128i b,
+                                                uint8_t const lut[2][16])
+{
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i lo = _mm_and_si128(b, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble);
+    __m128i row0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)lut[0]), lo);
+    __m128i row1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)lut[1]), lo);
+    __m128i upper = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+    __m128i row = _mm_or_si128(_mm_andnot_si128(upper, row0),
+                               _mm_and_si128(upper, row1));
+    __m128i bit = _mm_shuffle_epi8(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                                 1, 2, 4, 8, 16, 32, 64, -128),
+                                   hi);
+    return _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+}
+
+static inline TARGET_AVX2 __m256i lookup_avx2(__m256i b,
+                                              uint8_t const lut[2][16])
+{
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(b, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble);
+    __m256i lut0 = _mm256_broadcastsi128_si256(
+                       _mm_loadu_si128((__m128i const *)lut[0]));
+    __m256i lut1 = _mm256_broadcastsi128_si256(
+                       _mm_loadu_si128((__m128i const *)lut[1]));
+    __m256i row0 = _mm256_shuffle_epi8(lut0, lo);
+    __m256i row1 = _mm256_shuffle_epi8(lut1, lo);
+    __m256i upper = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+    __m256i row = _mm256_blendv_epi8(row0, row1, upper);
+    __m256i bit = _mm256_shuffle_epi8(
+                      _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128), hi);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+}
+
+#define OP_SSSE3(mode, b, m) \
+    ((mode) == FUZZING_XOR ? _mm_xor_si128(b, m) \
+      : (mode) == FUZZING_SET ? _mm_or_si128(b, m) : _mm_andnot_si128(m, b))
+
+#define OP_AVX2(mode, b, m) \
+    ((mode) == FUZZING_XOR ? _mm256_xor_si256(b, m) \
+      : (mode) == FUZZING_SET ? _mm256_or_si256(b, m) \
+      : _mm256_andnot_si256(m, b))
+
+/* A byte whose mask is zero is left unchanged by all three operations,
+ * so we can blindly compute the new value for the whole vector. Bytes
+ * that are protected before fuzzing or refused after fuzzing are then
+ * restored from the original vector. */
+#define DENSE_SSSE3(name, mode, protect, refuse) \
+    static TARGET_SSSE3 void name(volatile uint8_t *buf, \
+                                  uint8_t const *mask, int64_t len) \
+    { \
+        uint8_t *p = (uint8_t *)(uintptr_t)buf; \
+        int64_t i = 0; \
+        for ( ; i + 16 <= len; i += 16) \
+        { \
+            __m128i b = _mm_loadu_si128((__m128i const *)(p + i)); \
+            __m128i m = _mm_loadu_si128((__m128i const *)(mask + i)); \
+            __m128i nb = OP_SSSE3(mode, b, m); \
+            if (protect || refuse) \
+            { \
+                __m128i skip = _mm_setzero_si128(); \
+                if (protect) \
+                    skip = _mm_or_si128(skip, lookup_ssse3(b, protect_lut)); \
+                if (refuse) \
+                    skip = _mm_or_si128(skip, lookup_ssse3(nb, refuse_lut)); \
+                nb = _mm_or_si128(_mm_and_si128(skip, b), \
+                                  _mm_andnot_si128(skip, nb)); \
+            } \
+            _mm_storeu_si128((__m128i *)(p + i), nb); \
+        } \
+        for ( ; i < len; ++i) \
+            apply_byte(buf + i, mask[i], mode, protect, refuse); \
+    }
+
+#define DENSE_AVX2(name, mode, protect, refuse) \
+    static TARGET_AVX2 void name(volatile uint8_t *buf, \
+                                 uint8_t const *mask, int64_t len) \
+    { \
+        uint8_t *p = (uint8_t *)(uintptr_t)buf; \
+        int64_t i = 0; \
+        for ( ; i + 32 <= len; i += 32) \
+        { \
+            __m256i b = _mm256_loadu_si256((__m256i const *)(p + i)); \
+            __m256i m = _mm256_loadu_si256((__m256i const *)(mask + i)); \
+            __m256i nb = OP_AVX2(mode, b, m); \
+            if (protect || refuse) \
+            { \
+                __m256i skip = _mm256_setzero_si256(); \
+                if (protect) \
+                    skip = _mm256_or_si256(skip, lookup_avx2(b, protect_lut)); \
+                if (refuse) \
+                    skip = _mm256_or_si256(skip, lookup_avx2(nb, refuse_lut)); \
+                nb = _mm256_blendv_epi8(nb, b, skip); \
+            } \
+            _mm256_storeu_si256((__m256i *)(p + i), nb); \
+        } \
+        for ( ; i < len; ++i) \
+            apply_byte(buf + i, mask[i], mode, protect, refuse); \
+    }
+
+/* One kernel for each combination of mode, protected bytes present and
+ * refused bytes present */
+#define DENSE_VARIANTS(isa, macro) \
+    macro(dense_##isa##_xor_00, FUZZING_XOR, 0, 0) \
+    macro(dense_##isa##_xor_01, FUZZING_XOR, 0, 1) \
+    macro(dense_##isa##_xor_10, FUZZING_XOR, 1, 0) \
+    macro(dense_##isa##_xor_11, FUZZING_XOR, 1, 1) \
+    macro(dense_##isa##_set_00, FUZZING_SET, 0, 0) \
+    macro(dense_##isa##_set_01, FUZZING_SET, 0, 1) \
+    macro(dense_##isa##_set_10, FUZZING_SET, 1, 0) \
+    macro(dense_##isa##_set_11, FUZZING_SET, 1, 1) \
+    macro(dense_##isa##_unset_00, FUZZING_UNSET, 0, 0) \
+    macro(dense_##isa##_unset_01, FUZZING_UNSET, 0, 1) \
+    macro(dense_##isa##_unset_10, FUZZING_UNSET, 1, 0) \
+    macro(dense_##isa##_unset_11, FUZZING_UNSET, 1, 1)
+
+#define DENSE_TABLE(isa) \
+    { \
+        { { dense_##isa##_xor_00, dense_##isa##_xor_01 }, \
+          { dense_##isa##_xor_10, dense_##isa##_xor_11 } }, \
+        { { dense_##isa##_set_00, dense_##isa##_set_01 }, \
+          { dense_##isa##_set_10, dense_##isa##_set_11 } }, \
+        { { dense_##isa##_unset_00, dense_##isa##_unset_01 }, \
+          { dense_##isa##_unset_10, dense_##isa##_unset_11 } }, \
+    }
+
+DENSE_VARIANTS(ssse3, DENSE_SSSE3)
+DENSE_VARIANTS(avx2, DENSE_AVX2)
+
+static zzuf_kernel_t const dense_ssse3[3][2][2] = DENSE_TABLE(ssse3);
+static zzuf_kernel_t const dense_avx2[3][2][2] = DENSE_TABLE(avx2);
+
+#endif
+
+/* Pick the best dense kernel for the current CPU and settings. Return
+ * NULL if there is no vector kernel, in which case the caller should
+ * walk the sparse flip list instead. The ZZUF_KERNEL environment
+ * variable can be set to “scalar” or “ssse3” to restrict the choice,
+ * which is useful for testing. */
+zzuf_kernel_t _zz_dense_kernel(enum fuzzing mode, uint8_t const *protect,
+                               uint8_t const *refuse)
+{
+    protect_table = protect;
+    refuse_table = refuse;
+    build_lut(protect_lut, protect);
+    build_lut(refuse_lut, refuse);
+
+    int has_protect = 0, has_refuse = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        has_protect |= !!protect[i];
+        has_refuse |= !!refuse[i];
+    }
+
+#if defined HAVE_X86_DISPATCH
+    char const *isa = getenv("ZZUF_KERNEL");
+
+    /* This may be called from a library constructor, before the CPU
+     * model was probed by the runtime. */
+    __builtin_cpu_init();
+
+    if ((!isa || !strcmp(isa, "avx2")) && __builtin_cpu_supports("avx2"))
+        return dense_avx2[mode][has_protect][has_refuse];
+
+    if ((!isa || strcmp(isa, "scalar")) && __builtin_cpu_supports("ssse3"))
+        return dense_ssse3[mode][has_protect][has_refuse];
+#else
+    (void)mode;
+    (void)has_protect;
+    (void)has_refuse;
+#endif
+
+    return NULL;
+}
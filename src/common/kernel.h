@@ -0,0 +1,30 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  kernel.h: mask application kernels
+ */
+
+/* Fuzzing mode */
+enum fuzzing
+{
+    FUZZING_XOR = 0, FUZZING_SET, FUZZING_UNSET
+};
+
+/* A dense kernel applies a full bitmask to a buffer of the given length,
+ * honouring the protected and refused byte classes. */
+typedef void (*zzuf_kernel_t)(volatile uint8_t *, uint8_t const *, int64_t);
+
+extern zzuf_kernel_t _zz_dense_kernel(enum fuzzing, uint8_t const *,
+                                      uint8_t const *);
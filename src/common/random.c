@@ -25,21 +25,44 @@
 
 #include "random.h"
 
-static unsigned long ctx = 1;
+static uint32_t ctx = 1;
 
 void zzuf_srand(uint32_t seed)
 {
-    ctx = (seed ^ 0x12345678);
+    zzuf_srand_r(&ctx, seed);
 }
 
 uint32_t zzuf_rand(uint32_t max)
+{
+    return zzuf_rand_r(&ctx, max);
+}
+
+/* Reentrant versions: the caller owns the generator state, so that
+ * several threads can generate masks at the same time. */
+void zzuf_srand_r(uint32_t *state, uint32_t seed)
+{
+    *state = (seed ^ 0x12345678);
+}
+
+uint32_t zzuf_rand_r(uint32_t *state, uint32_t max)
 {
     /* Could be better, but do we care? */
-    long hi = ctx / 12773L;
-    long lo = ctx % 12773L;
+    long hi = *state / 12773L;
+    long lo = *state % 12773L;
     long x = 16807L * lo - 2836L * hi;
     if (x <= 0)
         x += 0x7fffffffL;
-    return (ctx = x) % (unsigned long)max;
+    return (*state = (uint32_t)x) % max;
+}
+
+/* Counter-based generator: return the nth value of the SplitMix64
+ * sequence for the given key. Unlike zzuf_rand(), there is no state,
+ * so values can be computed in any order. */
+uint64_t zzuf_crand(uint64_t key, uint64_t n)
+{
+    uint64_t z = key + (n + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
@@ -18,4 +18,7 @@
 
 void zzuf_srand(uint32_t);
 uint32_t zzuf_rand(uint32_t);
+void zzuf_srand_r(uint32_t *, uint32_t);
+uint32_t zzuf_rand_r(uint32_t *, uint32_t);
+uint64_t zzuf_crand(uint64_t, uint64_t);
 
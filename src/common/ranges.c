@@ -27,11 +27,15 @@
 #include "common.h"
 #include "ranges.h"
 
+static int64_t parse_offset(char const *);
+
 /* This function converts a string containing a list of ranges in the format
  * understood by cut(1) such as "1-5,8,10-" into a C array for lookup.
- * If more than 256 slots are required, new memory is allocated, otherwise
- * the static array static_ranges is used. It is the caller's duty to call
- * free() if the returned value is not static_ranges. */
+ * Values are 64-bit and may use a K, M or G suffix, such as "3G-".
+ * Each range is stored as its start and its end plus one; open ranges end
+ * at INT64_MAX. If more than 256 slots are required, new memory is
+ * allocated, otherwise the static array static_ranges is used. It is the
+ * caller's duty to call free() if the returned value is not static_ranges. */
 int64_t *_zz_allocrange(char const *list, int64_t static_ranges[256])
 {
     char const *parser;
@@ -54,11 +58,15 @@ int64_t *_zz_allocrange(char const *list, int64_t static_ranges[256])
         char const *comma = strchr(parser, ',');
         char const *dash = strchr(parser, '-');
 
-        ranges[i * 2] = (dash == parser) ? 0 : atoi(parser);
+        /* Ignore dashes that belong to the next ranges */
+        if (dash && comma && dash > comma)
+            dash = NULL;
+
+        ranges[i * 2] = (dash == parser) ? 0 : parse_offset(parser);
         if (dash && (dash + 1 == comma || dash[1] == '\0'))
-            ranges[i * 2 + 1] = ranges[i * 2]; /* special case */
-        else if (dash && (!comma || dash < comma))
-            ranges[i * 2 + 1] = atoi(dash + 1) + 1;
+            ranges[i * 2 + 1] = INT64_MAX; /* special case */
+        else if (dash)
+            ranges[i * 2 + 1] = parse_offset(dash + 1) + 1;
         else
             ranges[i * 2 + 1] = ranges[i * 2] + 1;
         parser = comma + 1;
@@ -77,9 +85,87 @@ int _zz_isinrange(int64_t value, int64_t const *ranges)
         return 1;
 
     for (r = ranges; r[1]; r += 2)
-        if (value >= r[0] && (r[0] == r[1] || value < r[1]))
+        if (value >= r[0] && value < r[1])
             return 1;
 
     return 0;
 }
 
+/* Sort a list of ranges returned by _zz_allocrange() in place, and merge
+ * the ranges that overlap or touch, so that they can be walked in order.
+ * Empty ranges are removed. Return the number of remaining ranges. */
+int _zz_mergerange(int64_t *ranges)
+{
+    int n = 0, count = 0;
+
+    while (ranges[n * 2 + 1])
+        ++n;
+
+    /* Insertion sort on the start offset; lists are usually short and
+     * often already sorted. */
+    for (int i = 1; i < n; ++i)
+    {
+        int64_t start = ranges[i * 2], stop = ranges[i * 2 + 1];
+        int j = i;
+
+        for ( ; j > 0 && ranges[j * 2 - 2] > start; --j)
+        {
+            ranges[j * 2] = ranges[j * 2 - 2];
+            ranges[j * 2 + 1] = ranges[j * 2 - 1];
+        }
+
+        ranges[j * 2] = start;
+        ranges[j * 2 + 1] = stop;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        int64_t start = ranges[i * 2], stop = ranges[i * 2 + 1];
+
+        if (stop <= start)
+            continue;
+
+        if (count && start <= ranges[count * 2 - 1])
+        {
+            if (stop > ranges[count * 2 - 1])
+                ranges[count * 2 - 1] = stop;
+            continue;
+        }
+
+        ranges[count * 2] = start;
+        ranges[count * 2 + 1] = stop;
+        ++count;
+    }
+
+    ranges[count * 2] = ranges[count * 2 + 1] = 0;
+
+    return count;
+}
+
+/* Parse a 64-bit decimal value with an optional K, M or G suffix. Values
+ * that do not fit are clamped. */
+static int64_t parse_offset(char const *str)
+{
+    char *end;
+    long long int ret = strtoll(str, &end, 10);
+    int shift = 0;
+
+    switch (*end)
+    {
+    case 'k': case 'K':
+        shift = 10;
+        break;
+    case 'm': case 'M':
+        shift = 20;
+        break;
+    case 'g': case 'G':
+        shift = 30;
+        break;
+    }
+
+    if (ret > (INT64_MAX - 1) >> shift)
+        return INT64_MAX - 1;
+
+    return (int64_t)ret << shift;
+}
+
@@ -18,4 +18,5 @@
 
 int64_t *_zz_allocrange(char const *, int64_t[256]);
 int _zz_isinrange(int64_t, int64_t const *);
+int _zz_mergerange(int64_t *);
 
@@ -0,0 +1,986 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  copy.c: copy mode inputs
+ *
+ *  In copy mode, the input files are loaded once, and each child gets
+ *  fuzzed copies of them as arguments. The copies for one child form a
+ *  job. Where possible, jobs are prepared ahead of time by a pool of
+ *  worker threads, so that the main loop never waits for large inputs
+ *  to be fuzzed while children have output to read or exits to report.
+ *
+ *  In corpus mode, the corpus argument is one more input, whose data is
+ *  that of the job's corpus entry. All corpus inputs are loaded at once.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE /* for memfd_create() */
+
+#if defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#elif defined HAVE_STDINT_H
+#   include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_WINDOWS_H
+#   include <windows.h>
+#endif
+#if defined HAVE_IO_H
+#   include <io.h>
+#endif
+#if defined HAVE_FCNTL_H
+#   include <fcntl.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if defined HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#if defined HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#endif
+#if defined HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+
+#include "common.h"
+#include "opts.h"
+#include "fd.h"
+#include "fuzz.h"
+#include "copy.h"
+#include "corpus.h"
+#include "shard.h"
+#include "myfork.h"
+#include "util/getopt.h"
+
+/* Children get their fuzzed inputs in memory files that they open
+ * through /proc/self/fd/N, instead of temporary files. Inputs with a file
+ * name extension get a symbolic link to that path with the same extension,
+ * in a directory of our own, which each child resolves to its own copy of
+ * the descriptor. */
+#if defined HAVE_MEMFD_CREATE && defined HAVE_MMAP && defined MFD_CLOEXEC
+#   define ZZUF_MEMFD 1
+#endif
+
+/* Jobs are prepared by worker threads, which wake up the main loop
+ * through its epoll set. Children must then be launched without fork(),
+ * which is not safe in a threaded program. */
+#if defined ZZUF_EPOLL && defined ZZUF_SPAWN && defined HAVE_PTHREAD_H
+#   define ZZUF_WORKERS 1
+#endif
+
+#if defined ZZUF_WORKERS
+struct zzuf_pool
+{
+    zzuf_opts_t *opts;
+    /* Protects the job states, and the jobs until they are ready */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* signalled when jobs are queued or on exit */
+    int nworkers, b_stop;
+    pthread_t *workers;
+    int pipe[2]; /* the workers write a byte when a job is ready */
+    zzuf_cursor_t next; /* the next seeds to queue */
+};
+
+static void start_pool(zzuf_opts_t *, int);
+static void stop_pool(zzuf_opts_t *);
+static void fill_queue(zzuf_opts_t *);
+static zzuf_job_t *find_job(zzuf_opts_t *, int, uint32_t);
+static int compare_jobs(zzuf_job_t const *, zzuf_job_t const *);
+static void *worker(void *);
+#endif
+
+static void load_inputs(zzuf_opts_t *);
+static int load_input(zzuf_input_t *, char *);
+static void free_input(zzuf_input_t *);
+static void set_seed(zzuf_opts_t *, zzuf_job_t *, int, uint32_t);
+static zzuf_input_t const *job_input(zzuf_opts_t *, zzuf_job_t const *, int);
+static void prepare_job(zzuf_opts_t *, zzuf_job_t *);
+static void init_context(fuzz_context_t *, zzuf_copy_t const *);
+static void fini_context(fuzz_context_t *);
+#if defined ZZUF_MEMFD
+static int open_copy(zzuf_copy_t *, zzuf_input_t const *);
+static void name_copy(zzuf_opts_t *, zzuf_copy_t *, zzuf_input_t const *);
+static void close_copy(zzuf_copy_t *);
+#endif
+static char const *get_tmpdir(void);
+#if !defined _WIN32
+static char const *get_extension(char const *);
+#endif
+
+/*
+ * Load the input files of copy mode once and for all, and allocate the
+ * jobs that will hold their copies.
+ */
+void copy_init(zzuf_opts_t *opts)
+{
+    load_inputs(opts);
+
+#if defined ZZUF_MEMFD
+    /* Only create the directory for links if some input needs one */
+    int links = 0;
+    for (int k = 0; k < opts->ninputs; ++k)
+        links |= !opts->input[k].b_corpus
+                  && *get_extension(opts->input[k].path);
+    for (int e = 0; e < opts->ncorpus; ++e)
+        links |= *get_extension(opts->corpus[e].path) != '\0';
+
+    char tmpname[4096];
+    if (links && strlen(get_tmpdir()) < 4000)
+    {
+        sprintf(tmpname, "%s/zzuf.%i.XXXXXX", get_tmpdir(), (int)getpid());
+        if (mkdtemp(tmpname))
+            opts->linkdir = strdup(tmpname);
+    }
+#endif
+
+    /* One job per slot, plus one per worker to prepare ahead of time.
+     * Each worker prepares one job at a time, so there is no need for
+     * more workers than CPUs or slots. */
+    opts->njobs = opts->maxchild;
+#if defined ZZUF_WORKERS
+    int nworkers = 0;
+    if (opts->epoll_fd >= 0)
+    {
+        long int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus < 1 ? 1
+                 : ncpus < opts->maxchild ? (int)ncpus : opts->maxchild;
+    }
+    opts->njobs += nworkers;
+#endif
+
+    opts->job = malloc(opts->njobs * sizeof(zzuf_job_t));
+    for (int n = 0; n < opts->njobs; ++n)
+    {
+        zzuf_job_t *job = &opts->job[n];
+
+        job->status = JOB_FREE;
+        job->entry = 0;
+        job->seed = 0;
+        job->copy = malloc(opts->ninputs * sizeof(zzuf_copy_t));
+        for (int k = 0; k < opts->ninputs; ++k)
+        {
+            job->copy[k].fd = -1;
+            job->copy[k].map = NULL;
+            job->copy[k].src = NULL;
+            job->copy[k].b_sealed = 0;
+            job->copy[k].b_link = 0;
+            job->copy[k].name = NULL;
+        }
+    }
+
+#if defined ZZUF_WORKERS
+    if (nworkers)
+        start_pool(opts, nworkers);
+#endif
+}
+
+void copy_fini(zzuf_opts_t *opts)
+{
+#if defined ZZUF_WORKERS
+    stop_pool(opts);
+#endif
+
+    for (int n = 0; n < opts->njobs; ++n)
+    {
+        for (int k = 0; k < opts->ninputs; ++k)
+        {
+            zzuf_copy_t *copy = &opts->job[n].copy[k];
+
+#if defined ZZUF_MEMFD
+            if (copy->fd >= 0)
+                close_copy(copy);
+            else
+#endif
+            if (copy->name)
+                unlink(copy->name);
+
+            free(copy->name);
+        }
+
+        free(opts->job[n].copy);
+    }
+
+    free(opts->job);
+    opts->job = NULL;
+    opts->njobs = 0;
+
+    if (opts->linkdir)
+    {
+        rmdir(opts->linkdir);
+        free(opts->linkdir);
+        opts->linkdir = NULL;
+    }
+
+    for (int k = 0; k < opts->ninputs; ++k)
+        free_input(&opts->input[k]);
+    for (int e = 0; e < opts->ncorpus; ++e)
+        free_input(&opts->corpus[e]);
+
+    free(opts->input);
+    opts->input = NULL;
+    opts->ninputs = 0;
+}
+
+/*
+ * Tell whether the child for the given corpus input and seed has to wait
+ * for a worker to prepare its inputs. The job is queued if it was not
+ * already.
+ */
+int copy_pending(zzuf_opts_t *opts, int entry, uint32_t seed)
+{
+#if defined ZZUF_WORKERS
+    zzuf_pool_t *pool = opts->pool;
+    if (!pool)
+        return 0; /* they will be prepared at launch time */
+
+    pthread_mutex_lock(&pool->mutex);
+    fill_queue(opts);
+
+    zzuf_job_t *job = find_job(opts, entry, seed);
+    if (!job)
+    {
+        /* Seeds are queued in the order they are launched, so this
+         * should not happen. If it does, take the job that is needed
+         * last, unless a worker is busy with it. */
+        for (int n = 0; n < opts->njobs; ++n)
+        {
+            zzuf_job_t *tmp = &opts->job[n];
+
+            if (tmp->status == JOB_USED || tmp->status == JOB_BUSY)
+                continue;
+            if (!job || tmp->status == JOB_FREE
+                 || (job->status != JOB_FREE && compare_jobs(tmp, job) > 0))
+                job = tmp;
+        }
+
+        if (job)
+        {
+            set_seed(opts, job, entry, seed);
+            job->status = JOB_QUEUED;
+            pthread_cond_signal(&pool->cond);
+        }
+    }
+
+    int ret = !job || job->status != JOB_READY;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ret;
+#else
+    (void)opts;
+    (void)entry;
+    (void)seed;
+    return 0;
+#endif
+}
+
+/*
+ * Give a child the fuzzed copies of the inputs for its seed, preparing
+ * them now if no worker did, and point its arguments to them.
+ */
+int copy_prepare(zzuf_opts_t *opts, zzuf_child_t *child)
+{
+    zzuf_job_t *job = NULL;
+
+#if defined ZZUF_WORKERS
+    zzuf_pool_t *pool = opts->pool;
+    if (pool)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        job = find_job(opts, child->entry, child->seed);
+        if (job && job->status == JOB_READY)
+            job->status = JOB_USED;
+        else
+            job = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (!job)
+            return -1;
+    }
+#endif
+
+    if (!job)
+    {
+        for (int n = 0; n < opts->njobs && !job; ++n)
+            if (opts->job[n].status == JOB_FREE)
+                job = &opts->job[n];
+
+        if (!job)
+            return -1;
+
+        set_seed(opts, job, child->entry, child->seed);
+        prepare_job(opts, job);
+        job->status = JOB_USED;
+    }
+
+    child->job = job;
+    for (int k = 0; k < opts->ninputs; ++k)
+        if (job->copy[k].name)
+            child->newargv[opts->input[k].arg] = job->copy[k].name;
+
+    return 0;
+}
+
+/*
+ * Take back the copies given to a child. Temporary files are removed,
+ * memory files are kept for another job.
+ */
+void copy_release(zzuf_opts_t *opts, zzuf_child_t *child)
+{
+    zzuf_job_t *job = child->job;
+    if (!job)
+        return;
+
+    for (int k = 0; k < opts->ninputs; ++k)
+    {
+        int j = opts->input[k].arg;
+        zzuf_copy_t *copy = &job->copy[k];
+
+        /* The corpus argument is set for each child */
+        if (!opts->input[k].b_corpus)
+            child->newargv[j] = opts->oldargv[zz_optind + j];
+
+        if (copy->fd < 0 && copy->name)
+        {
+            unlink(copy->name);
+            free(copy->name);
+            copy->name = NULL;
+        }
+    }
+
+    child->job = NULL;
+
+#if defined ZZUF_WORKERS
+    zzuf_pool_t *pool = opts->pool;
+    if (pool)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        job->status = JOB_FREE;
+        fill_queue(opts);
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+#endif
+
+    job->status = JOB_FREE;
+}
+
+#if defined ZZUF_EPOLL
+/*
+ * Acknowledge the wake-up calls of the workers.
+ */
+void copy_wakeup(zzuf_opts_t *opts)
+{
+#   if defined ZZUF_WORKERS
+    char buf[64];
+    while (opts->pool && read(opts->pool->pipe[0], buf, sizeof(buf)) > 0)
+        ;
+#   else
+    (void)opts;
+#   endif
+}
+#endif
+
+#if defined ZZUF_WORKERS
+/*
+ * Start the worker threads. If this fails, jobs are prepared at launch
+ * time, and the extra jobs are simply not used.
+ */
+static void start_pool(zzuf_opts_t *opts, int nworkers)
+{
+    zzuf_pool_t *pool = malloc(sizeof(zzuf_pool_t));
+    pool->opts = opts;
+    pool->nworkers = 0;
+    pool->b_stop = 0;
+    pool->workers = malloc(nworkers * sizeof(pthread_t));
+    pool->next = opts->next;
+
+    if (pipe(pool->pipe) < 0)
+    {
+        free(pool->workers);
+        free(pool);
+        return;
+    }
+
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(pool->pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(pool->pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_COPY;
+    if (epoll_ctl(opts->epoll_fd, EPOLL_CTL_ADD, pool->pipe[0], &ev) < 0)
+    {
+        close(pool->pipe[0]);
+        close(pool->pipe[1]);
+        free(pool->workers);
+        free(pool);
+        return;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    opts->pool = pool;
+
+    while (pool->nworkers < nworkers
+            && pthread_create(&pool->workers[pool->nworkers], NULL,
+                              worker, pool) == 0)
+        ++pool->nworkers;
+
+    if (!pool->nworkers)
+        stop_pool(opts);
+}
+
+static void stop_pool(zzuf_opts_t *opts)
+{
+    zzuf_pool_t *pool = opts->pool;
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->b_stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->nworkers; ++i)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    close(pool->pipe[0]);
+    close(pool->pipe[1]);
+    free(pool->workers);
+    free(pool);
+    opts->pool = NULL;
+}
+
+/*
+ * Queue jobs for the next seeds, as long as there are free jobs. Called
+ * with the pool mutex held.
+ */
+static void fill_queue(zzuf_opts_t *opts)
+{
+    zzuf_pool_t *pool = opts->pool;
+    int queued = 0;
+
+    /* Corpus inputs that crashed too often will not be launched again,
+     * drop the jobs that were prepared for them */
+    for (int n = 0; n < opts->njobs; ++n)
+    {
+        zzuf_job_t *job = &opts->job[n];
+        if ((job->status == JOB_QUEUED || job->status == JOB_READY)
+             && corpus_crashed(opts, job->entry))
+            job->status = JOB_FREE;
+    }
+
+    /* Never queue seeds that were already launched */
+    if (pool->next.block < opts->next.block
+         || (pool->next.block == opts->next.block
+              && pool->next.offset < opts->next.offset))
+        pool->next = opts->next;
+    shard_skip(opts, &pool->next, 0);
+
+    for (int n = 0; n < opts->njobs && pool->next.seed < opts->endseed; ++n)
+    {
+        zzuf_job_t *job = &opts->job[n];
+        if (job->status != JOB_FREE)
+            continue;
+
+        /* Copy mode has no persistent children, so each child gets
+         * exactly one seed */
+        set_seed(opts, job, pool->next.entry, pool->next.seed);
+        job->status = JOB_QUEUED;
+        ++queued;
+
+        shard_skip(opts, &pool->next, 1);
+    }
+
+    if (queued)
+        pthread_cond_broadcast(&pool->cond);
+}
+
+/*
+ * Find the job queued for a corpus input and a seed, if any. Called with
+ * the pool mutex held.
+ */
+static zzuf_job_t *find_job(zzuf_opts_t *opts, int entry, uint32_t seed)
+{
+    for (int n = 0; n < opts->njobs; ++n)
+    {
+        zzuf_job_t *job = &opts->job[n];
+
+        if (job->entry == entry && job->seed == seed
+             && (job->status == JOB_QUEUED || job->status == JOB_BUSY
+                  || job->status == JOB_READY))
+            return job;
+    }
+
+    return NULL;
+}
+
+/*
+ * Compare jobs in launch order: corpus input first, then seed.
+ */
+static int compare_jobs(zzuf_job_t const *a, zzuf_job_t const *b)
+{
+    if (a->entry != b->entry)
+        return a->entry < b->entry ? -1 : 1;
+
+    return a->seed < b->seed ? -1 : a->seed > b->seed;
+}
+
+/*
+ * Prepare the queued jobs, lowest seeds first, until told to stop.
+ */
+static void *worker(void *data)
+{
+    zzuf_pool_t *pool = data;
+    zzuf_opts_t *opts = pool->opts;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->b_stop)
+    {
+        zzuf_job_t *job = NULL;
+
+        for (int n = 0; n < opts->njobs; ++n)
+            if (opts->job[n].status == JOB_QUEUED
+                 && (!job || compare_jobs(&opts->job[n], job) < 0))
+                job = &opts->job[n];
+
+        if (!job)
+        {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+
+        job->status = JOB_BUSY;
+        pthread_mutex_unlock(&pool->mutex);
+
+        prepare_job(opts, job);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->status = JOB_READY;
+
+        /* If the pipe is full, the main loop has wake-ups pending */
+        write(pool->pipe[1], "", 1);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+#endif
+
+/*
+ * Load the input files of copy mode. Any argument that can be opened is
+ * considered an input file. In corpus mode, the corpus argument comes
+ * last and all corpus inputs are loaded.
+ */
+static void load_inputs(zzuf_opts_t *opts)
+{
+    opts->input = malloc((opts->oldargc - zz_optind + 1)
+                          * sizeof(zzuf_input_t));
+    opts->ninputs = 0;
+
+    for (int j = zz_optind + 1; j < opts->oldargc; ++j)
+    {
+        zzuf_input_t *input = &opts->input[opts->ninputs];
+
+        if (opts->ncorpus && j - zz_optind == opts->corpus_arg)
+            continue;
+        if (load_input(input, opts->oldargv[j]) < 0)
+            continue;
+
+        input->arg = j - zz_optind;
+        ++opts->ninputs;
+    }
+
+    if (opts->ncorpus)
+    {
+        zzuf_input_t *input = &opts->input[opts->ninputs++];
+        input->path = NULL;
+        input->arg = opts->corpus_arg;
+        input->b_corpus = 1;
+        input->b_mmap = 0;
+        input->data = NULL;
+        input->size = 0;
+    }
+
+    /* Inputs that cannot be read are fuzzed as empty files */
+    for (int e = 0; e < opts->ncorpus; ++e)
+        if (load_input(&opts->corpus[e], opts->corpus[e].path) < 0)
+            fprintf(stderr, "zzuf: cannot read `%s'\n", opts->corpus[e].path);
+}
+
+/*
+ * Load an input file in memory. Returns -1 if it cannot be opened.
+ */
+static int load_input(zzuf_input_t *input, char *path)
+{
+    FILE *fpin = fopen(path, "rb");
+    if (!fpin)
+        return -1;
+
+    input->path = path;
+    input->b_corpus = 0;
+    input->b_mmap = 0;
+    input->data = NULL;
+    input->size = 0;
+
+#if defined HAVE_MMAP
+    /* Regular files are simply mapped in memory */
+    struct stat st;
+    if (!fstat(fileno(fpin), &st) && S_ISREG(st.st_mode))
+    {
+        void *p = st.st_size ? mmap(NULL, st.st_size, PROT_READ,
+                                    MAP_PRIVATE, fileno(fpin), 0)
+                             : MAP_FAILED;
+        if (p != MAP_FAILED)
+        {
+            input->b_mmap = 1;
+            input->data = p;
+            input->size = st.st_size;
+            fclose(fpin);
+            return 0;
+        }
+    }
+#endif
+
+    while (!feof(fpin))
+    {
+        uint8_t buf[BUFSIZ];
+        size_t n = fread(buf, 1, BUFSIZ, fpin);
+        if (n <= 0)
+            break;
+        input->data = realloc(input->data, input->size + n);
+        memcpy(input->data + input->size, buf, n);
+        input->size += n;
+    }
+
+    fclose(fpin);
+    return 0;
+}
+
+static void free_input(zzuf_input_t *input)
+{
+#if defined HAVE_MMAP
+    if (input->b_mmap)
+        munmap(input->data, input->size);
+    else
+#endif
+    free(input->data);
+
+    input->b_mmap = 0;
+    input->data = NULL;
+    input->size = 0;
+}
+
+/*
+ * Give a job the corpus input and seed of a child, and each input the
+ * seed and ratio that _zz_register() would give it, which depend on the
+ * -A and -r flags. This uses the global settings, so only the main
+ * thread may call it.
+ */
+static void set_seed(zzuf_opts_t *opts, zzuf_job_t *job,
+                     int entry, uint32_t seed)
+{
+    int32_t saved = zzuf_get_seed();
+
+    job->entry = entry;
+    job->seed = seed;
+    zzuf_set_seed(seed);
+
+    for (int k = 0; k < opts->ninputs; ++k)
+    {
+        _zz_register(k);
+        fd_handle_t *h = _zz_fd_acquire(k);
+        if (h)
+        {
+            fuzz_context_t *fuzz = _zz_fd_getfuzz(h);
+            job->copy[k].seed = fuzz->seed;
+            job->copy[k].ratio = fuzz->ratio;
+            _zz_fd_release(h);
+        }
+        _zz_unregister(k);
+    }
+
+    zzuf_set_seed(saved);
+}
+
+/*
+ * Get the data of a job's input: the corpus argument stands for the
+ * job's corpus input.
+ */
+static zzuf_input_t const *job_input(zzuf_opts_t *opts,
+                                     zzuf_job_t const *job, int k)
+{
+    if (opts->input[k].b_corpus)
+        return &opts->corpus[job->entry];
+
+    return &opts->input[k];
+}
+
+/*
+ * Write the fuzzed copies of a job. This may run in a worker thread, so
+ * each copy is fuzzed with a context of its own instead of a registered
+ * file descriptor.
+ */
+static void prepare_job(zzuf_opts_t *opts, zzuf_job_t *job)
+{
+    for (int k = 0; k < opts->ninputs; ++k)
+    {
+        zzuf_input_t const *input = job_input(opts, job, k);
+        zzuf_copy_t *copy = &job->copy[k];
+        fuzz_context_t fuzz;
+
+#if defined ZZUF_MEMFD
+        /* Corpus inputs differ in size, so each one needs its own memory
+         * file */
+        if (copy->fd >= 0 && copy->src != input)
+            close_copy(copy);
+
+        /* If children can write to the file, the previous one may have
+         * changed anything, including the file's size. Should the size
+         * not be restored, start again with a new file rather than give
+         * the next child data that is not that of its seed. */
+        if (copy->fd >= 0 && !copy->b_sealed
+             && ftruncate(copy->fd, input->size) < 0)
+            close_copy(copy);
+
+        /* The memory file is created for the job's first seed, and kept
+         * for the next ones */
+        if (copy->fd < 0 && open_copy(copy, input) == 0)
+            name_copy(opts, copy, input);
+
+        if (copy->fd >= 0)
+        {
+            fuzz_record_t *record = &copy->record;
+
+            /* If children cannot write to the file, only the bytes that
+             * were altered for the previous seed need to be restored */
+            if (copy->b_sealed && record->count >= 0)
+            {
+                for (int64_t n = 0; n < record->count; ++n)
+                    copy->map[record->offsets[n]]
+                        = input->data[record->offsets[n]];
+            }
+            else if (input->size)
+                memcpy(copy->map, input->data, input->size);
+
+            /* Past one altered byte per cache line, copying everything
+             * again is just as fast */
+            record->count = 0;
+            record->max = input->size / 64;
+
+            init_context(&fuzz, copy);
+            fuzz.record = copy->b_sealed ? record : NULL;
+            _zz_fuzz_buffer(&fuzz, 0, copy->map, input->size);
+            fini_context(&fuzz);
+            continue;
+        }
+#endif
+
+        /* A ready job may have been given another seed */
+        if (copy->name)
+        {
+            unlink(copy->name);
+            free(copy->name);
+            copy->name = NULL;
+        }
+
+        char tmpname[4096];
+        char const *tmpdir = get_tmpdir();
+
+#ifdef _WIN32
+        sprintf(tmpname, "%s/zzuf.%i.XXXXXX", tmpdir, GetCurrentProcessId());
+        int fdout = _open(mktemp(tmpname), _O_RDWR, 0600);
+#else
+        /* Keep the file name extension, some programs need it */
+        char const *extension = get_extension(input->path);
+        sprintf(tmpname, "%s/zzuf.%i.XXXXXX%s", tmpdir, (int)getpid(), extension);
+        int fdout = mkstemps(tmpname, (int)strlen(extension));
+#endif
+        if (fdout < 0)
+            continue;
+
+        copy->name = strdup(tmpname);
+
+        init_context(&fuzz, copy);
+        for (size_t pos = 0; pos < input->size; pos += BUFSIZ)
+        {
+            uint8_t buf[BUFSIZ];
+            size_t n = input->size - pos < BUFSIZ ? input->size - pos : BUFSIZ;
+            memcpy(buf, input->data + pos, n);
+            _zz_fuzz_buffer(&fuzz, pos, buf, n);
+            write(fdout, buf, n);
+        }
+        fini_context(&fuzz);
+
+        close(fdout);
+    }
+}
+
+static void init_context(fuzz_context_t *fuzz, zzuf_copy_t const *copy)
+{
+    memset(fuzz, 0, sizeof(*fuzz));
+    fuzz->seed = copy->seed;
+    fuzz->ratio = copy->ratio;
+}
+
+static void fini_context(fuzz_context_t *fuzz)
+{
+    for (int i = 0; i < fuzz->nchunks; ++i)
+        free(fuzz->chunks[i]);
+}
+
+#if defined ZZUF_MEMFD
+/*
+ * Create a job's memory file for an input, map it in memory and fill it
+ * with the original data. Where possible, the file is then sealed so that
+ * only our mapping can change it.
+ */
+static int open_copy(zzuf_copy_t *copy, zzuf_input_t const *input)
+{
+    size_t size = input->size;
+#if defined F_SEAL_FUTURE_WRITE
+    int fd = memfd_create("zzuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    int fd = memfd_create("zzuf", MFD_CLOEXEC);
+#endif
+    if (fd < 0)
+        return -1;
+
+    /* The child's debug channel goes to DEBUG_FILENO, don't take it */
+    if (fd == DEBUG_FILENO)
+    {
+        int tmp = fcntl(fd, F_DUPFD_CLOEXEC, DEBUG_FILENO + 1);
+        close(fd);
+        fd = tmp;
+        if (fd < 0)
+            return -1;
+    }
+
+    void *p = NULL;
+    if (ftruncate(fd, size) < 0 || (size && (p = mmap(NULL, size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (size)
+        memcpy(p, input->data, size);
+
+    copy->fd = fd;
+    copy->map = p;
+    copy->src = input;
+    copy->b_sealed = 0;
+    copy->record.offsets = NULL;
+    copy->record.count = copy->record.size = copy->record.max = 0;
+
+#if defined F_SEAL_FUTURE_WRITE
+    /* Kernels older than Linux 5.1 do not know this seal */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                                | F_SEAL_FUTURE_WRITE) == 0)
+        copy->b_sealed = 1;
+#endif
+
+    return 0;
+}
+
+/*
+ * Set the path a child opens a job's memory file with. Some programs need
+ * the input's file name extension, which /proc/self/fd/N lacks, so they
+ * get a symbolic link to that path with the extension instead, if we
+ * could create our directory for links.
+ */
+static void name_copy(zzuf_opts_t *opts, zzuf_copy_t *copy,
+                      zzuf_input_t const *input)
+{
+    char const *extension = get_extension(input->path);
+    char target[64], buf[4096];
+
+    sprintf(target, "/proc/self/fd/%i", copy->fd);
+    free(copy->name);
+    copy->name = NULL;
+    copy->b_link = 0;
+
+    if (opts->linkdir && *extension
+         && strlen(opts->linkdir) + strlen(extension) < 4000)
+    {
+        /* Each memory file has its own descriptor, so the name is unique;
+         * only a link we failed to remove can be in the way, and we never
+         * remove anything else */
+        struct stat st;
+        sprintf(buf, "%s/%i%s", opts->linkdir, copy->fd, extension);
+        if (symlink(target, buf) == 0
+             || (errno == EEXIST && lstat(buf, &st) == 0
+                  && S_ISLNK(st.st_mode) && unlink(buf) == 0
+                  && symlink(target, buf) == 0))
+        {
+            copy->name = strdup(buf);
+            copy->b_link = 1;
+            return;
+        }
+    }
+
+    copy->name = strdup(target);
+}
+
+/*
+ * Close a job's memory file, and remove the link to it if it has one.
+ */
+static void close_copy(zzuf_copy_t *copy)
+{
+    if (copy->map)
+        munmap(copy->map, copy->src->size);
+    free(copy->record.offsets);
+    close(copy->fd);
+    if (copy->b_link)
+        unlink(copy->name);
+
+    free(copy->name);
+    copy->name = NULL;
+    copy->b_link = 0;
+    copy->fd = -1;
+    copy->map = NULL;
+}
+#endif
+
+static char const *get_tmpdir(void)
+{
+    char const *tmpdir = getenv("TEMP");
+    return tmpdir && *tmpdir ? tmpdir : "/tmp";
+}
+
+#if !defined _WIN32
+/*
+ * Get the file name extension of a path, or an empty string.
+ */
+static char const *get_extension(char const *path)
+{
+    char const *fbasename = strrchr(path, '/');
+    char const *extension = strrchr(fbasename ? fbasename : path, '.');
+    return extension ? extension : "";
+}
+#endif
@@ -0,0 +1,26 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  copy.h: copy mode inputs
+ */
+
+void copy_init(zzuf_opts_t *opts);
+void copy_fini(zzuf_opts_t *opts);
+int copy_pending(zzuf_opts_t *opts, int entry, uint32_t seed);
+int copy_prepare(zzuf_opts_t *opts, zzuf_child_t *child);
+void copy_release(zzuf_opts_t *opts, zzuf_child_t *child);
+#if defined ZZUF_EPOLL
+void copy_wakeup(zzuf_opts_t *opts);
+#endif
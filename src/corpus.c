@@ -0,0 +1,152 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  corpus.c: corpus mode inputs
+ *
+ *  In corpus mode, the program is run once per input and per seed. The
+ *  inputs are the regular files of a directory, or the files named in a
+ *  list file. Each input goes through the whole seed range, unless it
+ *  crashes the program more often than allowed, and the children are
+ *  launched in (input, seed) order so that all slots are kept busy from
+ *  one input to the next.
+ */
+
+#include "config.h"
+
+#if defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#elif defined HAVE_STDINT_H
+#   include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined HAVE_DIRENT_H
+#   include <dirent.h>
+#endif
+
+#include "common.h"
+#include "opts.h"
+#include "corpus.h"
+
+static int add_entry(zzuf_opts_t *, char const *, char const *);
+#if defined HAVE_DIRENT_H
+static int compare_entries(void const *, void const *);
+#endif
+
+/*
+ * Load the list of inputs from a directory or a list file. Returns -1 if
+ * it cannot be read or if it has no inputs.
+ */
+int corpus_load(zzuf_opts_t *opts, char const *path)
+{
+#if defined HAVE_DIRENT_H
+    DIR *dir = opendir(path);
+    if (dir)
+    {
+        struct dirent *de;
+        while ((de = readdir(dir)))
+            add_entry(opts, path, de->d_name);
+        closedir(dir);
+
+        /* Directory order is not stable, make runs reproducible */
+        qsort(opts->corpus, opts->ncorpus, sizeof(zzuf_input_t),
+              compare_entries);
+    }
+    else
+#endif
+    {
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            return -1;
+
+        char buf[4096];
+        while (fgets(buf, sizeof(buf), fp))
+        {
+            buf[strcspn(buf, "\r\n")] = '\0';
+            if (buf[0])
+                add_entry(opts, NULL, buf);
+        }
+
+        fclose(fp);
+    }
+
+    return opts->ncorpus ? 0 : -1;
+}
+
+void corpus_free(zzuf_opts_t *opts)
+{
+    for (int e = 0; e < opts->ncorpus; ++e)
+        free(opts->corpus[e].path);
+
+    free(opts->corpus);
+    opts->corpus = NULL;
+    opts->ncorpus = 0;
+}
+
+/*
+ * Tell whether an input has crashed the program as many times as -C
+ * allows, in which case its remaining seeds are skipped.
+ */
+int corpus_crashed(zzuf_opts_t const *opts, int entry)
+{
+    return opts->ncorpus && opts->maxcrashes
+            && opts->corpus[entry].crashes >= opts->maxcrashes;
+}
+
+/*
+ * Append an input to the corpus. Directory entries that are not regular
+ * files are ignored, list file entries are taken as they are.
+ */
+static int add_entry(zzuf_opts_t *opts, char const *dir, char const *name)
+{
+    char *path = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+
+    if (dir)
+    {
+        sprintf(path, "%s/%s", dir, name);
+
+        struct stat st;
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+        {
+            free(path);
+            return -1;
+        }
+    }
+    else
+        strcpy(path, name);
+
+    opts->corpus = realloc(opts->corpus,
+                           (opts->ncorpus + 1) * sizeof(zzuf_input_t));
+
+    zzuf_input_t *input = &opts->corpus[opts->ncorpus++];
+    input->path = path;
+    input->arg = -1;
+    input->b_corpus = 0;
+    input->b_mmap = 0;
+    input->data = NULL;
+    input->size = 0;
+    input->crashes = 0;
+
+    return 0;
+}
+
+#if defined HAVE_DIRENT_H
+static int compare_entries(void const *a, void const *b)
+{
+    return strcmp(((zzuf_input_t const *)a)->path,
+                  ((zzuf_input_t const *)b)->path);
+}
+#endif
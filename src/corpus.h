@@ -0,0 +1,21 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  corpus.h: corpus mode inputs
+ */
+
+int corpus_load(zzuf_opts_t *opts, char const *path);
+void corpus_free(zzuf_opts_t *opts);
+int corpus_crashed(zzuf_opts_t const *opts, int entry);
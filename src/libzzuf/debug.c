@@ -65,7 +65,7 @@ static char const *hex2char = "0123456789abcdef";
     } while (0)
 
 /* Temporary buffer for deferred output */
-static zzuf_mutex_t debug_mutex = 0;
+static zzuf_mutex_t debug_mutex = ZZUF_MUTEX_INIT("debug");
 static char debug_buffer[BUFSIZ];
 static size_t debug_count = 1;
 
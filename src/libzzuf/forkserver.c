@@ -0,0 +1,252 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  forkserver.c: fork server
+ *
+ *  Instead of executing the program again for each seed, zzuf can ask
+ *  libzzuf to stop once it is initialised and to wait for requests on a
+ *  control socket. Each request forks a new child with its own seed,
+ *  ratio and output channels, which then resumes normal execution while
+ *  the server reports its PID and exit status to zzuf.
+ *
+ *  The fork point can also be deferred until the program is about to open
+ *  its first watched file, so that the initialisation it does before
+ *  reading its input is not repeated for each seed either. Each child
+ *  then opens the file itself and gets its own file offset.
+ */
+
+#include "config.h"
+
+/* Need this for unsetenv() and CMSG_* */
+#define _GNU_SOURCE
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#if defined HAVE_STDINT_H
+#   include <stdint.h>
+#elif defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_SYS_SOCKET_H
+#   include <sys/socket.h>
+#endif
+#if defined HAVE_SYS_WAIT_H
+#   include <sys/wait.h>
+#endif
+
+#include "common.h"
+#include "libzzuf.h"
+#include "debug.h"
+#include "fd.h"
+#include "forkserver.h"
+#include "util/mutex.h"
+
+#if defined ZZUF_FORKSERVER
+static void run_server(int);
+static int recv_request(int, struct fork_request *, int[3]);
+static int send_int(int, int);
+
+/* Control socket of a server waiting for its fork point, or -1 */
+static volatile int deferred_fd = -1;
+#endif
+
+/**
+ * Become a fork server if zzuf asked for it, either right now or when
+ * the first watched file is opened, depending on the fork point.
+ */
+void _zz_forkserver_init(char const *var, char const *point)
+{
+#if defined ZZUF_FORKSERVER
+    /* Programs launched by our children must not become servers */
+    unsetenv("ZZUF_FORKSERVER");
+    unsetenv("ZZUF_FORKPOINT");
+
+    if (point && !strcmp(point, "open"))
+    {
+        debug("fork server deferred until a watched file is opened");
+        deferred_fd = atoi(var);
+        return;
+    }
+
+    run_server(atoi(var));
+#else
+    (void)var;
+    (void)point;
+#endif
+}
+
+/**
+ * Called before a file is opened. If the fork point was deferred and the
+ * file must be watched, become the fork server. This function only
+ * returns in the forked children and in programs without a fork server.
+ */
+void _zz_forkserver_open(char const *path)
+{
+#if defined ZZUF_FORKSERVER
+    if (deferred_fd < 0 || !_zz_mustwatch(path))
+        return;
+
+    /* Only one thread may become the server */
+    static zzuf_mutex_t mutex = ZZUF_MUTEX_INIT("fork point");
+    zzuf_mutex_lock(&mutex);
+    int fd = deferred_fd;
+    deferred_fd = -1;
+    zzuf_mutex_unlock(&mutex);
+
+    if (fd >= 0)
+    {
+        debug("fork point reached at \"%s\"", path);
+        run_server(fd);
+    }
+#else
+    (void)path;
+#endif
+}
+
+#if defined ZZUF_FORKSERVER
+/*
+ * The server loop. This function only returns in the forked children,
+ * with the requested seed and ratio set.
+ */
+static void run_server(int fd)
+{
+    debug("fork server listening on %i", fd);
+
+    /* Our output channels belong to the run zzuf launched us for, which
+     * goes on in a child: close them. The children get their own. */
+    _zz_lockfd(-1);
+    int null_fd = open("/dev/null", O_WRONLY);
+    _zz_unlock(-1);
+    int const channels[] = { g_debug_fd, STDERR_FILENO, STDOUT_FILENO };
+    for (int j = 0; j < 3; ++j)
+        if (null_fd >= 0 && channels[j] >= 0 && channels[j] != null_fd)
+            dup2(null_fd, channels[j]);
+    if (null_fd > STDERR_FILENO && null_fd != g_debug_fd)
+        close(null_fd);
+
+    if (send_int(fd, (int)getpid()) < 0)
+        _exit(EXIT_FAILURE);
+
+    for (;;)
+    {
+        struct fork_request req;
+        int fds[3];
+
+        /* zzuf closed the control socket: we are no longer needed */
+        if (recv_request(fd, &req, fds) < 0)
+            _exit(EXIT_SUCCESS);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            /* We are the child. Install the output channels in reverse
+             * order, so that the debug channel is done last, and resume
+             * normal execution. */
+            int const targets[] = { g_debug_fd, STDERR_FILENO, STDOUT_FILENO };
+            close(fd);
+            for (int j = 3; j--; )
+            {
+                if (fds[j] != targets[j])
+                {
+                    dup2(fds[j], targets[j]);
+                    close(fds[j]);
+                }
+            }
+
+            zzuf_set_seed(req.seed);
+            zzuf_set_ratio(req.minratio, req.maxratio);
+            _zz_fd_reseed();
+            return;
+        }
+
+        for (int j = 0; j < 3; ++j)
+            close(fds[j]);
+
+        if (send_int(fd, (int)pid) < 0)
+            _exit(EXIT_FAILURE);
+
+        if (pid < 0)
+            continue;
+
+        int status;
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+            {
+                status = 0;
+                break;
+            }
+        }
+
+        if (send_int(fd, status) < 0)
+            _exit(EXIT_FAILURE);
+    }
+}
+
+static int recv_request(int fd, struct fork_request *req, int fds[3])
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+
+    struct iovec iov;
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t ret;
+    do
+        ret = recvmsg(fd, &msg, 0);
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != (ssize_t)sizeof(*req))
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+         || cmsg->cmsg_type != SCM_RIGHTS
+         || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return -1;
+
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    return 0;
+}
+
+static int send_int(int fd, int val)
+{
+    ssize_t ret;
+    do
+        ret = write(fd, &val, sizeof(val));
+    while (ret < 0 && errno == EINTR);
+
+    return ret == (ssize_t)sizeof(val) ? 0 : -1;
+}
+#endif
+
@@ -0,0 +1,21 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  forkserver.h: fork server
+ */
+
+extern void _zz_forkserver_init(char const *, char const *);
+extern void _zz_forkserver_open(char const *);
+
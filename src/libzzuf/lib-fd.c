@@ -71,6 +71,7 @@
 #include "network.h"
 #include "fuzz.h"
 #include "fd.h"
+#include "forkserver.h"
 
 #if defined HAVE_SOCKLEN_T
 #   define SOCKLEN_T socklen_t
@@ -88,9 +89,10 @@
 
 /* Local prototypes */
 #if defined HAVE_READV || defined HAVE_RECVMSG
-static void fuzz_iovec   (int fd, const struct iovec *iov, ssize_t ret);
+static void fuzz_iovec   (fd_handle_t *h, const struct iovec *iov,
+                          ssize_t ret);
 #endif
-static void offset_check (int fd);
+static void offset_check (fd_handle_t *h);
 
 /* Library functions that we divert */
 static int     (*ORIG(open))    (const char *file, int oflag, ...);
@@ -173,6 +175,10 @@ static int     (*ORIG(close))   (int fd);
     { \
         LOADSYM(myopen); \
         \
+        if (g_libzzuf_ready && !_zz_islocked(-1) \
+            && ((oflag & (O_RDONLY | O_RDWR | O_WRONLY)) != O_WRONLY)) \
+            _zz_forkserver_open(file); \
+        \
         int mode = 0; \
         if (oflag & O_CREAT) \
         { \
@@ -231,8 +237,7 @@ int NEW(dup)(int oldfd)
     LOADSYM(dup);
 
     int ret = ORIG(dup)(oldfd);
-    if (!g_libzzuf_ready || _zz_islocked(-1) || !_zz_iswatched(oldfd)
-         || !_zz_isactive(oldfd))
+    if (!g_libzzuf_ready || _zz_islocked(-1) || !is_active_fd(oldfd))
         return ret;
 
     if (ret >= 0)
@@ -252,15 +257,14 @@ int NEW(dup2)(int oldfd, int newfd)
     LOADSYM(dup2);
 
     int ret = ORIG(dup2)(oldfd, newfd);
-    if (!g_libzzuf_ready || _zz_islocked(-1) || !_zz_iswatched(oldfd)
-         || !_zz_isactive(oldfd))
+    if (!g_libzzuf_ready || _zz_islocked(-1) || !is_active_fd(oldfd))
         return ret;
 
     if (ret >= 0)
     {
         /* We must close newfd if it was open, but only if oldfd != newfd
          * and if dup2() suceeded. */
-        if (oldfd != newfd && _zz_iswatched(newfd) && _zz_isactive(newfd))
+        if (oldfd != newfd && is_active_fd(newfd))
             _zz_unregister(newfd);
 
         debug("%s(%i, %i) = %i", __func__, oldfd, newfd, ret);
@@ -279,7 +283,7 @@ int NEW(accept)(int sockfd, SOCKADDR_T *addr, SOCKLEN_T *addrlen)
 
     int ret = ORIG(accept)(sockfd, addr, addrlen);
     if (!g_libzzuf_ready || _zz_islocked(-1) || !g_network_fuzzing
-         || !_zz_iswatched(sockfd) || !_zz_isactive(sockfd))
+         || !is_active_fd(sockfd))
         return ret;
 
     if (ret >= 0)
@@ -381,14 +385,21 @@ int NEW(socket)(int domain, int type, int protocol)
         LOADSYM(myrecv); \
         \
         ret = ORIG(myrecv) myargs; \
-        if (!must_fuzz_fd(s) || !_zz_hostwatched(s)) \
+        fd_handle_t *h = must_fuzz_acquire(s); \
+        if (!h) \
+            return ret; \
+        if (!_zz_hostwatched(s)) \
+        { \
+            _zz_fd_release(h); \
             return ret; \
+        } \
         \
         if (ret > 0) \
         { \
-            _zz_fuzz(s, buf, ret); \
-            _zz_addpos(s, ret); \
+            _zz_fd_fuzz(h, buf, ret); \
+            _zz_fd_addpos(h, ret); \
         } \
+        _zz_fd_release(h); \
         \
         char tmp[128]; \
         debug_str(tmp, buf, ret, 8); \
@@ -420,14 +431,21 @@ RECV_T NEW(__recv_chk)(int s, void *buf, size_t len, size_t buflen, int flags)
         LOADSYM(myrecvfrom); \
         \
         ret = ORIG(myrecvfrom) myargs; \
-        if (!must_fuzz_fd(s) || !_zz_hostwatched(s)) \
+        fd_handle_t *h = must_fuzz_acquire(s); \
+        if (!h) \
             return ret; \
+        if (!_zz_hostwatched(s)) \
+        { \
+            _zz_fd_release(h); \
+            return ret; \
+        } \
         \
         if (ret > 0) \
         { \
-            _zz_fuzz(s, buf, ret); \
-            _zz_addpos(s, ret); \
+            _zz_fd_fuzz(h, buf, ret); \
+            _zz_fd_addpos(h, ret); \
         } \
+        _zz_fd_release(h); \
         \
         char tmp[128], tmp2[128]; \
         if (ret > 0 && fromlen) \
@@ -472,10 +490,17 @@ RECV_T NEW(recvmsg)(int s, struct msghdr *hdr, int flags)
     LOADSYM(recvmsg);
 
     ssize_t ret = ORIG(recvmsg)(s, hdr, flags);
-    if (!must_fuzz_fd(s) || !_zz_hostwatched(s))
+    fd_handle_t *h = must_fuzz_acquire(s);
+    if (!h)
         return ret;
+    if (!_zz_hostwatched(s))
+    {
+        _zz_fd_release(h);
+        return ret;
+    }
 
-    fuzz_iovec(s, hdr->msg_iov, ret);
+    fuzz_iovec(h, hdr->msg_iov, ret);
+    _zz_fd_release(h);
     debug("%s(%i, %p, %x) = %li", __func__, s, hdr, flags, (long int)ret);
 
     return ret;
@@ -488,13 +513,19 @@ RECV_T NEW(recvmsg)(int s, struct msghdr *hdr, int flags)
         LOADSYM(myread); \
         \
         ret = ORIG(myread) myargs; \
-        if (!must_fuzz_fd(fd) || !_zz_hostwatched(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ret; \
+        if (!_zz_hostwatched(fd)) \
+        { \
+            _zz_fd_release(h); \
+            return ret; \
+        } \
         \
         if (ret > 0) \
         { \
-            _zz_fuzz(fd, buf, ret); \
-            _zz_addpos(fd, ret); \
+            _zz_fd_fuzz(h, buf, ret); \
+            _zz_fd_addpos(h, ret); \
         } \
         \
         char tmp[128]; \
@@ -502,7 +533,8 @@ RECV_T NEW(recvmsg)(int s, struct msghdr *hdr, int flags)
         debug("%s(%i, %p, %li) = %i %s", __func__, \
               fd, buf, (long int)count, ret, tmp); \
         \
-        offset_check(fd); \
+        offset_check(h); \
+        _zz_fd_release(h); \
     } while (0)
 
 #if defined READ_USES_SSIZE_T
@@ -535,13 +567,15 @@ ssize_t NEW(readv)(int fd, const struct iovec *iov, int count)
     LOADSYM(readv);
 
     ssize_t ret = ORIG(readv)(fd, iov, count);
-    if (!must_fuzz_fd(fd))
+    fd_handle_t *h = must_fuzz_acquire(fd);
+    if (!h)
         return ret;
 
-    fuzz_iovec(fd, iov, ret);
+    fuzz_iovec(h, iov, ret);
     debug("%s(%i, %p, %i) = %li", __func__, fd, iov, count, (long int)ret);
 
-    offset_check(fd);
+    offset_check(h);
+    _zz_fd_release(h);
     return ret;
 }
 #endif
@@ -553,17 +587,15 @@ ssize_t NEW(pread)(int fd, void *buf, size_t count, off_t offset)
     LOADSYM(pread);
 
     int ret = ORIG(pread)(fd, buf, count, offset);
-    if (!must_fuzz_fd(fd))
+    fd_handle_t *h = must_fuzz_acquire(fd);
+    if (!h)
         return ret;
 
+    /* pread() does not use the file position, so neither do we: other
+     * threads may be reading the same descriptor meanwhile. */
     if (ret > 0)
-    {
-        long int curoff = _zz_getpos(fd);
-
-        _zz_setpos(fd, offset);
-        _zz_fuzz(fd, buf, ret);
-        _zz_setpos(fd, curoff);
-    }
+        _zz_fuzz_buffer(_zz_fd_getfuzz(h), offset, buf, ret);
+    _zz_fd_release(h);
 
     char tmp[128];
     debug_str(tmp, buf, ret, 8);
@@ -580,13 +612,15 @@ ssize_t NEW(pread)(int fd, void *buf, size_t count, off_t offset)
         LOADSYM(mylseek); \
         \
         ret = ORIG(mylseek)(fd, offset, whence); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ret; \
         \
         debug("%s(%i, %lli, %i) = %lli", __func__, fd, \
               (long long int)offset, whence, (long long int)ret); \
         if (ret != (off_t)-1) \
-            _zz_setpos(fd, ret); \
+            _zz_fd_setpos(h, ret); \
+        _zz_fd_release(h); \
     } while (0)
 
 #undef lseek
@@ -620,10 +654,18 @@ int NEW(aio_read)(struct aiocb *aiocbp)
     LOADSYM(aio_read);
 
     int fd = aiocbp->aio_fildes;
-    if (!g_libzzuf_ready || !_zz_iswatched(fd) || !_zz_isactive(fd))
+    fd_handle_t *h = g_libzzuf_ready ? _zz_fd_acquire(fd) : NULL;
+    if (h && !_zz_fd_isactive(h))
+    {
+        _zz_fd_release(h);
+        h = NULL;
+    }
+    if (!h)
         return ORIG(aio_read)(aiocbp);
 
-    _zz_lockfd(fd);
+    /* The lock is kept until aio_return() */
+    _zz_fd_lock(h);
+    _zz_fd_release(h);
     int ret = ORIG(aio_read)(aiocbp);
 
     debug("%s({%i, %i, %i, %p, %li, ..., %li}) = %i", __func__,
@@ -639,19 +681,23 @@ ssize_t NEW(aio_return)(struct aiocb *aiocbp)
     LOADSYM(aio_return);
 
     int fd = aiocbp->aio_fildes;
-    if (!g_libzzuf_ready || !_zz_iswatched(fd) || !_zz_isactive(fd))
+    fd_handle_t *h = g_libzzuf_ready ? _zz_fd_acquire(fd) : NULL;
+    if (h && !_zz_fd_isactive(h))
+    {
+        _zz_fd_release(h);
+        h = NULL;
+    }
+    if (!h)
         return ORIG(aio_return)(aiocbp);
 
     ssize_t ret = ORIG(aio_return)(aiocbp);
-    _zz_unlock(fd);
+    _zz_fd_unlock(h);
 
     /* FIXME: make sure we’re actually *reading* */
     if (ret > 0)
-    {
-        _zz_setpos(fd, aiocbp->aio_offset);
-        _zz_fuzz(fd, aiocbp->aio_buf, ret);
-        _zz_addpos(fd, ret);
-    }
+        _zz_fuzz_buffer(_zz_fd_getfuzz(h), aiocbp->aio_offset,
+                        aiocbp->aio_buf, ret);
+    _zz_fd_release(h);
 
     debug("%s({%i, %i, %i, %p, %li, ..., %li}) = %li", __func__,
           fd, aiocbp->aio_lio_opcode, aiocbp->aio_reqprio, aiocbp->aio_buf,
@@ -671,12 +717,21 @@ int NEW(close)(int fd)
     if (fd == g_debug_fd)
         return 0;
 
-    int ret = ORIG(close)(fd);
-    if (!g_libzzuf_ready || !_zz_iswatched(fd) || _zz_islocked(fd))
-        return ret;
+    fd_handle_t *h = g_libzzuf_ready ? _zz_fd_acquire(fd) : NULL;
+    if (!h)
+        return ORIG(close)(fd);
 
-    debug("%s(%i) = %i", __func__, fd, ret);
+    int locked = _zz_fd_islocked(h);
+    _zz_fd_release(h);
+    if (locked)
+        return ORIG(close)(fd);
+
+    /* Unregister the descriptor before closing it, otherwise another
+     * thread may get the same descriptor from open() and register it
+     * before we unregister it. */
     _zz_unregister(fd);
+    int ret = ORIG(close)(fd);
+    debug("%s(%i) = %i", __func__, fd, ret);
 
     return ret;
 }
@@ -684,7 +739,7 @@ int NEW(close)(int fd)
 /* XXX: the following functions are local */
 
 #if defined HAVE_READV || defined HAVE_RECVMSG
-static void fuzz_iovec(int fd, const struct iovec *iov, ssize_t ret)
+static void fuzz_iovec(fd_handle_t *h, const struct iovec *iov, ssize_t ret)
 {
     /* NOTE: We assume that iov countains at least <ret> bytes. */
     while (ret > 0)
@@ -695,8 +750,8 @@ static void fuzz_iovec(int fd, const struct iovec *iov, ssize_t ret)
         if (len > (size_t)ret)
             len = ret;
 
-        _zz_fuzz(fd, b, len);
-        _zz_addpos(fd, len);
+        _zz_fd_fuzz(h, b, len);
+        _zz_fd_addpos(h, len);
 
         iov++;
         ret -= len;
@@ -705,8 +760,9 @@ static void fuzz_iovec(int fd, const struct iovec *iov, ssize_t ret)
 #endif
 
 /* Sanity check, can be OK though (for instance with a character device) */
-static void offset_check(int fd)
+static void offset_check(fd_handle_t *h)
 {
+    int fd = _zz_fd_getfd(h);
     int orig_errno = errno;
 #if defined HAVE_LSEEK64
     LOADSYM(lseek64);
@@ -717,9 +773,9 @@ static void offset_check(int fd)
 
     off_t ret = ORIG(lseek)(fd, 0, SEEK_CUR);
 #endif
-    if (ret != -1 && ret != _zz_getpos(fd))
+    if (ret != -1 && ret != _zz_fd_getpos(h))
         debug("warning: lseek(%d, 0, SEEK_CUR) = %lli (expected %lli)",
-              fd, (long long int)ret, (long long int)_zz_getpos(fd));
+              fd, (long long int)ret, (long long int)_zz_fd_getpos(h));
     errno = orig_errno;
 }
 
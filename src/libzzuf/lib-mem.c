@@ -74,6 +74,7 @@
 #include "debug.h"
 #include "fuzz.h"
 #include "fd.h"
+#include "pagefault.h"
 
 #if !defined SIGKILL
 #   define SIGKILL 9
@@ -303,12 +304,27 @@ int nbmaps = 0;
             return ORIG(mymmap)(start, length, prot, flags, fd, offset); \
         \
         char *b = MAP_FAILED; \
+        size_t data_length = 0; \
+        int lazy = 0; \
         \
         ret = ORIG(mymmap)(NULL, length, prot, flags, fd, offset); \
         if (ret != MAP_FAILED && length) \
         { \
-            b = ORIG(mymmap)(start, length, PROT_READ | PROT_WRITE, \
-                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); \
+            /* If we requested a memory area larger than the end of the
+             * file, it was not actually allocated, so do not try to
+             * copy data beyond that point. */ \
+            data_length = _zz_bytes_until_eof(fd, offset - _zz_getpos(fd)); \
+            if (data_length > length) \
+                data_length = length; \
+            \
+            /* If possible, only copy and fuzz the pages that actually
+             * get accessed, using page faults. */ \
+            b = _zz_pagefault_map(start, length, ret, data_length, \
+                                  fd, offset); \
+            lazy = b != MAP_FAILED; \
+            if (!lazy) \
+                b = ORIG(mymmap)(start, length, PROT_READ | PROT_WRITE, \
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); \
             if (b == MAP_FAILED) \
             { \
                 munmap(ret, length); \
@@ -316,10 +332,9 @@ int nbmaps = 0;
             } \
         } \
         \
-        size_t data_length = 0; \
         if (b != MAP_FAILED) \
         { \
-            int i, oldpos; \
+            int i; \
             for (i = 0; i < nbmaps; i += 2) \
                 if (maps[i] == NULL) \
                     break; \
@@ -331,27 +346,20 @@ int nbmaps = 0;
             maps[i] = b; \
             maps[i + 1] = ret; \
             \
-            oldpos = _zz_getpos(fd); \
-            _zz_setpos(fd, offset); /* mmap() maps the fd at offset 0 */ \
-            /* If we requested a memory area larger than the end of the
-             * file, it was not actually allocated, so do not try to
-             * copy data beyond that point. */ \
-            data_length = _zz_bytes_until_eof(fd, offset - oldpos); \
-            if (data_length > length) \
-                data_length = length; \
-            \
-            /* FIXME: we should not blindly memcpy() here because the
-             * memory area might be immense; instead, rely on mprotect()
-             * and sigaction() to detect page faults and only copy memory
-             * areas that get accessed. */ \
-            memcpy(b, ret, data_length); \
-            _zz_fuzz(fd, (uint8_t *)b, length); \
-            _zz_setpos(fd, oldpos); \
+            if (!lazy) \
+            { \
+                int64_t oldpos = _zz_getpos(fd); \
+                _zz_setpos(fd, offset); /* mmap() maps the fd at offset 0 */ \
+                memcpy(b, ret, data_length); \
+                _zz_fuzz(fd, (uint8_t *)b, length); \
+                _zz_setpos(fd, oldpos); \
+            } \
             ret = b; \
         } \
         \
+        /* Do not touch lazy maps, just to print debug information */ \
         char tmp[128]; \
-        debug_str(tmp, (uint8_t *)b, (unsigned)data_length, 8); \
+        debug_str(tmp, (uint8_t *)b, lazy ? 0 : (unsigned)data_length, 8); \
         debug("%s(%p, %li, %i, %i, %i, %lli) = %p %s [%li]", __func__, start, \
               (long int)length, prot, flags, fd, (long long int)offset, \
               ret, tmp, (long int)data_length); \
@@ -386,6 +394,7 @@ int NEW(munmap)(void *start, size_t length)
         if (maps[i] != start)
             continue;
 
+        _zz_pagefault_unmap(start);
         ORIG(munmap)(start, length);
         int ret = ORIG(munmap)(maps[i + 1], length);
         maps[i] = NULL;
@@ -37,6 +37,7 @@
 #include "lib-load.h"
 #include "debug.h"
 #include "fuzz.h"
+#include "pagefault.h"
 
 #if defined HAVE_SIGHANDLER_T
 #   define SIG_T sighandler_t
@@ -95,10 +96,24 @@ SIG_T NEW(signal)(int signum, SIG_T handler)
 {
     LOADSYM(signal);
 
+    if (g_disable_sighandlers && isfatal(signum))
+        handler = SIG_DFL;
+
+#if defined HAVE_SIGACTION
+    /* Lazy mmap() fuzzing may need to keep its own SIGSEGV handler */
+    struct sigaction act, oldact;
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = handler;
+    act.sa_flags = SA_RESTART;
+    if (_zz_pagefault_sigaction(signum, &act, &oldact))
+        return oldact.sa_handler;
+#endif
+
     if (!g_disable_sighandlers)
         return ORIG(signal)(signum, handler);
 
-    SIG_T ret = ORIG(signal)(signum, isfatal(signum) ? SIG_DFL : handler);
+    SIG_T ret = ORIG(signal)(signum, handler);
 
     debug("%s(%i, %p) = %p", __func__, signum, handler, ret);
 
@@ -112,20 +127,22 @@ int NEW(sigaction)(int signum, const struct sigaction *act,
 {
     LOADSYM(sigaction);
 
-    if (!g_disable_sighandlers)
-        return ORIG(sigaction)(signum, act, oldact);
-
-    int ret;
-
-    if (act && isfatal(signum))
+    struct sigaction newact;
+    if (g_disable_sighandlers && act && isfatal(signum))
     {
-        struct sigaction newact;
         memcpy(&newact, act, sizeof(struct sigaction));
         newact.sa_handler = SIG_DFL;
-        ret = ORIG(sigaction)(signum, &newact, oldact);
+        act = &newact;
     }
-    else
-        ret = ORIG(sigaction)(signum, act, oldact);
+
+    /* Lazy mmap() fuzzing may need to keep its own SIGSEGV handler */
+    if (_zz_pagefault_sigaction(signum, act, oldact))
+        return 0;
+
+    if (!g_disable_sighandlers)
+        return ORIG(sigaction)(signum, act, oldact);
+
+    int ret = ORIG(sigaction)(signum, act, oldact);
 
     debug("%s(%i, %p, %p) = %i", __func__, signum, act, oldact, ret);
 
@@ -38,7 +38,7 @@
 #   include <inttypes.h>
 #endif
 #include <stdlib.h>
-#include <string.h> /* Needed for memcpy */
+#include <string.h> /* Needed for memcpy and strchr */
 
 #include <stdio.h>
 #include <sys/types.h>
@@ -57,6 +57,7 @@
 #include "debug.h"
 #include "fuzz.h"
 #include "fd.h"
+#include "forkserver.h"
 
 #if defined HAVE_FPOS64_T
 #   define FPOS64_T fpos64_t
@@ -280,6 +281,16 @@ static inline void debug_stream(char const *prefix, FILE *s)
  * and immediately fuzz whatever's preloaded in the stream structure.
  */
 
+/* Like the open() wrappers, only let streams that may be read from
+ * become the fork point, and not those opened by the libc itself. */
+#define FORKSERVER_OPEN(path, mode) \
+    do \
+    { \
+        if (path && !_zz_islocked(-1) \
+            && ((mode)[0] == 'r' || strchr(mode, '+'))) \
+            _zz_forkserver_open(path); \
+    } while (0)
+
 #define ZZ_FOPEN(myfopen) \
     do \
     { \
@@ -287,6 +298,7 @@ static inline void debug_stream(char const *prefix, FILE *s)
         \
         if (!g_libzzuf_ready) \
             return ORIG(myfopen)(path, mode); \
+        FORKSERVER_OPEN(path, mode); \
         _zz_lockfd(-1); \
         ret = ORIG(myfopen)(path, mode); \
         _zz_unlock(-1); \
@@ -305,6 +317,9 @@ static inline void debug_stream(char const *prefix, FILE *s)
     { \
         LOADSYM(myfreopen); \
         \
+        if (g_libzzuf_ready) \
+            FORKSERVER_OPEN(path, mode); \
+        \
         int fd0 = -1, fd1 = -1, disp = 0; \
         if (g_libzzuf_ready && (fd0 = fileno(stream)) >= 0 && _zz_iswatched(fd0)) \
         { \
@@ -418,7 +433,8 @@ static int const shuffle[256] =
         LOADSYM(myfseek); \
         \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myfseek)(stream, offset, whence); \
         \
         debug_stream("before", stream); \
@@ -438,9 +454,9 @@ static int const shuffle[256] =
             buf[i] = shuffle[(i + seed) & 0xff]; \
         } \
         \
-        _zz_lockfd(fd); \
+        _zz_fd_lock(h); \
         ret = ORIG(myfseek)(stream, offset, whence); \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         \
         int64_t newpos = ZZ_FTELL(stream); \
         int newoff = get_streambuf_offset(stream); \
@@ -462,10 +478,11 @@ static int const shuffle[256] =
         debug_stream(changed ? "modified" : "unchanged", stream); \
         if (changed) \
         { \
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream)); \
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream)); \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         debug("%s([%i], %lli, %s) = %i", __func__, \
               fd, (long long int)offset, get_seek_mode_name(whence), ret); \
@@ -483,7 +500,8 @@ static int const shuffle[256] =
         LOADSYM(myfsetpos); \
         \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myfsetpos)(stream, pos); \
         \
         debug_stream("before", stream); \
@@ -491,9 +509,9 @@ static int const shuffle[256] =
         int64_t oldpos = ZZ_FTELL(stream); \
         int oldoff = get_streambuf_offset(stream); \
         int oldcnt = get_streambuf_count(stream); \
-        _zz_lockfd(fd); \
+        _zz_fd_lock(h); \
         ret = ORIG(myfsetpos)(stream, pos); \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         int64_t newpos = ZZ_FTELL(stream); \
         int newcnt = get_streambuf_count(stream); \
         int changed = (newpos > oldpos + oldcnt || newpos < oldpos - oldoff \
@@ -501,10 +519,11 @@ static int const shuffle[256] =
         debug_stream(changed ? "modified" : "unchanged", stream); \
         if (changed) \
         { \
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream)); \
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream)); \
         } \
-        _zz_setpos(fd, FPOS_T_TO_INT64_T(*pos)); \
+        _zz_fd_setpos(h, FPOS_T_TO_INT64_T(*pos)); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         debug("%s([%i], %lli) = %i", __func__, \
               fd, (long long int)FPOS_T_TO_INT64_T(*pos), ret); \
@@ -517,7 +536,8 @@ static int const shuffle[256] =
         LOADSYM(rewind); \
         \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
         { \
             ORIG(rewind)(stream); \
             return; \
@@ -527,9 +547,9 @@ static int const shuffle[256] =
         int64_t oldpos = ZZ_FTELL(stream); \
         int oldoff = get_streambuf_offset(stream); \
         int oldcnt = get_streambuf_count(stream); \
-        _zz_lockfd(fd); \
+        _zz_fd_lock(h); \
         ORIG(rewind)(stream); \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         int64_t newpos = ZZ_FTELL(stream); \
         int newcnt = get_streambuf_count(stream); \
         int changed = (newpos > oldpos + oldcnt || newpos < oldpos - oldoff \
@@ -537,10 +557,11 @@ static int const shuffle[256] =
         debug_stream(changed ? "modified" : "unchanged", stream); \
         if (changed) \
         { \
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream)); \
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream)); \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         debug("%s([%i])", __func__, fd); \
     } while (0)
@@ -613,16 +634,17 @@ void NEW(rewind)(FILE *stream)
         \
         uint8_t *b = (uint8_t *)ptr; \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myfread) myargs; \
         \
         debug_stream("before", stream); \
         /* FIXME: ftell() will return -1 on a pipe such as stdin */ \
         int64_t oldpos = ZZ_FTELL(stream); \
         int oldcnt = get_streambuf_count(stream); \
-        _zz_lockfd(fd); \
+        _zz_fd_lock(h); \
         ret = ORIG(myfread) myargs; \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         int64_t newpos = ZZ_FTELL(stream); \
         int newcnt = get_streambuf_count(stream); \
         int changed = (newpos > oldpos + oldcnt \
@@ -632,13 +654,14 @@ void NEW(rewind)(FILE *stream)
         { \
             /* The internal stream buffer is completely different, so we need
              * to fuzz it entirely. */ \
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream)); \
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream)); \
             /* Fuzz returned data that wasn't in the old internal buffer */ \
-            _zz_setpos(fd, oldpos + oldcnt); \
-            _zz_fuzz(fd, b + oldcnt, newpos - oldpos - oldcnt); \
+            _zz_fd_setpos(h, oldpos + oldcnt); \
+            _zz_fd_fuzz(h, b + oldcnt, newpos - oldpos - oldcnt); \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         \
         char tmp[128]; \
@@ -703,15 +726,16 @@ size_t NEW(__fread_unlocked_chk)(void *ptr, size_t ptrlen, size_t size,
         LOADSYM(myfgetc); \
         \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myfgetc)(arg); \
         \
         debug_stream("before", stream); \
         int64_t oldpos = ZZ_FTELL(stream); \
         int oldcnt = get_streambuf_count(stream); \
-        _zz_lockfd(fd); \
+        _zz_fd_lock(h); \
         ret = ORIG(myfgetc)(arg); \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         int64_t newpos = ZZ_FTELL(stream); \
         int newcnt = get_streambuf_count(stream); \
         int changed = (newpos > oldpos + oldcnt \
@@ -721,17 +745,18 @@ size_t NEW(__fread_unlocked_chk)(void *ptr, size_t ptrlen, size_t size,
         { \
             /* Fuzz returned data that wasn't in the old internal buffer */ \
             uint8_t ch = ret; \
-            _zz_setpos(fd, oldpos); \
-            _zz_fuzz(fd, &ch, 1); \
+            _zz_fd_setpos(h, oldpos); \
+            _zz_fd_fuzz(h, &ch, 1); \
             ret = ch; \
         } \
         if (changed) \
         { \
             /* Fuzz the internal stream buffer */ \
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream)); \
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream)); \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         if (ret == EOF) \
             debug("%s([%i]) = EOF", __func__, fd); \
@@ -801,7 +826,8 @@ int NEW(fgetc_unlocked)(FILE *stream)
         \
         ret = s; \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myfgets) myargs; \
         \
         debug_stream("before", stream); \
@@ -817,16 +843,16 @@ int NEW(fgetc_unlocked)(FILE *stream)
             for (int i = 0; i < size - 1; ++i) \
             { \
                 int chr; \
-                _zz_lockfd(fd); \
+                _zz_fd_lock(h); \
                 chr = ORIG(myfgetc)(stream); \
-                _zz_unlock(fd); \
+                _zz_fd_unlock(h); \
                 newpos = oldpos + 1; \
                 if (oldcnt == 0 && chr != EOF) \
                 { \
                     /* Fuzz returned data that wasn't in the old buffer */ \
                     uint8_t ch = chr; \
-                    _zz_setpos(fd, oldpos); \
-                    _zz_fuzz(fd, &ch, 1); \
+                    _zz_fd_setpos(h, oldpos); \
+                    _zz_fd_fuzz(h, &ch, 1); \
                     chr = ch; \
                 } \
                 int newcnt = get_streambuf_count(stream); \
@@ -834,8 +860,8 @@ int NEW(fgetc_unlocked)(FILE *stream)
                      || (newpos == oldpos + oldcnt && newcnt != 0)) \
                 { \
                     /* Fuzz the internal stream buffer, if necessary */ \
-                    _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-                    _zz_fuzz(fd, get_streambuf_base(stream), \
+                    _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+                    _zz_fd_fuzz(h, get_streambuf_base(stream), \
                                  get_streambuf_size(stream)); \
                 } \
                 oldpos = newpos; \
@@ -855,7 +881,8 @@ int NEW(fgetc_unlocked)(FILE *stream)
                 } \
             } \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         debug("%s(%p, %i, [%i]) = %p", __func__, s, size, fd, ret); \
     } while (0)
@@ -910,15 +937,17 @@ int NEW(ungetc)(int c, FILE *stream)
     LOADSYM(ungetc);
 
     int fd = fileno(stream);
-    if (!must_fuzz_fd(fd))
+    fd_handle_t *h = must_fuzz_acquire(fd);
+    if (!h)
         return ORIG(ungetc)(c, stream);
 
     debug_stream("before", stream);
     int oldpos = ZZ_FTELL(stream);
-    _zz_lockfd(fd);
+    _zz_fd_lock(h);
     int ret = ORIG(ungetc)(c, stream);
-    _zz_unlock(fd);
-    _zz_setpos(fd, oldpos - 1);
+    _zz_fd_unlock(h);
+    _zz_fd_setpos(h, oldpos - 1);
+    _zz_fd_release(h);
 
     debug_stream("after", stream);
     if (ret == EOF)
@@ -941,12 +970,12 @@ int NEW(fclose)(FILE *fp)
     if (!g_libzzuf_ready || !_zz_iswatched(fd))
         return ORIG(fclose)(fp);
 
+    /* Unregister the descriptor before closing it, for the same reason
+     * as in close(). This also prevents close() from doing it. */
     debug_stream("before", fp);
-    _zz_lockfd(fd);
+    _zz_unregister(fd);
     int ret = ORIG(fclose)(fp);
-    _zz_unlock(fd);
     debug("%s([%i]) = %i", __func__, fd, ret);
-    _zz_unregister(fd);
 
     return ret;
 }
@@ -962,7 +991,8 @@ int NEW(fclose)(FILE *fp)
         LOADSYM(fgetc); \
         \
         int fd = fileno(stream); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(getdelim)(lineptr, n, delim, stream); \
         \
         debug_stream("before", stream); \
@@ -986,16 +1016,16 @@ int NEW(fclose)(FILE *fp)
                 *lineptr = line; \
                 break; \
             } \
-            _zz_lockfd(fd); \
+            _zz_fd_lock(h); \
             chr = ORIG(fgetc)(stream); \
-            _zz_unlock(fd); \
+            _zz_fd_unlock(h); \
             newpos = oldpos + 1; \
             if (oldcnt == 0 && chr != EOF) \
             { \
                 /* Fuzz returned data that wasn't in the old buffer */ \
                 uint8_t ch = chr; \
-                _zz_setpos(fd, oldpos); \
-                _zz_fuzz(fd, &ch, 1); \
+                _zz_fd_setpos(h, oldpos); \
+                _zz_fd_fuzz(h, &ch, 1); \
                 chr = ch; \
             } \
             int newcnt = get_streambuf_count(stream); \
@@ -1003,8 +1033,8 @@ int NEW(fclose)(FILE *fp)
                  || (newpos == oldpos + oldcnt && newcnt != 0)) \
             { \
                 /* Fuzz the internal stream buffer, if necessary */ \
-                _zz_setpos(fd, newpos - get_streambuf_offset(stream)); \
-                _zz_fuzz(fd, get_streambuf_base(stream), \
+                _zz_fd_setpos(h, newpos - get_streambuf_offset(stream)); \
+                _zz_fd_fuzz(h, get_streambuf_base(stream), \
                              get_streambuf_size(stream)); \
             } \
             oldpos = newpos; \
@@ -1025,7 +1055,8 @@ int NEW(fclose)(FILE *fp)
                 } \
             } \
         } \
-        _zz_setpos(fd, newpos); \
+        _zz_fd_setpos(h, newpos); \
+        _zz_fd_release(h); \
         debug_stream("after", stream); \
         if (need_delim) \
             debug("%s(%p, %p, '%c', [%i]) = %li", __func__, \
@@ -1072,7 +1103,8 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
     LOADSYM(fgetc);
 
     int fd = fileno(stream);
-    if (!must_fuzz_fd(fd))
+    fd_handle_t *h = must_fuzz_acquire(fd);
+    if (!h)
         return ORIG(fgetln)(stream, len);
 
     debug_stream("before", stream);
@@ -1081,22 +1113,22 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
     int oldcnt = get_streambuf_count(stream);
     int64_t newpos = oldpos;
 
-    fuzz_context_t *fuzz = _zz_getfuzz(fd);
+    fuzz_context_t *fuzz = _zz_fd_getfuzz(h);
 
     size_t i = 0, size = 0;
     do
     {
-        _zz_lockfd(fd);
+        _zz_fd_lock(h);
         int chr = ORIG(fgetc)(stream);
-        _zz_unlock(fd);
+        _zz_fd_unlock(h);
 
         newpos = oldpos + 1;
         if (oldcnt == 0 && chr != EOF)
         {
             /* Fuzz returned data that wasn't in the old buffer */
             uint8_t ch = chr;
-            _zz_setpos(fd, oldpos);
-            _zz_fuzz(fd, &ch, 1);
+            _zz_fd_setpos(h, oldpos);
+            _zz_fd_fuzz(h, &ch, 1);
             chr = ch;
         }
 
@@ -1105,8 +1137,8 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
              || (newpos == oldpos + oldcnt && newcnt != 0))
         {
             /* Fuzz the internal stream buffer, if necessary */
-            _zz_setpos(fd, newpos - get_streambuf_offset(stream));
-            _zz_fuzz(fd, get_streambuf_base(stream), get_streambuf_size(stream));
+            _zz_fd_setpos(h, newpos - get_streambuf_offset(stream));
+            _zz_fd_fuzz(h, get_streambuf_base(stream), get_streambuf_size(stream));
         }
         oldpos = newpos;
         oldcnt = newcnt;
@@ -1124,6 +1156,7 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
 
     *len = i;
     char *ret = fuzz->tmp;
+    _zz_fd_release(h);
 
     debug_stream("after", stream);
     debug("%s([%i], &%li) = %p", __func__, fd, (long int)*len, ret);
@@ -1147,15 +1180,16 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
         LOADSYM(myrefill); \
         \
         int fd = fileno(fp); \
-        if (!must_fuzz_fd(fd)) \
+        fd_handle_t *h = must_fuzz_acquire(fd); \
+        if (!h) \
             return ORIG(myrefill)(fp); \
         \
         debug_stream("before", fp); \
-        int64_t pos = _zz_getpos(fd); \
-        _zz_lockfd(fd); \
+        int64_t pos = _zz_fd_getpos(h); \
+        _zz_fd_lock(h); \
         ret = ORIG(myrefill)(fp); \
         off_t newpos = lseek(fd, 0, SEEK_CUR); \
-        _zz_unlock(fd); \
+        _zz_fd_unlock(h); \
         debug_stream("during", fp); \
         if (ret != EOF) \
         { \
@@ -1164,28 +1198,29 @@ char *NEW(fgetln)(FILE *stream, size_t *len)
             { \
                 uint8_t ch = (uint8_t)(unsigned int)ret; \
                 if (newpos != -1) \
-                    _zz_setpos(fd, newpos - get_streambuf_count(fp) - 1); \
-                already_fuzzed = _zz_getfuzzed(fd); \
-                _zz_fuzz(fd, &ch, 1); \
+                    _zz_fd_setpos(h, newpos - get_streambuf_count(fp) - 1); \
+                already_fuzzed = _zz_fd_getfuzzed(h); \
+                _zz_fd_fuzz(h, &ch, 1); \
                 ret = get_streambuf_pos(fp)[-1] = ch; \
-                _zz_setfuzzed(fd, get_streambuf_count(fp) + 1); \
-                _zz_addpos(fd, 1); \
+                _zz_fd_setfuzzed(h, get_streambuf_count(fp) + 1); \
+                _zz_fd_addpos(h, 1); \
             } \
             else \
             { \
-                _zz_setfuzzed(fd, get_streambuf_count(fp)); \
+                _zz_fd_setfuzzed(h, get_streambuf_count(fp)); \
                 if (newpos != -1) \
-                    _zz_setpos(fd, newpos - get_streambuf_count(fp)); \
+                    _zz_fd_setpos(h, newpos - get_streambuf_count(fp)); \
             } \
             if (get_streambuf_count(fp) > already_fuzzed) \
             { \
-                _zz_addpos(fd, already_fuzzed); \
-                _zz_fuzz(fd, get_streambuf_pos(fp), \
+                _zz_fd_addpos(h, already_fuzzed); \
+                _zz_fd_fuzz(h, get_streambuf_pos(fp), \
                              get_streambuf_count(fp) - already_fuzzed); \
             } \
-            _zz_addpos(fd, get_streambuf_count(fp) - already_fuzzed); \
+            _zz_fd_addpos(h, get_streambuf_count(fp) - already_fuzzed); \
         } \
-        _zz_setpos(fd, pos); /* FIXME: do we always need to do this? */ \
+        _zz_fd_setpos(h, pos); /* FIXME: do we always need to do this? */ \
+        _zz_fd_release(h); \
         debug_stream("after", fp); \
         if (REFILL_RETURNS_INT) \
             debug("%s([%i]) = %i", __func__, fd, ret); \
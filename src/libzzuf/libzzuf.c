@@ -37,6 +37,9 @@
 #if defined HAVE_UNISTD_H
 #   include <unistd.h>
 #endif
+#if defined HAVE_SYS_RESOURCE_H
+#   include <sys/resource.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -47,10 +50,32 @@
 #include "debug.h"
 #include "fd.h"
 #include "network.h"
+#include "pagefault.h"
+#include "forkserver.h"
+#include "persistent.h"
 #include "sys.h"
 #include "fuzz.h"
 #include "util/mutex.h"
 
+/* Same choice of limits as in zzuf */
+#if defined RLIMIT_AS
+#   define ZZUF_RLIMIT_MEM RLIMIT_AS
+#elif defined RLIMIT_VMEM
+#   define ZZUF_RLIMIT_MEM RLIMIT_VMEM
+#elif defined RLIMIT_DATA
+#   define ZZUF_RLIMIT_MEM RLIMIT_DATA
+#else
+#   undef ZZUF_RLIMIT_MEM
+#endif
+
+#if defined RLIMIT_CPU
+#   define ZZUF_RLIMIT_CPU RLIMIT_CPU
+#else
+#   undef ZZUF_RLIMIT_CPU
+#endif
+
+static void set_limits(char const *, char const *);
+
 #if defined HAVE_WINDOWS_H
 BOOL WINAPI DllMain(HINSTANCE, DWORD, PVOID);
 #endif
@@ -109,7 +134,7 @@ int g_network_fuzzing = 0;
 void libzzuf_init(void)
 {
     /* Make sure we don't get initialised more than once */
-    static zzuf_mutex_t mutex = 0;
+    static zzuf_mutex_t mutex = ZZUF_MUTEX_INIT("init");
     static int initialised = 0;
     zzuf_mutex_lock(&mutex);
     if (initialised++)
@@ -132,6 +157,10 @@ void libzzuf_init(void)
         g_debug_fd = atoi(tmp);
 #endif
 
+    /* zzuf also sets the limits, but the program may already be running
+     * by then: make sure they apply to everything it does */
+    set_limits(getenv("ZZUF_MEMORY"), getenv("ZZUF_CPUTIME"));
+
     /* We need malloc() and a few others as soon as possible */
     _zz_mem_init();
 
@@ -152,6 +181,14 @@ void libzzuf_init(void)
     if (tmp && *tmp)
         _zz_fuzzing(tmp);
 
+    tmp = getenv("ZZUF_GENERATOR");
+    if (tmp && *tmp)
+        _zz_generator(tmp);
+
+    tmp = getenv("ZZUF_CHUNKCACHE");
+    if (tmp && *tmp)
+        _zz_chunk_cache(atoi(tmp));
+
     tmp = getenv("ZZUF_BYTES");
     if (tmp && *tmp)
         _zz_bytes(tmp);
@@ -196,6 +233,10 @@ void libzzuf_init(void)
     if (tmp)
         g_memory_limit = atoi(tmp);
 
+    tmp = getenv("ZZUF_LAZYMMAP");
+    if (tmp && *tmp)
+        _zz_pagefault_mode(tmp);
+
     tmp = getenv("ZZUF_NETWORK");
     if (tmp && *tmp == '1')
         g_network_fuzzing = 1;
@@ -204,6 +245,16 @@ void libzzuf_init(void)
     _zz_network_init();
     _zz_sys_init();
 
+    /* Fork servers started here only return in their children, before
+     * any descriptor is registered so that each child uses its own seed. */
+    tmp = getenv("ZZUF_FORKSERVER");
+    if (tmp && *tmp)
+        _zz_forkserver_init(tmp, getenv("ZZUF_FORKPOINT"));
+
+    tmp = getenv("ZZUF_PERSISTENT");
+    if (tmp && *tmp)
+        _zz_persistent_init(tmp, getenv("ZZUF_PERSISTENTFD"));
+
     tmp = getenv("ZZUF_STDIN");
     if (tmp && *tmp == '1')
         _zz_register(0);
@@ -225,12 +276,47 @@ void libzzuf_fini(void)
 
     debug("libzzuf finishing for PID %li", (long int)getpid());
 
+    for (zzuf_mutex_t *m = zzuf_mutex_next_contended(NULL); m;
+         m = zzuf_mutex_next_contended(m))
+        debug2("%s lock: %i contended, %i slept", m->name,
+               m->contended, m->waits);
+
     _zz_fd_fini();
     _zz_network_fini();
 
     g_libzzuf_ready = 0;
 }
 
+/**
+ * Apply the memory and CPU time limits given to zzuf with the -M and -T
+ * flags, the same way zzuf does.
+ */
+static void set_limits(char const *mem, char const *cpu)
+{
+#if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
+    if (mem && *mem)
+    {
+        struct rlimit rlim;
+        rlim.rlim_cur = (uint64_t)atoi(mem) * 1048576;
+        rlim.rlim_max = (uint64_t)atoi(mem) * 1048576;
+        setrlimit(ZZUF_RLIMIT_MEM, &rlim);
+    }
+#endif
+
+#if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_CPU
+    if (cpu && *cpu)
+    {
+        struct rlimit rlim;
+        rlim.rlim_cur = atoi(cpu);
+        rlim.rlim_max = atoi(cpu) + 5;
+        setrlimit(ZZUF_RLIMIT_CPU, &rlim);
+    }
+#endif
+
+    (void)mem;
+    (void)cpu;
+}
+
 #if defined HAVE_WINDOWS_H
 BOOL WINAPI DllMain(HINSTANCE hinst, DWORD reason, PVOID impLoad)
 {
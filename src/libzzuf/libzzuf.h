@@ -48,3 +48,33 @@ static inline int must_fuzz_fd(int fd)
             && !_zz_islocked(fd) && _zz_isactive(fd);
 }
 
+/* Same as must_fuzz_fd(), but returns a handle to the file descriptor,
+ * which must then be given back with _zz_fd_release(). */
+static inline fd_handle_t *must_fuzz_acquire(int fd)
+{
+    if (!g_libzzuf_ready)
+        return NULL;
+
+    fd_handle_t *h = _zz_fd_acquire(fd);
+    if (h && (_zz_fd_islocked(h) || !_zz_fd_isactive(h)))
+    {
+        _zz_fd_release(h);
+        return NULL;
+    }
+
+    return h;
+}
+
+/* Whether a watched file descriptor is active, for functions that create
+ * a new file descriptor from it */
+static inline int is_active_fd(int fd)
+{
+    fd_handle_t *h = _zz_fd_acquire(fd);
+    if (!h)
+        return 0;
+
+    int ret = _zz_fd_isactive(h);
+    _zz_fd_release(h);
+    return ret;
+}
+
@@ -0,0 +1,729 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  pagefault.c: lazy fuzzing of memory mapped files
+ *
+ *  Instead of copying and fuzzing a whole file when it is mapped, we
+ *  reserve an anonymous memory area and only fill the pages that the
+ *  program actually accesses. Page faults are caught with userfaultfd
+ *  where available, or by protecting the area with mprotect() and
+ *  catching SIGSEGV otherwise. In both cases, a page is filled elsewhere
+ *  and then moved in place, so that other threads never see it before it
+ *  is fuzzed.
+ */
+
+#include "config.h"
+
+/* Need this for siginfo_t and MAP_ANON */
+#define _GNU_SOURCE
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#if defined HAVE_SYS_CDEFS_H
+#   include <sys/cdefs.h>
+#endif
+/* Need this for struct sigaction on HP-UX */
+#define _INCLUDE_POSIX_SOURCE
+/* Need this for struct sigaction on OpenSolaris */
+#define __EXTENSIONS__
+
+#if defined HAVE_STDINT_H
+#   include <stdint.h>
+#elif defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#if defined HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+#if defined HAVE_LINUX_USERFAULTFD_H
+#   include <fcntl.h>
+#   include <poll.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <linux/userfaultfd.h>
+#endif
+
+#include "libzzuf.h"
+#include "lib-load.h"
+#include "debug.h"
+#include "fuzz.h"
+#include "fd.h"
+#include "pagefault.h"
+#include "util/mutex.h"
+
+#if defined HAVE_MMAP
+
+#if !defined MAP_ANONYMOUS
+#   define MAP_ANONYMOUS MAP_ANON
+#endif
+#if !defined MAP_NORESERVE
+#   define MAP_NORESERVE 0
+#endif
+
+#if defined HAVE_LINUX_USERFAULTFD_H && defined HAVE_PTHREAD_H \
+     && defined __NR_userfaultfd
+#   define USE_USERFAULTFD 1
+#endif
+/* Without mremap(), the SIGSEGV handler could only make a page accessible
+ * before filling it, and other threads could read it meanwhile */
+#if defined HAVE_SIGACTION && defined SA_SIGINFO \
+     && defined HAVE_MREMAP && defined MREMAP_FIXED
+#   define USE_SIGSEGV 1
+#endif
+
+/* Library functions that we need to call without being diverted */
+static void *  (*ORIG(mmap))      (void *start, size_t length, int prot,
+                                   int flags, int fd, off_t offset);
+#if defined USE_SIGSEGV
+static int     (*ORIG(sigaction)) (int signum, const struct sigaction *act,
+                                   struct sigaction *oldact);
+#endif
+
+/* We do not allocate anything when looking up a faulting address or
+ * filling a page, so that the signal handler can safely do both. */
+#define MAX_LAZY_MAPS 256
+
+struct lazy_map
+{
+    uint8_t *start;
+    size_t length, data_length;
+    uint8_t const *orig;
+    int64_t offset;
+    /* Bitmap of pages that were already filled */
+    uint8_t *filled;
+    /* Private copy of the file's fuzzing context, since the file
+     * descriptor may be closed while the map is still in use. With
+     * SIGSEGV, its chunk cache is allocated beforehand. */
+    fuzz_context_t fuzz;
+};
+
+static struct lazy_map *lazy_maps[MAX_LAZY_MAPS];
+static zzuf_mutex_t lazy_mutex = ZZUF_MUTEX_INIT("lazy map");
+static size_t page_size;
+
+static enum method
+{
+    METHOD_NONE,
+    METHOD_AUTO,
+    METHOD_SIGSEGV,
+    METHOD_USERFAULTFD,
+}
+wanted = METHOD_NONE, method = METHOD_NONE;
+
+static int initialised = 0;
+
+static void init(void);
+static void free_map(struct lazy_map *);
+static struct lazy_map *find_map(uintptr_t);
+static int is_filled(struct lazy_map const *, size_t);
+static void set_filled(struct lazy_map *, size_t);
+static void fill_page(struct lazy_map *, size_t, uint8_t *);
+static void fill_all(struct lazy_map *);
+
+#if defined USE_USERFAULTFD
+static int uffd = -1;
+static int init_userfaultfd(void);
+static int uffd_register(void *, size_t);
+static void *uffd_thread(void *);
+static void uffd_prepare(void);
+static void uffd_parent(void);
+static void uffd_child(void);
+#endif
+
+#if defined USE_SIGSEGV
+static struct sigaction next_segv, next_bus;
+/* Where the SIGSEGV handler fills the next page, before moving it */
+static uint8_t *scratch = MAP_FAILED;
+static int init_sigsegv(void);
+static void sigsegv_handler(int, siginfo_t *, void *);
+static void install_page(struct lazy_map *, size_t);
+static void install_all(struct lazy_map *);
+#endif
+
+void _zz_pagefault_mode(char const *mode)
+{
+    if (!strcmp(mode, "signal"))
+        wanted = METHOD_SIGSEGV;
+    else if (!strcmp(mode, "0"))
+        wanted = METHOD_NONE;
+    else
+        wanted = METHOD_AUTO;
+}
+
+/* Reserve a memory area that will be filled with the fuzzed contents of
+ * “orig” as pages get accessed. Return MAP_FAILED if this is not possible,
+ * in which case the caller should copy and fuzz the data itself. */
+void *_zz_pagefault_map(void *start, size_t length, void const *orig,
+                        size_t data_length, int fd, int64_t offset)
+{
+    if (wanted == METHOD_NONE)
+        return MAP_FAILED;
+
+    zzuf_mutex_lock(&lazy_mutex);
+    if (!initialised)
+        init();
+    zzuf_mutex_unlock(&lazy_mutex);
+
+    if (method == METHOD_NONE)
+        return MAP_FAILED;
+
+    size_t npages = (length + page_size - 1) / page_size;
+    struct lazy_map *map = malloc(sizeof(*map));
+    uint8_t *filled = calloc((npages + 7) / 8, 1);
+    void *b = MAP_FAILED;
+
+    /* Do not reserve swap space for the whole area, since we expect
+     * most of it to never be accessed. */
+    if (map && filled)
+        b = ORIG(mmap)(start, length, method == METHOD_SIGSEGV ? PROT_NONE
+                                       : PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+#if defined USE_USERFAULTFD
+    if (b != MAP_FAILED && method == METHOD_USERFAULTFD)
+    {
+        if (uffd_register(b, length) < 0)
+        {
+            munmap(b, length);
+            b = MAP_FAILED;
+        }
+    }
+#endif
+
+    fd_handle_t *h = b == MAP_FAILED ? NULL : _zz_fd_acquire(fd);
+    if (!h)
+    {
+        if (b != MAP_FAILED)
+            munmap(b, length);
+        free(map);
+        free(filled);
+        return MAP_FAILED;
+    }
+
+    fuzz_context_t *fuzz = _zz_fd_getfuzz(h);
+    memset(&map->fuzz, 0, sizeof(map->fuzz));
+    map->fuzz.seed = fuzz->seed;
+    map->fuzz.ratio = fuzz->ratio;
+    _zz_fd_release(h);
+    map->start = b;
+    map->length = length;
+    map->data_length = data_length;
+    map->orig = orig;
+    map->offset = offset;
+    map->filled = filled;
+
+    /* The signal handler must not allocate memory */
+    if (method == METHOD_SIGSEGV && _zz_fuzz_reserve(&map->fuzz) < 0)
+    {
+        munmap(b, length);
+        free_map(map);
+        return MAP_FAILED;
+    }
+
+    zzuf_mutex_lock(&lazy_mutex);
+    int i;
+    for (i = 0; i < MAX_LAZY_MAPS; ++i)
+        if (!lazy_maps[i])
+        {
+            lazy_maps[i] = map;
+            break;
+        }
+    zzuf_mutex_unlock(&lazy_mutex);
+
+    if (i == MAX_LAZY_MAPS)
+    {
+        munmap(b, length);
+        free_map(map);
+        return MAP_FAILED;
+    }
+
+    debug2("... lazy map %p for %i, @%lli, %lli bytes", b, fd,
+           (long long int)offset, (long long int)length);
+
+    return b;
+}
+
+/* Forget about a lazy map; this must be called before the memory area
+ * is unmapped. */
+void _zz_pagefault_unmap(void *start)
+{
+    struct lazy_map *map = NULL;
+
+    zzuf_mutex_lock(&lazy_mutex);
+    for (int i = 0; i < MAX_LAZY_MAPS; ++i)
+        if (lazy_maps[i] && lazy_maps[i]->start == start)
+        {
+            map = lazy_maps[i];
+            lazy_maps[i] = NULL;
+            break;
+        }
+    zzuf_mutex_unlock(&lazy_mutex);
+
+    if (map)
+        free_map(map);
+}
+
+/* Our SIGSEGV and SIGBUS handlers must stay in place when the program
+ * installs its own; we call the program's handlers ourselves for faults
+ * that do not belong to a lazy map. Return 1 if the call was handled. */
+int _zz_pagefault_sigaction(int signum, struct sigaction const *act,
+                            struct sigaction *oldact)
+{
+#if defined USE_SIGSEGV
+    struct sigaction *next = signum == SIGSEGV ? &next_segv
+#   if defined SIGBUS
+                           : signum == SIGBUS ? &next_bus
+#   endif
+                           : NULL;
+
+    if (method != METHOD_SIGSEGV || !next)
+        return 0;
+
+    if (oldact)
+        memcpy(oldact, next, sizeof(struct sigaction));
+    if (act)
+        memcpy(next, act, sizeof(struct sigaction));
+
+    return 1;
+#else
+    (void)signum;
+    (void)act;
+    (void)oldact;
+
+    return 0;
+#endif
+}
+
+/* Called with lazy_mutex held */
+static void init(void)
+{
+    initialised = 1;
+    method = METHOD_NONE;
+
+    LOADSYM(mmap);
+
+#if defined _SC_PAGESIZE
+    page_size = sysconf(_SC_PAGESIZE);
+#elif defined HAVE_GETPAGESIZE
+    page_size = getpagesize();
+#else
+    page_size = 4096;
+#endif
+
+#if defined USE_USERFAULTFD
+    if (wanted == METHOD_AUTO && init_userfaultfd() == 0)
+    {
+        method = METHOD_USERFAULTFD;
+        debug("lazy mmap() fuzzing using userfaultfd");
+        return;
+    }
+#endif
+
+#if defined USE_SIGSEGV
+    if (init_sigsegv() == 0)
+    {
+        method = METHOD_SIGSEGV;
+        debug("lazy mmap() fuzzing using SIGSEGV");
+        return;
+    }
+#endif
+
+    debug("lazy mmap() fuzzing not available");
+}
+
+static void free_map(struct lazy_map *map)
+{
+    for (int i = 0; i < map->fuzz.nchunks; ++i)
+        free(map->fuzz.chunks[i]);
+    free(map->filled);
+    free(map);
+}
+
+/* Called with lazy_mutex held */
+static struct lazy_map *find_map(uintptr_t addr)
+{
+    for (int i = 0; i < MAX_LAZY_MAPS; ++i)
+    {
+        struct lazy_map *map = lazy_maps[i];
+        if (map && addr >= (uintptr_t)map->start
+             && addr < (uintptr_t)map->start + map->length)
+            return map;
+    }
+
+    return NULL;
+}
+
+static int is_filled(struct lazy_map const *map, size_t off)
+{
+    return map->filled[off / page_size / 8] & (1 << (off / page_size % 8));
+}
+
+static void set_filled(struct lazy_map *map, size_t off)
+{
+    map->filled[off / page_size / 8] |= 1 << (off / page_size % 8);
+}
+
+/* Copy the page at offset “off” of a map to “dst” and fuzz it, exactly as
+ * if the whole file had been copied and fuzzed at once. */
+static void fill_page(struct lazy_map *map, size_t off, uint8_t *dst)
+{
+    size_t len = map->length - off < page_size ? map->length - off
+                                               : page_size;
+    size_t copy = off >= map->data_length ? 0
+                : map->data_length - off < len ? map->data_length - off
+                : len;
+
+    memcpy(dst, map->orig + off, copy);
+    memset(dst + copy, 0, page_size - copy);
+    _zz_fuzz_buffer(&map->fuzz, map->offset + off, dst, len);
+}
+
+/* Fill all the remaining pages of a map, which must be writable */
+static void fill_all(struct lazy_map *map)
+{
+    for (size_t off = 0; off < map->length; off += page_size)
+        if (!is_filled(map, off))
+        {
+            fill_page(map, off, map->start + off);
+            set_filled(map, off);
+        }
+}
+
+#if defined USE_USERFAULTFD
+/* Called with lazy_mutex held */
+static int init_userfaultfd(void)
+{
+    struct uffdio_api api;
+    pthread_t thread;
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (uffd < 0)
+        return -1;
+
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(uffd, UFFDIO_API, &api) < 0
+         || pthread_create(&thread, NULL, uffd_thread, NULL))
+    {
+        close(uffd);
+        uffd = -1;
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    static int atfork = 0;
+    if (!atfork++)
+        pthread_atfork(uffd_prepare, uffd_parent, uffd_child);
+
+    return 0;
+}
+
+/* Have the missing pages of a memory area resolved by our thread */
+static int uffd_register(void *start, size_t length)
+{
+    struct uffdio_register reg;
+    reg.range.start = (uintptr_t)start;
+    reg.range.len = (length + page_size - 1) / page_size * page_size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    return ioctl(uffd, UFFDIO_REGISTER, &reg) < 0 ? -1 : 0;
+}
+
+/* This thread resolves the page faults of all lazy maps, including those
+ * caused by system calls accessing them. */
+static void *uffd_thread(void *arg)
+{
+    uint8_t *page = ORIG(mmap)(NULL, page_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    (void)arg;
+
+    for (;;)
+    {
+        struct pollfd pfd;
+        struct uffd_msg msg;
+
+        pfd.fd = uffd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, -1) < 1
+             || read(uffd, &msg, sizeof(msg)) != sizeof(msg)
+             || msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        uintptr_t addr = msg.arg.pagefault.address
+                          & ~(uintptr_t)(page_size - 1);
+        struct uffdio_copy copy;
+        copy.dst = addr;
+        copy.src = (uintptr_t)page;
+        copy.len = page_size;
+        copy.mode = 0;
+
+        zzuf_mutex_lock(&lazy_mutex);
+        struct lazy_map *map = find_map(addr);
+        if (map)
+        {
+            fill_page(map, addr - (uintptr_t)map->start, page);
+            set_filled(map, addr - (uintptr_t)map->start);
+        }
+        else
+            memset(page, 0, page_size);
+        ioctl(uffd, UFFDIO_COPY, &copy);
+        zzuf_mutex_unlock(&lazy_mutex);
+    }
+
+    return NULL;
+}
+
+/* Make sure no page is being filled while we fork */
+static void uffd_prepare(void)
+{
+    zzuf_mutex_lock(&lazy_mutex);
+}
+
+static void uffd_parent(void)
+{
+    zzuf_mutex_unlock(&lazy_mutex);
+}
+
+/* The child process has no thread to resolve page faults, and its maps
+ * are no longer registered with userfaultfd, so we start again with a new
+ * descriptor. Pages that were already filled are present in the child and
+ * never fault; the others stay lazy, so that a child that only touches a
+ * few of them, or calls exec(), does not pay for whole maps. Only if this
+ * fails do we fill all the remaining pages at once. */
+static void uffd_child(void)
+{
+    if (method == METHOD_USERFAULTFD)
+    {
+        close(uffd);
+        uffd = -1;
+        if (init_userfaultfd() < 0)
+            method = METHOD_NONE;
+
+        for (int i = 0; i < MAX_LAZY_MAPS; ++i)
+            if (lazy_maps[i] && (method == METHOD_NONE
+                                  || uffd_register(lazy_maps[i]->start,
+                                                   lazy_maps[i]->length) < 0))
+                fill_all(lazy_maps[i]);
+    }
+
+    zzuf_mutex_unlock(&lazy_mutex);
+}
+#endif
+
+#if defined USE_SIGSEGV
+/* Called with lazy_mutex held */
+static int init_sigsegv(void)
+{
+    struct sigaction sa;
+
+    LOADSYM(sigaction);
+
+    scratch = ORIG(mmap)(NULL, page_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (scratch == MAP_FAILED)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = sigsegv_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+
+    if (ORIG(sigaction)(SIGSEGV, &sa, &next_segv) < 0)
+    {
+        munmap(scratch, page_size);
+        scratch = MAP_FAILED;
+        return -1;
+    }
+#if defined SIGBUS
+    /* Some systems raise SIGBUS when accessing protected pages */
+    if (ORIG(sigaction)(SIGBUS, &sa, &next_bus) < 0)
+    {
+        ORIG(sigaction)(SIGSEGV, &next_segv, NULL);
+        munmap(scratch, page_size);
+        scratch = MAP_FAILED;
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+/* Unlike the userfaultfd thread, this handler cannot help when a system
+ * call accesses a page that was never touched: the call fails with EFAULT
+ * instead. It only uses memory allocated beforehand and locks that are
+ * safe in signal handlers, and a thread faulting on a page that another
+ * thread is filling waits for it on lazy_mutex. */
+static void sigsegv_handler(int signum, siginfo_t *info, void *ctx)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr & ~(uintptr_t)(page_size - 1);
+
+    zzuf_mutex_lock(&lazy_mutex);
+    struct lazy_map *map = find_map(addr);
+    if (map)
+    {
+        size_t off = addr - (uintptr_t)map->start;
+
+        if (!is_filled(map, off))
+            install_page(map, off);
+
+        zzuf_mutex_unlock(&lazy_mutex);
+        return;
+    }
+    zzuf_mutex_unlock(&lazy_mutex);
+
+    /* Not ours: pass the fault to the program's handler */
+    struct sigaction *next = signum == SIGSEGV ? &next_segv : &next_bus;
+
+    if (next->sa_handler != SIG_DFL && next->sa_handler != SIG_IGN)
+    {
+        /* Call it the way the kernel would have: with its mask, plus the
+         * signal itself unless SA_NODEFER, and only once if SA_RESETHAND */
+        struct sigaction handler = *next;
+        sigset_t mask = handler.sa_mask, oldmask;
+
+        if (!(handler.sa_flags & SA_NODEFER))
+            sigaddset(&mask, signum);
+        if (handler.sa_flags & SA_RESETHAND)
+        {
+            memset(next, 0, sizeof(*next));
+            sigemptyset(&next->sa_mask);
+            next->sa_handler = SIG_DFL;
+        }
+
+#if defined HAVE_PTHREAD_H
+        pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+#else
+        sigprocmask(SIG_BLOCK, &mask, &oldmask);
+#endif
+        if (handler.sa_flags & SA_SIGINFO)
+            handler.sa_sigaction(signum, info, ctx);
+        else
+            handler.sa_handler(signum);
+#if defined HAVE_PTHREAD_H
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+#else
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+#endif
+    }
+    else
+    {
+        /* Restore the default action; the faulting instruction will be
+         * executed again and the process will be killed as expected. */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = SIG_DFL;
+        ORIG(sigaction)(signum, &sa, NULL);
+    }
+}
+
+/* Fill the scratch page, then move it over the protected page, which is
+ * thus replaced with its fuzzed contents in one go. Called with
+ * lazy_mutex held. */
+static void install_page(struct lazy_map *map, size_t off)
+{
+    if (scratch != MAP_FAILED)
+    {
+        fill_page(map, off, scratch);
+        if (mremap(scratch, page_size, page_size,
+                   MREMAP_MAYMOVE | MREMAP_FIXED,
+                   map->start + off) != MAP_FAILED)
+        {
+            set_filled(map, off);
+            scratch = ORIG(mmap)(NULL, page_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            return;
+        }
+    }
+
+    /* We probably hit the maximum number of memory areas of the process,
+     * since each page moved in place is a new one */
+    install_all(map);
+}
+
+/* Replace a whole map with its fuzzed contents at once, which merges its
+ * memory areas into one. Pages that were already filled may be written
+ * to by other threads, so they are made read-only while being copied;
+ * writers then fault and wait for us on lazy_mutex. Each of them is a
+ * memory area of its own, so this does not create new ones. Called with
+ * lazy_mutex held. */
+static void install_all(struct lazy_map *map)
+{
+    size_t size = (map->length + page_size - 1) / page_size * page_size;
+    uint8_t *b = ORIG(mmap)(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+    size_t off = 0;
+
+    for ( ; b != MAP_FAILED && off < size; off += page_size)
+    {
+        if (!is_filled(map, off))
+            fill_page(map, off, b + off);
+        else if (mprotect(map->start + off, page_size, PROT_READ) == 0)
+            memcpy(b + off, map->start + off, page_size);
+        else
+            break;
+    }
+
+    if (b != MAP_FAILED && off == size
+         && mremap(b, size, size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   map->start) != MAP_FAILED)
+    {
+        for (off = 0; off < size; off += page_size)
+            set_filled(map, off);
+        return;
+    }
+
+    if (b != MAP_FAILED)
+        munmap(b, size);
+
+    /* Out of memory: as a last resort, fill the map where it is, and let
+     * other threads see unfuzzed pages for a while */
+    mprotect(map->start, size, PROT_READ | PROT_WRITE);
+    fill_all(map);
+}
+#endif
+
+#else /* !HAVE_MMAP */
+
+void _zz_pagefault_mode(char const *mode)
+{
+    (void)mode;
+}
+
+void _zz_pagefault_unmap(void *start)
+{
+    (void)start;
+}
+
+int _zz_pagefault_sigaction(int signum, struct sigaction const *act,
+                            struct sigaction *oldact)
+{
+    (void)signum;
+    (void)act;
+    (void)oldact;
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,27 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  pagefault.h: lazy fuzzing of memory mapped files
+ */
+
+struct sigaction;
+
+extern void _zz_pagefault_mode(char const *);
+extern void *_zz_pagefault_map(void *, size_t, void const *, size_t,
+                               int, int64_t);
+extern void _zz_pagefault_unmap(void *);
+extern int _zz_pagefault_sigaction(int, struct sigaction const *,
+                                   struct sigaction *);
+
@@ -0,0 +1,112 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  persistent.c: persistent mode
+ *
+ *  Programs that know they are being fuzzed can hand a harness function
+ *  to zzuf_persistent(), which calls it once per seed without restarting
+ *  the process. Before each call, the descriptors that are still open get
+ *  the new seed and lose their cached chunks, and the seed is stored in
+ *  the status file shared with zzuf, so that zzuf knows which seed was
+ *  running if the process crashes and where to restart it.
+ */
+
+#include "config.h"
+
+/* Need this for unsetenv() */
+#define _GNU_SOURCE
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#if defined HAVE_STDINT_H
+#   include <stdint.h>
+#elif defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#endif
+#include <stdlib.h>
+
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+
+#include "common.h"
+#include "libzzuf.h"
+#include "debug.h"
+#include "fd.h"
+#include "persistent.h"
+
+/* Number of seeds zzuf wants this process to run */
+static int iterations = 1;
+
+/* The seed being run, shared with zzuf, or NULL */
+static volatile uint32_t *status = NULL;
+
+/**
+ * Read the persistent mode settings given by zzuf.
+ */
+void _zz_persistent_init(char const *count, char const *fd)
+{
+    iterations = atoi(count);
+    if (iterations < 1)
+        iterations = 1;
+
+#if defined ZZUF_PERSISTENT
+    /* Programs launched by our children must not report to zzuf */
+    unsetenv("ZZUF_PERSISTENT");
+    unsetenv("ZZUF_PERSISTENTFD");
+
+    if (fd && *fd)
+    {
+        int n = atoi(fd);
+        void *p = mmap(NULL, sizeof(*status), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, n, 0);
+        if (p != MAP_FAILED)
+            status = p;
+        close(n);
+    }
+#else
+    (void)fd;
+#endif
+
+    debug("persistent mode for %i seeds", iterations);
+}
+
+/**
+ * Call the harness once per seed, starting with the current seed, until
+ * it returns non-zero or all the seeds zzuf asked for are done.
+ */
+int zzuf_persistent(zzuf_harness_t harness, void *data)
+{
+    uint32_t seed = (uint32_t)zzuf_get_seed();
+    int n = 0;
+
+    while (n < iterations)
+    {
+        zzuf_set_seed((int32_t)(seed + n));
+        _zz_fd_reseed();
+        if (status)
+            *status = seed + n;
+
+        debug2("persistent iteration %i, seed %u", n, seed + n);
+
+        ++n;
+        if (harness(data))
+            break;
+    }
+
+    return n;
+}
+
@@ -0,0 +1,49 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  zzuf.h: public libzzuf API
+ *
+ *  These functions are exported by libzzuf and may be called by programs
+ *  that are aware of being fuzzed, for instance to run a test harness in
+ *  persistent mode. See libzzuf(3) for details.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fuzzing settings */
+extern void zzuf_set_seed(int32_t);
+extern int32_t zzuf_get_seed(void);
+extern void zzuf_set_ratio(double, double);
+extern double zzuf_get_ratio(void);
+extern void zzuf_set_auto_increment(void);
+extern void zzuf_include_pattern(char const *);
+extern void zzuf_exclude_pattern(char const *);
+extern void zzuf_protect_range(char const *);
+extern void zzuf_refuse_range(char const *);
+
+/* Persistent mode: call the harness once per seed, in the same process,
+ * until it returns non-zero or all seeds are done. Returns the number of
+ * times the harness was called. */
+typedef int (*zzuf_harness_t)(void *);
+extern int zzuf_persistent(zzuf_harness_t, void *);
+
+#ifdef __cplusplus
+}
+#endif
+
@@ -18,6 +18,7 @@
 #include "config.h"
 
 #define _INCLUDE_POSIX_SOURCE /* for STDERR_FILENO on HP-UX */
+#define _GNU_SOURCE /* for prlimit() and environ on glibc systems */
 #define _BSD_SOURCE /* for setenv on glibc systems */
 #define _DEFAULT_SOURCE
 
@@ -40,10 +41,32 @@
 #   include <io.h>
 #endif
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h> /* for O_BINARY */
 #if defined HAVE_SYS_RESOURCE_H
 #   include <sys/resource.h> /* for RLIMIT_AS */
 #endif
+#if defined HAVE_SYS_TIME_H
+#   include <sys/time.h> /* for select() */
+#endif
+#if defined HAVE_SYS_SOCKET_H
+#   include <sys/socket.h> /* for socketpair() */
+#endif
+#if defined HAVE_SYS_WAIT_H
+#   include <sys/wait.h>
+#endif
+#if defined HAVE_POLL_H
+#   include <poll.h>
+#endif
+#if defined HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#endif
+#if defined HAVE_SYS_SYSCALL_H
+#   include <sys/syscall.h> /* for SYS_pidfd_open */
+#endif
+#if defined HAVE_SPAWN_H
+#   include <spawn.h>
+#endif
 
 #include "common.h"
 #include "opts.h"
@@ -74,8 +97,45 @@
 #   undef ZZUF_RLIMIT_CPU
 #endif
 
+#if defined ZZUF_EPOLL && defined SYS_pidfd_open
+#   define ZZUF_PIDFD 1
+#endif
+
+#if defined HAVE_FORK
+#   if defined __APPLE__
+#       define EXTRAINFO ""
+#       define PRELOAD "DYLD_INSERT_LIBRARIES"
+#   elif defined __osf__
+#       define EXTRAINFO ":DEFAULT"
+#       define PRELOAD "_RLD_LIST"
+#   elif defined __sun && defined __i386
+#       define EXTRAINFO ""
+#       define PRELOAD "LD_PRELOAD_32"
+#   else
+#       define EXTRAINFO ""
+#       define PRELOAD "LD_PRELOAD"
+#   endif
+#endif
+
 static int mypipe(int pipefd[2]);
 static int run_process(zzuf_child_t *child, zzuf_opts_t *, int[][2]);
+#if defined HAVE_FORK
+static void prepare_env(zzuf_opts_t *);
+static void set_limits(pid_t, zzuf_opts_t *);
+static void share_fds(zzuf_child_t *, zzuf_opts_t *, int);
+#endif
+#if defined ZZUF_SPAWN
+static char **child_env(zzuf_child_t *);
+#endif
+#if defined ZZUF_FORKSERVER
+static int open_server(zzuf_child_t *);
+static void drop_server(zzuf_child_t *, zzuf_opts_t *);
+static int fork_request(zzuf_child_t *, zzuf_opts_t *, int[][2]);
+static int read_int(int, int *);
+#endif
+#if defined ZZUF_PERSISTENT
+static int open_status(zzuf_child_t *);
+#endif
 
 #if defined HAVE_WINDOWS_H
 static int dll_inject(PROCESS_INFORMATION *, char const *);
@@ -89,6 +149,21 @@ static void *get_proc_address(void *, DWORD, char const *);
  */
 int myfork(zzuf_child_t *child, zzuf_opts_t *opts)
 {
+#if defined ZZUF_FORKSERVER
+    /* A slot without a fork server launches the program as one. Until it
+     * reaches its fork point, it is the slot's child like any other, see
+     * myfork_ready(). */
+    int server_end = -1;
+    if (opts->b_forkserver && child->server_fd < 0
+         && (server_end = open_server(child)) < 0)
+        return -1;
+#endif
+
+#if defined ZZUF_PERSISTENT
+    if (opts->persistent && open_status(child) < 0)
+        return -1;
+#endif
+
     /* Prepare communication pipes */
     int pipefds[3][2];
     for (int i = 0; i < 3; ++i)
@@ -100,24 +175,388 @@ int myfork(zzuf_child_t *child, zzuf_opts_t *opts)
         }
     }
 
-    pid_t pid = run_process(child, opts, pipefds);
-    if (pid < 0)
+#if defined ZZUF_FORKSERVER
+    if (child->server_pid > 0)
+    {
+        if (fork_request(child, opts, pipefds) < 0)
+            return -1;
+    }
+    else
+#endif
+    {
+        pid_t pid = run_process(child, opts, pipefds);
+#if defined ZZUF_FORKSERVER
+        if (server_end >= 0)
+        {
+            /* Only this process may become a server */
+            unsetenv("ZZUF_FORKSERVER");
+            close(server_end);
+            if (pid < 0)
+            {
+                close(child->server_fd);
+                child->server_fd = -1;
+            }
+        }
+#endif
+        if (pid < 0)
+        {
+            /* FIXME: close pipes */
+            return -1;
+        }
+
+        child->pid = pid;
+        for (int i = 0; i < 3; ++i)
+        {
+            close(pipefds[i][1]);
+            child->fd[i] = pipefds[i][0];
+        }
+
+#if defined ZZUF_PIDFD
+        /* Get an event as soon as the child exits. Kernels older than 5.3
+         * do not have pidfds, in which case we poll with waitpid(). */
+        if (opts->epoll_fd >= 0)
+            child->exit_fd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    }
+
+#if defined ZZUF_EPOLL
+    for (int i = 0; i < 3; ++i)
+    {
+        /* The pipes are drained when the child exits, but its own
+         * children may still have them open: never block on them */
+        if (opts->epoll_fd >= 0)
+            fcntl(child->fd[i], F_SETFL, O_NONBLOCK);
+        myfork_watch(child, opts, i, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    myfork_watch(child, opts, CHANNEL_EXIT, EPOLL_CTL_ADD, EPOLLIN);
+#   if defined ZZUF_FORKSERVER
+    if (server_end >= 0)
+        myfork_watch(child, opts, CHANNEL_SERVER, EPOLL_CTL_ADD, EPOLLIN);
+#   endif
+#endif
+
+    return 0;
+}
+
+#if defined ZZUF_EPOLL
+/*
+ * Add one of a slot's descriptors to the epoll set, change the events
+ * we wait for, or remove it.
+ */
+void myfork_watch(zzuf_child_t *child, zzuf_opts_t *opts,
+                  int channel, int op, uint32_t events)
+{
+    int fd = channel == CHANNEL_SERVER ? child->server_fd
+           : channel == CHANNEL_EXIT ? child->exit_fd : child->fd[channel];
+    if (opts->epoll_fd < 0 || fd < 0)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = EVENT_DATA(child - opts->child, channel);
+
+    if (epoll_ctl(opts->epoll_fd, op, fd, &ev) < 0 && op == EPOLL_CTL_ADD)
+        perror("epoll_ctl");
+}
+#endif
+
+#if defined HAVE_WAITPID
+/*
+ * Check whether a child has exited, without blocking. Children of a fork
+ * server are not ours, so we get their status from the server instead.
+ */
+pid_t mywait(zzuf_child_t *child, zzuf_opts_t *opts, int *status)
+{
+#if defined ZZUF_FORKSERVER
+    /* A fork server that died before its fork point is our own child */
+    if (child->server_fd >= 0 && child->server_pid == 0)
+    {
+        pid_t pid = waitpid(child->pid, status, WNOHANG);
+        if (pid > 0)
+            drop_server(child, opts);
+        return pid;
+    }
+
+    if (child->server_fd >= 0)
+    {
+#   if defined HAVE_POLL_H
+        struct pollfd pfd;
+        pfd.fd = child->server_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 0) <= 0)
+            return 0;
+#   else
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET((unsigned int)child->server_fd, &fdset);
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+
+        if (select(child->server_fd + 1, &fdset, NULL, NULL, &tv) <= 0)
+            return 0;
+#   endif
+
+        if (read_int(child->server_fd, status) < 0)
+        {
+            fprintf(stderr, "zzuf: fork server for `%s' died\n",
+                    child->newargv[0]);
+            myfork_stop(child, opts);
+            *status = 0;
+        }
+
+        return child->pid;
+    }
+#else
+    (void)opts;
+#endif
+
+    return waitpid(child->pid, status, WNOHANG);
+}
+
+/*
+ * Stop the fork server of a slot, if any. The server exits as soon as
+ * it sees the control socket closed.
+ */
+void myfork_stop(zzuf_child_t *child, zzuf_opts_t *opts)
+{
+    if (child->server_fd < 0)
+        return;
+
+#if defined ZZUF_EPOLL
+    myfork_watch(child, opts, CHANNEL_SERVER, EPOLL_CTL_DEL, 0);
+#else
+    (void)opts;
+#endif
+    close(child->server_fd);
+    child->server_fd = -1;
+    if (child->server_pid > 0)
+        waitpid(child->server_pid, NULL, 0);
+    child->server_pid = 0;
+}
+#endif
+
+#if defined ZZUF_FORKSERVER
+/*
+ * Handle the first message of a slot's new fork server: its PID once it
+ * has reached the fork point, or EOF because it exited first. Returns 0
+ * if the server is ready for requests. Otherwise, the process is treated
+ * as a normal child from now on.
+ */
+int myfork_ready(zzuf_child_t *child, zzuf_opts_t *opts)
+{
+    int hello;
+
+    /* We may already be killing it for running too long */
+    if (read_int(child->server_fd, &hello) < 0
+         || child->status != STATUS_RUNNING)
     {
-        /* FIXME: close pipes */
-        fprintf(stderr, "error launching `%s'\n", child->newargv[0]);
+        drop_server(child, opts);
         return -1;
     }
 
-    child->pid = pid;
+    child->server_pid = child->pid;
+
+    /* Its exit status is now reported by the children it forks */
+    if (child->exit_fd >= 0)
+    {
+#   if defined ZZUF_EPOLL
+        myfork_watch(child, opts, CHANNEL_EXIT, EPOLL_CTL_DEL, 0);
+#   endif
+        close(child->exit_fd);
+        child->exit_fd = -1;
+    }
+
+    return 0;
+}
+#endif
+
+#if defined ZZUF_PERSISTENT
+/*
+ * Get the seed a persistent mode child is running, as last reported by
+ * libzzuf in the status file.
+ */
+uint32_t myfork_seed(zzuf_child_t *child)
+{
+    uint32_t seed;
+
+    if (child->persist_fd < 0
+         || pread(child->persist_fd, &seed, sizeof(seed), 0)
+             != (ssize_t)sizeof(seed))
+        return child->seed;
+
+    return seed;
+}
+
+/*
+ * Create the status file of a persistent mode child. It is unlinked right
+ * away and only shared with that child, which maps it in memory.
+ */
+static int open_status(zzuf_child_t *child)
+{
+    FILE *fp = tmpfile();
+    if (!fp)
+    {
+        perror("tmpfile");
+        return -1;
+    }
+
+    child->persist_fd = dup(fileno(fp));
+    fclose(fp);
+    if (child->persist_fd < 0)
+    {
+        perror("dup");
+        return -1;
+    }
+
+    /* Other children must not inherit it */
+    fcntl(child->persist_fd, F_SETFD, FD_CLOEXEC);
+
+    if (write(child->persist_fd, &child->seed, sizeof(child->seed))
+         != (ssize_t)sizeof(child->seed))
+    {
+        perror("write");
+        close(child->persist_fd);
+        child->persist_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+#if defined ZZUF_FORKSERVER
+/*
+ * Create the control socket of a new fork server, and tell the next
+ * process we launch to become one. Returns the end of the socket that
+ * the server inherits, which must be closed once it is launched.
+ */
+static int open_server(zzuf_child_t *child)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    /* Other slots' servers must not keep our end of the socket open */
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    char buf[32];
+    sprintf(buf, "%i", sv[1]);
+    setenv("ZZUF_FORKSERVER", buf, 1);
+
+    child->server_fd = sv[0];
+    child->server_pid = 0;
+    return sv[1];
+}
+
+/*
+ * Forget about a fork server that did not reach its fork point. Since
+ * nothing we fuzz happens before it, no other run is going to reach it
+ * either, so the next processes are launched normally.
+ */
+static void drop_server(zzuf_child_t *child, zzuf_opts_t *opts)
+{
+    if (opts->b_forkserver)
+    {
+        fprintf(stderr, "zzuf: `%s' did not reach its fork point, "
+                "launching it normally\n", child->newargv[0]);
+        opts->b_forkserver = 0;
+    }
+
+#   if defined ZZUF_EPOLL
+    myfork_watch(child, opts, CHANNEL_SERVER, EPOLL_CTL_DEL, 0);
+#   endif
+    close(child->server_fd);
+    child->server_fd = -1;
+}
+
+/*
+ * Ask the fork server for a new child, passing it the write ends of the
+ * communication pipes.
+ */
+static int fork_request(zzuf_child_t *child, zzuf_opts_t *opts,
+                        int pipes[][2])
+{
+    struct fork_request req;
+    memset(&req, 0, sizeof(req));
+    req.seed = child->seed;
+    req.minratio = opts->minratio;
+    req.maxratio = opts->maxratio;
+
+    struct iovec iov;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    for (int i = 0; i < 3; ++i)
+        memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &pipes[i][1], sizeof(int));
+
+    ssize_t ret;
+    do
+        ret = sendmsg(child->server_fd, &msg, 0);
+    while (ret < 0 && errno == EINTR);
+
+    /* The server has its own copies now */
     for (int i = 0; i < 3; ++i)
+        close(pipes[i][1]);
+
+    int pid = -1;
+    if (ret != (ssize_t)sizeof(req) || read_int(child->server_fd, &pid) < 0)
     {
-        close(pipefds[i][1]);
-        child->fd[i] = pipefds[i][0];
+        fprintf(stderr, "zzuf: lost fork server for `%s'\n",
+                child->newargv[0]);
+        myfork_stop(child, opts);
     }
 
+    if (pid < 0)
+    {
+        for (int i = 0; i < 3; ++i)
+            close(pipes[i][0]);
+        return -1;
+    }
+
+    child->pid = pid;
+    for (int i = 0; i < 3; ++i)
+        child->fd[i] = pipes[i][0];
+
     return 0;
 }
 
+static int read_int(int fd, int *val)
+{
+    ssize_t ret;
+    do
+        ret = read(fd, val, sizeof(*val));
+    while (ret < 0 && errno == EINTR);
+
+    return ret == (ssize_t)sizeof(*val) ? 0 : -1;
+}
+#endif
+
 /*
  * Create a pipe, a unidirectional channel for interprocess communication.
  */
@@ -205,23 +644,57 @@ static void setenv(char const *name, char const *value, int overwrite)
 static int run_process(zzuf_child_t *child, zzuf_opts_t *opts, int pipes[][2])
 {
 #if defined HAVE_FORK
-#   if defined __APPLE__
-#       define EXTRAINFO ""
-#       define PRELOAD "DYLD_INSERT_LIBRARIES"
-    /* Only enforce flat namespace in preload mode */
-    if (opts->opmode == OPMODE_PRELOAD)
-        setenv("DYLD_FORCE_FLAT_NAMESPACE", "1", 1);
-#   elif defined __osf__
-#       define EXTRAINFO ":DEFAULT"
-#       define PRELOAD "_RLD_LIST"
-#   elif defined __sun && defined __i386
-#       define EXTRAINFO ""
-#       define PRELOAD "LD_PRELOAD_32"
-#   else
-#       define EXTRAINFO ""
-#       define PRELOAD "LD_PRELOAD"
-#   endif
+    /* What is the same for all children is only computed once */
+    static int env_ready = 0;
+    if (!env_ready)
+    {
+        prepare_env(opts);
+        env_ready = 1;
+    }
+#endif
+
+#if defined ZZUF_SPAWN
+    /* Same file descriptor juggling as in the child after fork() below */
+    static int const fds[] = { DEBUG_FILENO, STDERR_FILENO, STDOUT_FILENO };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int j = 3; j--; )
+    {
+        if (pipes[j][0] >= 0)
+            posix_spawn_file_actions_addclose(&actions, pipes[j][0]);
+        if (pipes[j][1] != fds[j])
+        {
+            posix_spawn_file_actions_adddup2(&actions, pipes[j][1], fds[j]);
+            posix_spawn_file_actions_addclose(&actions, pipes[j][1]);
+        }
+    }
 
+    share_fds(child, opts, 1);
+    pid_t pid;
+    int ret = posix_spawnp(&pid, child->newargv[0], &actions, NULL,
+                           child->newargv, child_env(child));
+    posix_spawn_file_actions_destroy(&actions);
+    share_fds(child, opts, 0);
+
+    /* Close the pipe fds used for writing, since we will only be reading */
+    for (int j = 3; j--; )
+        close(pipes[j][1]);
+
+    if (ret)
+    {
+        fprintf(stderr, "%s: %s\n", child->newargv[0], strerror(ret));
+        return -1;
+    }
+
+    /* posix_spawn() returns once the program is loaded, but it then runs
+     * concurrently with us, so these limits may come too late for what it
+     * does first. libzzuf sets them again when it is initialised, so this
+     * only matters for programs that do not load it, as in copy mode. */
+    set_limits(pid, opts);
+
+    return pid;
+
+#elif defined HAVE_FORK
     /* Fork and launch child */
     int pid = fork();
     if (pid < 0)
@@ -256,84 +729,28 @@ static int run_process(zzuf_child_t *child, zzuf_opts_t *opts, int pipes[][2])
             pipes[j][1] = fds[j];
         }
     }
-#endif
 
-#if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
-    if (opts->maxmem >= 0)
-    {
-        struct rlimit rlim;
-        rlim.rlim_cur = (uint64_t)opts->maxmem * 1048576;
-        rlim.rlim_max = (uint64_t)opts->maxmem * 1048576;
-        setrlimit(ZZUF_RLIMIT_MEM, &rlim);
-    }
-#endif
+    set_limits(0, opts);
+    share_fds(child, opts, 1);
 
-#if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_CPU
-    if (opts->maxcpu >= 0)
-    {
-        struct rlimit rlim;
-        rlim.rlim_cur = opts->maxcpu;
-        rlim.rlim_max = opts->maxcpu + 5;
-        setrlimit(ZZUF_RLIMIT_CPU, &rlim);
-    }
-#endif
-
-    /* Set environment variables */
+    /* Set the variables that change with each child */
     char buf[64];
-#if defined _WIN32
-    sprintf(buf, "%i", _get_osfhandle(pipes[0][1]));
-#else
-    sprintf(buf, "%i", pipes[0][1]);
-#endif
-    setenv("ZZUF_DEBUGFD", buf, 1);
-#if defined HAVE_INTTYPES_H
-    sprintf(buf, "%"PRIu32, opts->seed);
-#else
-    sprintf(buf, "%u", opts->seed);
-#endif
+#   if defined HAVE_INTTYPES_H
+    sprintf(buf, "%"PRIu32, child->seed);
+#   else
+    sprintf(buf, "%u", child->seed);
+#   endif
     setenv("ZZUF_SEED", buf, 1);
-    sprintf(buf, "%g", opts->minratio);
-    setenv("ZZUF_MINRATIO", buf, 1);
-    sprintf(buf, "%g", opts->maxratio);
-    setenv("ZZUF_MAXRATIO", buf, 1);
-
-#if defined HAVE_FORK
-    /* Make sure there is space for everything we might do. */
-    int len = strlen(opts->oldargv[0]);
-    char *libpath =
-               malloc(len + strlen(LIBDIR "/" LT_OBJDIR SONAME EXTRAINFO) + 1);
-    strcpy(libpath, opts->oldargv[0]);
-
-    /* If the binary name contains a '/', we look for a libzzuf in the
-     * same directory. Otherwise, we only look into the system directory
-     * to avoid shared library attacks. Write the result in libpath. */
-    char *tmp = strrchr(libpath, '/');
-    if (tmp)
-    {
-        strcpy(tmp + 1, LT_OBJDIR SONAME);
-        if (access(libpath, R_OK) < 0)
-            strcpy(libpath, LIBDIR "/" SONAME);
-    }
-    else
-        strcpy(libpath, LIBDIR "/" SONAME);
-
-    /* OSF1 only */
-    strcat(libpath, EXTRAINFO);
 
-    /* Do not clobber previous LD_PRELOAD values */
-    tmp = getenv(PRELOAD);
-    if (tmp && *tmp)
+#   if defined ZZUF_PERSISTENT
+    if (child->persist_fd >= 0)
     {
-        char *bigbuf = malloc(strlen(tmp) + strlen(libpath) + 2);
-        sprintf(bigbuf, "%s:%s", tmp, libpath);
-        free(libpath);
-        libpath = bigbuf;
+        sprintf(buf, "%i", child->persist_fd);
+        setenv("ZZUF_PERSISTENTFD", buf, 1);
+        sprintf(buf, "%i", (int)(child->endseed - child->seed));
+        setenv("ZZUF_PERSISTENT", buf, 1);
     }
-
-    /* Only preload the library in preload mode */
-    if (opts->opmode == OPMODE_PRELOAD)
-        setenv(PRELOAD, libpath, 1);
-    free(libpath);
+#   endif
 
     if (execvp(child->newargv[0], child->newargv))
     {
@@ -346,6 +763,17 @@ static int run_process(zzuf_child_t *child, zzuf_opts_t *opts, int pipes[][2])
     return 0;
 
 #elif HAVE_WINDOWS_H
+    /* Set environment variables */
+    char buf[64];
+    sprintf(buf, "%i", _get_osfhandle(pipes[0][1]));
+    setenv("ZZUF_DEBUGFD", buf, 1);
+    sprintf(buf, "%u", child->seed);
+    setenv("ZZUF_SEED", buf, 1);
+    sprintf(buf, "%g", opts->minratio);
+    setenv("ZZUF_MINRATIO", buf, 1);
+    sprintf(buf, "%g", opts->maxratio);
+    setenv("ZZUF_MAXRATIO", buf, 1);
+
     /* Inherit standard handles */
     STARTUPINFO sinfo;
     memset(&sinfo, 0, sizeof(sinfo));
@@ -413,6 +841,177 @@ static int run_process(zzuf_child_t *child, zzuf_opts_t *opts, int pipes[][2])
 #endif
 }
 
+#if defined HAVE_FORK
+/*
+ * Set the environment variables that are the same for all children, and
+ * find libzzuf, so that launching a child only needs to set its seed.
+ */
+static void prepare_env(zzuf_opts_t *opts)
+{
+    char buf[64];
+    sprintf(buf, "%i", DEBUG_FILENO);
+    setenv("ZZUF_DEBUGFD", buf, 1);
+    sprintf(buf, "%g", opts->minratio);
+    setenv("ZZUF_MINRATIO", buf, 1);
+    sprintf(buf, "%g", opts->maxratio);
+    setenv("ZZUF_MAXRATIO", buf, 1);
+
+    /* Only preload the library in preload mode */
+    if (opts->opmode != OPMODE_PRELOAD)
+        return;
+
+#   if defined __APPLE__
+    /* Only enforce flat namespace in preload mode */
+    setenv("DYLD_FORCE_FLAT_NAMESPACE", "1", 1);
+#   endif
+
+    /* Make sure there is space for everything we might do. */
+    int len = strlen(opts->oldargv[0]);
+    char *libpath =
+               malloc(len + strlen(LIBDIR "/" LT_OBJDIR SONAME EXTRAINFO) + 1);
+    strcpy(libpath, opts->oldargv[0]);
+
+    /* If the binary name contains a '/', we look for a libzzuf in the
+     * same directory. Otherwise, we only look into the system directory
+     * to avoid shared library attacks. Write the result in libpath. */
+    char *tmp = strrchr(libpath, '/');
+    if (tmp)
+    {
+        strcpy(tmp + 1, LT_OBJDIR SONAME);
+        if (access(libpath, R_OK) < 0)
+            strcpy(libpath, LIBDIR "/" SONAME);
+    }
+    else
+        strcpy(libpath, LIBDIR "/" SONAME);
+
+    /* OSF1 only */
+    strcat(libpath, EXTRAINFO);
+
+    /* Do not clobber previous LD_PRELOAD values */
+    tmp = getenv(PRELOAD);
+    if (tmp && *tmp)
+    {
+        char *bigbuf = malloc(strlen(tmp) + strlen(libpath) + 2);
+        sprintf(bigbuf, "%s:%s", tmp, libpath);
+        free(libpath);
+        libpath = bigbuf;
+    }
+
+    setenv(PRELOAD, libpath, 1);
+    free(libpath);
+}
+
+/*
+ * Apply the memory and CPU time limits to a child, either from the
+ * child itself after fork(), or from the parent after posix_spawn().
+ */
+static void set_limits(pid_t pid, zzuf_opts_t *opts)
+{
+#   if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
+    if (opts->maxmem >= 0)
+    {
+        struct rlimit rlim;
+        rlim.rlim_cur = (uint64_t)opts->maxmem * 1048576;
+        rlim.rlim_max = (uint64_t)opts->maxmem * 1048576;
+#       if defined ZZUF_SPAWN
+        prlimit(pid, ZZUF_RLIMIT_MEM, &rlim, NULL);
+#       else
+        setrlimit(ZZUF_RLIMIT_MEM, &rlim);
+#       endif
+    }
+#   endif
+
+#   if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_CPU
+    if (opts->maxcpu >= 0)
+    {
+        struct rlimit rlim;
+        rlim.rlim_cur = opts->maxcpu;
+        rlim.rlim_max = opts->maxcpu + 5;
+#       if defined ZZUF_SPAWN
+        prlimit(pid, ZZUF_RLIMIT_CPU, &rlim, NULL);
+#       else
+        setrlimit(ZZUF_RLIMIT_CPU, &rlim);
+#       endif
+    }
+#   endif
+
+    (void)pid;
+    (void)opts;
+}
+
+/*
+ * Let a child inherit the descriptors that are meant for it, namely its
+ * persistent mode status file and its copy mode inputs, or stop sharing
+ * them. They are close-on-exec the rest of the time, so that children
+ * do not get each other's.
+ */
+static void share_fds(zzuf_child_t *child, zzuf_opts_t *opts, int share)
+{
+    int flags = share ? 0 : FD_CLOEXEC;
+
+#   if defined ZZUF_PERSISTENT
+    if (child->persist_fd >= 0)
+        fcntl(child->persist_fd, F_SETFD, flags);
+#   endif
+
+    for (int k = 0; child->job && k < opts->ninputs; ++k)
+        if (child->job->copy[k].fd >= 0)
+            fcntl(child->job->copy[k].fd, F_SETFD, flags);
+}
+#endif
+
+#if defined ZZUF_SPAWN
+/*
+ * Build the environment of a child: ours, set up by prepare_env(), plus
+ * the variables that change with each child. The array and the strings
+ * are reused from one child to the next.
+ */
+static char **child_env(zzuf_child_t *child)
+{
+    static char **env = NULL;
+    static size_t size = 0;
+    static char seed[32];
+
+    size_t n = 0;
+    while (environ[n])
+        ++n;
+
+    if (n + 4 > size)
+    {
+        size = n + 4;
+        env = realloc(env, size * sizeof(*env));
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (strncmp(environ[i], "ZZUF_SEED=", 10)
+             && strncmp(environ[i], "ZZUF_PERSISTENT", 15))
+            env[k++] = environ[i];
+
+#   if defined HAVE_INTTYPES_H
+    sprintf(seed, "ZZUF_SEED=%"PRIu32, child->seed);
+#   else
+    sprintf(seed, "ZZUF_SEED=%u", child->seed);
+#   endif
+    env[k++] = seed;
+
+#   if defined ZZUF_PERSISTENT
+    static char persistfd[32], persistent[32];
+    if (child->persist_fd >= 0)
+    {
+        sprintf(persistfd, "ZZUF_PERSISTENTFD=%i", child->persist_fd);
+        env[k++] = persistfd;
+        sprintf(persistent, "ZZUF_PERSISTENT=%i",
+                (int)(child->endseed - child->seed));
+        env[k++] = persistent;
+    }
+#   endif
+
+    env[k] = NULL;
+    return env;
+}
+#endif
+
 #if defined HAVE_WINDOWS_H
 
 static int dll_inject(PROCESS_INFORMATION *pinfo, char const *lib)
@@ -17,4 +17,29 @@
  */
 
 int myfork(zzuf_child_t *child, zzuf_opts_t *opts);
+#if defined HAVE_WAITPID
+pid_t mywait(zzuf_child_t *child, zzuf_opts_t *opts, int *status);
+void myfork_stop(zzuf_child_t *child, zzuf_opts_t *opts);
+#endif
+#if defined ZZUF_FORKSERVER
+int myfork_ready(zzuf_child_t *child, zzuf_opts_t *opts);
+#endif
+#if defined ZZUF_EPOLL
+/* Events carry the slot number and the channel: 0 to 2 are the child's
+ * pipes, as in zzuf_child_t::fd, 3 is the slot's fork server and 4 is
+ * the child's pidfd. The timer and the copy mode workers use values of
+ * their own. */
+#   define CHANNEL_SERVER 3
+#   define CHANNEL_EXIT 4
+#   define EVENT_DATA(slot, channel) (((uint64_t)(slot) << 3) | (channel))
+#   define EVENT_SLOT(data) ((int)((data) >> 3))
+#   define EVENT_CHANNEL(data) ((int)((data) & 7))
+#   define EVENT_TIMER ((uint64_t)-1)
+#   define EVENT_COPY ((uint64_t)-2)
+void myfork_watch(zzuf_child_t *child, zzuf_opts_t *opts,
+                  int channel, int op, uint32_t events);
+#endif
+#if defined ZZUF_PERSISTENT
+uint32_t myfork_seed(zzuf_child_t *child);
+#endif
 
@@ -35,7 +35,8 @@ zzuf_opts_t *zzuf_create_opts(void)
     zzuf_opts_t *opts = malloc(sizeof(zzuf_opts_t));
 
     opts->opmode = OPMODE_PRELOAD;
-    opts->fuzzing = opts->bytes = opts->list = opts->ports = NULL;
+    opts->fuzzing = opts->generator = NULL;
+    opts->bytes = opts->list = opts->ports = NULL;
     opts->allow = NULL;
     opts->protect = opts->refuse = NULL;
 
@@ -48,9 +49,12 @@ zzuf_opts_t *zzuf_create_opts(void)
     opts->b_hex = 0;
     opts->b_checkexit = 0;
     opts->b_verbose = 0;
+    opts->b_forkserver = 0;
+    opts->persistent = 0;
 
     opts->maxbytes = -1;
     opts->maxmem = DEFAULT_MEM;
+    opts->chunkcache = 0;
     opts->starttime = zzuf_time();
     opts->maxtime = 0;
     opts->maxusertime = -1;
@@ -62,6 +66,21 @@ zzuf_opts_t *zzuf_create_opts(void)
     opts->nchild = 0;
     opts->maxcrashes = 1;
     opts->crashes = 0;
+    opts->launches = 0;
+    opts->busytime = 0;
+    opts->epoll_fd = -1;
+    opts->timer_fd = -1;
+    opts->ninputs = opts->njobs = 0;
+    opts->input = NULL;
+    opts->job = NULL;
+    opts->ncorpus = opts->corpus_arg = 0;
+    opts->corpus = NULL;
+    opts->shard = 0;
+    opts->nshards = 1;
+    opts->npairs = opts->batch = 0;
+    opts->queue = NULL;
+    opts->pool = NULL;
+    opts->linkdir = NULL;
     opts->child = NULL;
 
     return opts;
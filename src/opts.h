@@ -23,8 +23,39 @@
 #   include <windows.h>
 #endif
 
+/* On Linux, children's output channels are watched with a persistent
+ * epoll set instead of a select() call rebuilt at each loop */
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1
+#   define ZZUF_EPOLL 1
+#endif
+
+/* Deadlines are delivered to the same epoll set by a timerfd, so that we
+ * only wake up when something happens */
+#if defined ZZUF_EPOLL && defined HAVE_SYS_TIMERFD_H && defined HAVE_TIMERFD_CREATE
+#   define ZZUF_TIMERFD 1
+#endif
+
+/* When resource limits can be set from the outside, children are
+ * launched with posix_spawn(), whose cost does not grow with our memory
+ * size the way fork() does */
+#if defined HAVE_SPAWN_H && defined HAVE_POSIX_SPAWNP && defined HAVE_PRLIMIT
+#   define ZZUF_SPAWN 1
+#endif
+
+/* Seeds can be shared with other zzuf processes through a file that they
+ * lock with fcntl() or map in memory */
+#if defined HAVE_FCNTL_H && !defined _WIN32
+#   define ZZUF_QUEUE 1
+#endif
+
 typedef struct zzuf_opts zzuf_opts_t;
 typedef struct zzuf_child zzuf_child_t;
+typedef struct zzuf_input zzuf_input_t;
+typedef struct zzuf_copy zzuf_copy_t;
+typedef struct zzuf_job zzuf_job_t;
+typedef struct zzuf_pool zzuf_pool_t;
+typedef struct zzuf_cursor zzuf_cursor_t;
+typedef struct zzuf_queue zzuf_queue_t;
 
 zzuf_opts_t *zzuf_create_opts(void);
 void zzuf_destroy_opts(zzuf_opts_t *);
@@ -45,12 +76,77 @@ struct zzuf_child
     HANDLE process_handle;
 #endif
     int fd[3]; /* 0 is debug, 1 is stderr, 2 is stdout */
-    int bytes, seed;
+    /* Fork server for this slot, if any. Until it reaches its fork point,
+     * server_pid is 0 and the server is also the slot's child. */
+    pid_t server_pid;
+    int server_fd;
+    int persist_fd; /* persistent mode status file */
+    int exit_fd; /* readable when the child exits (Linux pidfd) */
+    int bytes;
+    uint32_t seed, endseed; /* seeds left to run are [seed, endseed) */
     double ratio;
     int64_t date;
     zzuf_md5sum_t *md5;
     zzuf_hexdump_t *hex;
     char **newargv;
+    zzuf_job_t *job; /* copy mode: the fuzzed copies of the inputs */
+    int entry; /* corpus mode: the input in zzuf_opts_t::corpus */
+};
+
+/* An input file, either given on the command line in copy mode or part
+ * of the corpus in corpus mode. Copy mode loads it once. */
+struct zzuf_input
+{
+    char *path;
+    int arg; /* position in zzuf_child_t::newargv */
+    int b_corpus; /* copy mode: stands for the child's corpus input */
+    int b_mmap;
+    uint8_t *data;
+    size_t size;
+    int crashes; /* corpus mode: crashes seen with this input */
+};
+
+/* Copy mode: a fuzzed copy of an input, in a memory file that is reused
+ * from one seed to the next, or -1 for a temporary file */
+struct zzuf_copy
+{
+    int fd;
+    uint8_t *map;
+    zzuf_input_t const *src; /* the input the memory file was made for */
+    int b_sealed; /* children cannot write to the memory file */
+    int b_link; /* name is a symbolic link to the memory file */
+    fuzz_record_t record; /* the bytes altered for the last seed */
+    char *name; /* the path given to the child */
+    uint32_t seed; /* the settings _zz_register() gave this input */
+    double ratio;
+};
+
+/* Copy mode: the fuzzed copies of all the inputs for one child. Jobs are
+ * queued ahead of time and prepared by worker threads, if there are any,
+ * or right before the child is launched. */
+struct zzuf_job
+{
+    enum job_status
+    {
+        JOB_FREE,
+        JOB_QUEUED,
+        JOB_BUSY, /* a worker is preparing it */
+        JOB_READY,
+        JOB_USED, /* given to a child */
+    } status;
+
+    int entry; /* corpus mode: the input in zzuf_opts_t::corpus */
+    uint32_t seed;
+    zzuf_copy_t *copy; /* one per input */
+};
+
+/* A position in the (input, seed) pairs run by this process, see shard.c */
+struct zzuf_cursor
+{
+    int entry; /* corpus mode: the input in zzuf_opts_t::corpus */
+    uint32_t seed; /* zzuf_opts_t::endseed once there are no seeds left */
+    int64_t block; /* the nth block of seeds taken by this process */
+    int64_t offset; /* the position in the block */
 };
 
 struct zzuf_opts
@@ -63,10 +159,12 @@ struct zzuf_opts
     } opmode;
     char **oldargv;
     int oldargc;
-    char *fuzzing, *bytes, *list, *ports, *protect, *refuse, *allow;
+    char *fuzzing, *generator;
+    char *bytes, *list, *ports, *protect, *refuse, *allow;
 
     uint32_t seed;
     uint32_t endseed;
+    zzuf_cursor_t next; /* the next seeds to launch */
 
     double minratio;
     double maxratio;
@@ -76,10 +174,13 @@ struct zzuf_opts
     int b_checkexit;
     int b_verbose;
     int b_quiet;
+    int b_forkserver;
 
+    int persistent;
     int maxbytes;
     int maxcpu;
     int maxmem;
+    int chunkcache;
 
     int64_t starttime;
     int64_t maxtime;
@@ -87,7 +188,20 @@ struct zzuf_opts
     int64_t delay;
     int64_t lastlaunch;
 
-    int maxchild, nchild, maxcrashes, crashes;
+    int maxchild, nchild, maxcrashes, crashes, launches;
+    int ninputs, njobs;
+    zzuf_input_t *input;
+    int ncorpus, corpus_arg;
+    zzuf_input_t *corpus;
+    /* Seed distribution: static sharding (-H) or shared queue (-Q) */
+    int shard, nshards;
+    int64_t npairs, batch;
+    zzuf_queue_t *queue;
+    zzuf_job_t *job;
+    zzuf_pool_t *pool; /* copy mode worker threads, see copy.c */
+    char *linkdir; /* copy mode: holds the links to memory files */
+    int64_t busytime; /* total time spent by children in their slots */
+    int epoll_fd, timer_fd;
 
     zzuf_child_t *child;
 };
@@ -0,0 +1,423 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  shard.c: seed distribution
+ *
+ *  The (input, seed) pairs to run are numbered from 0, input first, and
+ *  taken by blocks of consecutive pairs. On its own, a zzuf process takes
+ *  them all as one block. With -H, it only takes one block out of n, and
+ *  with -Q, it takes blocks from a counter shared with other processes,
+ *  so that fast processes take more blocks than slow ones. The counter
+ *  is in a file: if the file is in memory, it is simply incremented
+ *  atomically, otherwise the file is locked, which also works across
+ *  hosts on a network file system.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE /* for ftruncate() and fstatfs() */
+
+#if defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#elif defined HAVE_STDINT_H
+#   include <stdint.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_FCNTL_H
+#   include <fcntl.h>
+#endif
+#if defined HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#if defined HAVE_SYS_VFS_H
+#   include <sys/vfs.h>
+#endif
+
+#include "common.h"
+#include "opts.h"
+#include "corpus.h"
+#include "shard.h"
+#include "util/mutex.h"
+
+/* The counter is only mapped in memory when the file is in a tmpfs file
+ * system, which cannot be shared by several hosts */
+#if defined ZZUF_QUEUE && defined HAVE_SYS_VFS_H && defined HAVE_FSTATFS \
+     && defined HAVE_MMAP && defined __linux__
+#   define ZZUF_QUEUE_MMAP 1
+#   define TMPFS_MAGIC_NUMBER 0x01021994
+#endif
+
+#if defined ZZUF_QUEUE
+struct zzuf_queue
+{
+    int fd;
+    int64_t *counter; /* the mapped counter, or NULL */
+    /* Start of the blocks taken, from zzuf_opts_t::next's block on */
+    int64_t first, *blocks;
+    int nblocks, b_empty;
+};
+
+static zzuf_queue_t *open_queue(char const *);
+static void close_queue(zzuf_queue_t *);
+static int64_t claim(zzuf_queue_t *, int64_t);
+static int raise_to(zzuf_queue_t *, int64_t);
+static int lock(zzuf_queue_t *, int);
+#endif
+
+static int64_t seed_range(zzuf_opts_t const *);
+static int64_t block_start(zzuf_opts_t *, int64_t);
+static void settle(zzuf_opts_t *, zzuf_cursor_t *);
+static void seek(zzuf_opts_t *, zzuf_cursor_t *, int64_t, int64_t);
+
+/*
+ * Choose the size of the blocks and open the queue, if any. Returns -1 if
+ * the queue cannot be opened.
+ */
+int shard_init(zzuf_opts_t *opts, char const *queue)
+{
+    int64_t count = opts->persistent ? opts->persistent : 1;
+
+    opts->npairs = seed_range(opts) * (opts->ncorpus ? opts->ncorpus : 1);
+
+    /* Blocks are small enough to balance the work, and large enough for
+     * a persistent process to run a whole block */
+    if (queue)
+        opts->batch = count * opts->maxchild;
+    else if (opts->nshards > 1)
+        opts->batch = count;
+    else
+        opts->batch = opts->npairs > 0 ? opts->npairs : 1;
+
+#if defined ZZUF_QUEUE
+    if (queue)
+    {
+        opts->queue = open_queue(queue);
+        if (!opts->queue)
+            return -1;
+    }
+#else
+    if (queue)
+        return -1;
+#endif
+
+    return 0;
+}
+
+void shard_fini(zzuf_opts_t *opts)
+{
+#if defined ZZUF_QUEUE
+    if (opts->queue)
+        close_queue(opts->queue);
+    opts->queue = NULL;
+#else
+    (void)opts;
+#endif
+}
+
+/*
+ * Put a cursor on the first pair this process runs.
+ */
+void shard_start(zzuf_opts_t *opts, zzuf_cursor_t *cursor)
+{
+    cursor->entry = 0;
+    cursor->seed = opts->seed;
+    cursor->block = 0;
+    cursor->offset = 0;
+    settle(opts, cursor);
+}
+
+/*
+ * Count the seeds, up to max, that can be run in a row from a cursor:
+ * they have to be for the same input and in the same block.
+ */
+uint32_t shard_count(zzuf_opts_t *opts, zzuf_cursor_t const *cursor,
+                     uint32_t max)
+{
+    int64_t pos = block_start(opts, cursor->block) + cursor->offset;
+    int64_t left = opts->batch - cursor->offset;
+
+    if ((cursor->entry + 1) * seed_range(opts) - pos < left)
+        left = (cursor->entry + 1) * seed_range(opts) - pos;
+
+    return left < max ? (uint32_t)left : max;
+}
+
+/*
+ * Move a cursor past count seeds, or only past the inputs that crashed
+ * too often if count is 0.
+ */
+void shard_skip(zzuf_opts_t *opts, zzuf_cursor_t *cursor, uint32_t count)
+{
+    if (cursor->seed == opts->endseed)
+        return;
+
+    cursor->offset += count;
+    settle(opts, cursor);
+}
+
+static int64_t seed_range(zzuf_opts_t const *opts)
+{
+    return opts->endseed > opts->seed
+            ? (int64_t)opts->endseed - opts->seed : 0;
+}
+
+/*
+ * Find where the nth block taken by this process starts, taking it from
+ * the queue if necessary. Returns -1 if there are no seeds left for it.
+ */
+static int64_t block_start(zzuf_opts_t *opts, int64_t block)
+{
+#if defined ZZUF_QUEUE
+    zzuf_queue_t *queue = opts->queue;
+    if (queue)
+    {
+        /* Forget the blocks that were launched */
+        int64_t done = opts->next.block - queue->first;
+        if (done > 0 && done <= queue->nblocks)
+        {
+            queue->nblocks -= (int)done;
+            memmove(queue->blocks, queue->blocks + done,
+                    queue->nblocks * sizeof(int64_t));
+            queue->first += done;
+        }
+
+        while (!queue->b_empty && block - queue->first >= queue->nblocks)
+        {
+            /* Make room first, so that a claimed block is never lost */
+            int64_t *blocks = realloc(queue->blocks,
+                                      (queue->nblocks + 1) * sizeof(int64_t));
+            if (blocks)
+                queue->blocks = blocks;
+
+            int64_t start = blocks ? claim(queue, opts->batch) : -1;
+            if (start < 0 || start >= opts->npairs)
+            {
+                queue->b_empty = 1;
+                break;
+            }
+
+            queue->blocks[queue->nblocks++] = start;
+        }
+
+        if (block < queue->first || block - queue->first >= queue->nblocks)
+            return -1;
+
+        return queue->blocks[block - queue->first];
+    }
+#endif
+
+    int64_t start = (block * opts->nshards + opts->shard) * opts->batch;
+    return start < opts->npairs ? start : -1;
+}
+
+/*
+ * Make sure a cursor is on a pair that this process runs and whose input
+ * did not crash too often, or mark it as finished.
+ */
+static void settle(zzuf_opts_t *opts, zzuf_cursor_t *cursor)
+{
+    int64_t range = seed_range(opts);
+
+    for (;;)
+    {
+        int64_t start = block_start(opts, cursor->block);
+        if (start < 0)
+        {
+            cursor->seed = opts->endseed;
+            return;
+        }
+
+        int64_t pos = start + cursor->offset;
+        if (cursor->offset >= opts->batch || pos >= opts->npairs)
+        {
+            cursor->block++;
+            cursor->offset = 0;
+            continue;
+        }
+
+        cursor->entry = (int)(pos / range);
+        cursor->seed = opts->seed + (uint32_t)(pos % range);
+        if (!corpus_crashed(opts, cursor->entry))
+            return;
+
+        seek(opts, cursor, start, (cursor->entry + 1) * range);
+    }
+}
+
+/*
+ * Move a cursor on a block starting at start to the first pair at or
+ * after pos that this process may run, without going through all the
+ * blocks in between. The queue is moved past pos as well, so that the
+ * other processes do not run the skipped pairs either.
+ */
+static void seek(zzuf_opts_t *opts, zzuf_cursor_t *cursor,
+                 int64_t start, int64_t pos)
+{
+    if (pos < start + opts->batch)
+    {
+        cursor->offset = pos - start;
+        return;
+    }
+
+#if defined ZZUF_QUEUE
+    if (opts->queue)
+    {
+        /* If the other processes cannot be told, stop taking blocks
+         * rather than let them run the skipped pairs */
+        if (raise_to(opts->queue, pos) < 0)
+            opts->queue->b_empty = 1;
+        cursor->block++;
+        cursor->offset = 0;
+        return;
+    }
+#endif
+
+    /* The first block of ours that ends after pos */
+    int64_t block = pos / opts->batch;
+    cursor->block = block > opts->shard
+                  ? (block - opts->shard + opts->nshards - 1) / opts->nshards
+                  : 0;
+    cursor->offset = cursor->block * opts->nshards + opts->shard == block
+                   ? pos - block * opts->batch : 0;
+}
+
+#if defined ZZUF_QUEUE
+static zzuf_queue_t *open_queue(char const *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return NULL;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    zzuf_queue_t *queue = malloc(sizeof(zzuf_queue_t));
+    queue->fd = fd;
+    queue->counter = NULL;
+    queue->first = 0;
+    queue->blocks = NULL;
+    queue->nblocks = 0;
+    queue->b_empty = 0;
+
+#if defined ZZUF_QUEUE_MMAP
+    /* Extending the file to the counter's size does not change it if
+     * another process already did */
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == TMPFS_MAGIC_NUMBER
+         && lock(queue, F_WRLCK) == 0)
+    {
+        off_t size = lseek(fd, 0, SEEK_END);
+        void *p = MAP_FAILED;
+        if (size >= (off_t)sizeof(int64_t)
+             || ftruncate(fd, sizeof(int64_t)) == 0)
+            p = mmap(NULL, sizeof(int64_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+            queue->counter = p;
+        lock(queue, F_UNLCK);
+    }
+#endif
+
+    return queue;
+}
+
+static void close_queue(zzuf_queue_t *queue)
+{
+#if defined ZZUF_QUEUE_MMAP
+    if (queue->counter)
+        munmap(queue->counter, sizeof(int64_t));
+#endif
+    close(queue->fd);
+    free(queue->blocks);
+    free(queue);
+}
+
+/*
+ * Take the next n pairs from the queue. Returns the first one, or -1 if
+ * the queue cannot be read.
+ */
+static int64_t claim(zzuf_queue_t *queue, int64_t n)
+{
+    if (queue->counter)
+        return zzuf_atomic_add64(queue->counter, n) - n;
+
+    if (lock(queue, F_WRLCK) < 0)
+        return -1;
+
+    int64_t start = 0, end;
+    if (lseek(queue->fd, 0, SEEK_SET) < 0
+         || read(queue->fd, &start, sizeof(start)) != sizeof(start))
+        start = 0; /* the file was just created */
+    end = start + n;
+    if (lseek(queue->fd, 0, SEEK_SET) < 0
+         || write(queue->fd, &end, sizeof(end)) != sizeof(end))
+        start = -1;
+
+    lock(queue, F_UNLCK);
+    return start;
+}
+
+/*
+ * Make sure the queue does not hand out the pairs before pos. Returns -1
+ * if the queue cannot be read or written.
+ */
+static int raise_to(zzuf_queue_t *queue, int64_t pos)
+{
+    if (queue->counter)
+    {
+        int64_t old = *queue->counter;
+        while (old < pos)
+        {
+            int64_t tmp = zzuf_atomic_cas64(queue->counter, old, pos);
+            if (tmp == old)
+                break;
+            old = tmp;
+        }
+        return 0;
+    }
+
+    if (lock(queue, F_WRLCK) < 0)
+        return -1;
+
+    int64_t start = 0;
+    int ret = 0;
+    if (lseek(queue->fd, 0, SEEK_SET) < 0
+         || read(queue->fd, &start, sizeof(start)) != sizeof(start))
+        start = 0; /* the file was just created */
+    if (start < pos && (lseek(queue->fd, 0, SEEK_SET) < 0
+                         || write(queue->fd, &pos, sizeof(pos)) != sizeof(pos)))
+        ret = -1;
+
+    lock(queue, F_UNLCK);
+    return ret;
+}
+
+static int lock(zzuf_queue_t *queue, int type)
+{
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+
+    while (fcntl(queue->fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &fl) < 0)
+        if (errno != EINTR)
+            return -1;
+
+    return 0;
+}
+#endif
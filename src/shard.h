@@ -0,0 +1,24 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2016 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#pragma once
+
+/*
+ *  shard.h: seed distribution
+ */
+
+int shard_init(zzuf_opts_t *opts, char const *queue);
+void shard_fini(zzuf_opts_t *opts);
+void shard_start(zzuf_opts_t *opts, zzuf_cursor_t *cursor);
+uint32_t shard_count(zzuf_opts_t *opts, zzuf_cursor_t const *cursor,
+                     uint32_t max);
+void shard_skip(zzuf_opts_t *opts, zzuf_cursor_t *cursor, uint32_t count);
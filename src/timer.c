@@ -40,7 +40,7 @@ int64_t zzuf_time(void)
     gettimeofday(&tv, NULL);
     return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 #else
-    static zzuf_mutex_t mutex = 0;
+    static zzuf_mutex_t mutex = ZZUF_MUTEX_INIT("timer");
     static unsigned long int prev = 0;
     static uint64_t tv_base = 0;
 
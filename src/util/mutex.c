@@ -0,0 +1,161 @@
+/*
+ *  zzuf - general purpose fuzzer
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+/*
+ *  mutex.c: lock contention handling
+ */
+
+#include "config.h"
+/* Needed for syscall() */
+#define _GNU_SOURCE
+
+#if defined HAVE_LINUX_FUTEX_H
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#endif
+#if defined HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#if defined HAVE_SCHED_YIELD
+#   include <sched.h>
+#endif
+#include <errno.h>
+#include <stddef.h>
+
+#include "util/mutex.h"
+
+#if defined HAVE_LINUX_FUTEX_H && defined SYS_futex
+#   define USE_FUTEX 1
+#   if !defined FUTEX_PRIVATE_FLAG
+#       define FUTEX_PRIVATE_FLAG 0
+#   endif
+#endif
+
+/* How many times we look at a lock before going to sleep. Most critical
+ * sections in zzuf are a few hundred instructions long, so a preempted
+ * lock owner is the only reason to spin much longer than that. */
+#define SPIN_COUNT 200
+
+/* List of the locks that were contended at least once */
+static zzuf_mutex_t *volatile contended_list = NULL;
+
+static inline int exchange(zzuf_mutex_t *l, int val)
+{
+#if _WIN32
+    return InterlockedExchange(&l->lock, val);
+#else
+    /* This is only an acquire barrier, which is all we need here */
+    return __sync_lock_test_and_set(&l->lock, val);
+#endif
+}
+
+static inline int compare_exchange(zzuf_mutex_t *l, int old, int val)
+{
+#if _WIN32
+    return InterlockedCompareExchange(&l->lock, val, old);
+#else
+    return __sync_val_compare_and_swap(&l->lock, old, val);
+#endif
+}
+
+static inline void cpu_pause(void)
+{
+#if _WIN32
+    YieldProcessor();
+#elif defined __i386__ || defined __x86_64__
+    __builtin_ia32_pause();
+#elif defined __aarch64__ || (defined __arm__ && __ARM_ARCH >= 7)
+    __asm__ __volatile__("yield");
+#elif defined __powerpc__ || defined __ppc__
+    __asm__ __volatile__("or 27,27,27");
+#endif
+}
+
+/* Sleep until the lock word is no longer 2, or for a short while if we
+ * have no way to be woken up. */
+static void sleep_on(zzuf_mutex_t *l)
+{
+#if USE_FUTEX
+    int saved_errno = errno;
+    /* Returns immediately if the lock was released in the meantime, and
+     * may return early because of a signal: the caller checks again. */
+    syscall(SYS_futex, &l->lock, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2,
+            NULL, NULL, 0);
+    errno = saved_errno;
+#elif _WIN32
+    SwitchToThread();
+#elif defined HAVE_SCHED_YIELD
+    sched_yield();
+#else
+    (void)l;
+#endif
+}
+
+static void add_contended(zzuf_mutex_t *l)
+{
+    zzuf_mutex_t *head;
+
+    do
+    {
+        head = zzuf_atomic_load_ptr((void *volatile *)&contended_list);
+        l->next = head;
+    }
+#if _WIN32
+    while (InterlockedCompareExchangePointer(
+                (void *volatile *)&contended_list, l, head) != head);
+#else
+    while (!__sync_bool_compare_and_swap(&contended_list, head, l));
+#endif
+}
+
+void zzuf_mutex_wait(zzuf_mutex_t *l)
+{
+    if (zzuf_atomic_add(&l->contended, 1) == 1 && l->name)
+        add_contended(l);
+
+    /* Spin for a while, hoping the owner releases the lock soon */
+    for (int i = 0; i < SPIN_COUNT; ++i)
+    {
+        cpu_pause();
+        if (l->lock == 0 && compare_exchange(l, 0, 1) == 0)
+            return;
+    }
+
+    /* Mark the lock as having sleepers, and sleep until we get it. Since
+     * we cannot know whether other threads are still sleeping when we
+     * wake up, we keep the lock marked as such. */
+    while (exchange(l, 2) != 0)
+    {
+        zzuf_atomic_add(&l->waits, 1);
+        sleep_on(l);
+    }
+}
+
+void zzuf_mutex_wake(zzuf_mutex_t *l)
+{
+#if USE_FUTEX
+    int saved_errno = errno;
+    syscall(SYS_futex, &l->lock, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1,
+            NULL, NULL, 0);
+    errno = saved_errno;
+#else
+    (void)l;
+#endif
+}
+
+/* Iterate over the named locks that were contended at least once */
+zzuf_mutex_t *zzuf_mutex_next_contended(zzuf_mutex_t *l)
+{
+    return l ? l->next
+             : zzuf_atomic_load_ptr((void *volatile *)&contended_list);
+}
+
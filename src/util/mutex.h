@@ -13,39 +13,154 @@
 #pragma once
 
 /*
- *  mutex.h: very simple spinlock routines
+ *  mutex.h: very simple lock and atomic routines
  */
 
+#if defined HAVE_STDINT_H
+#   include <stdint.h>
+#elif defined HAVE_INTTYPES_H
+#   include <inttypes.h>
+#endif
 #if HAVE_WINDOWS_H
 #   include <windows.h>
 #endif
 
+#if !_WIN32 && !__GNUC__ && !__clang__
+#   error "No known atomic operations for this platform"
+#endif
+
+/* The lock word is 0 when the lock is free, 1 when it is taken, and 2
+ * when it is taken and other threads may be sleeping on it. Taking a
+ * free lock or releasing an uncontended one is a single atomic operation;
+ * the rest is done by zzuf_mutex_wait() and zzuf_mutex_wake(), which spin
+ * for a while before sleeping. They do not allocate memory and preserve
+ * errno, so locks can be used very early and from signal handlers. */
+typedef struct zzuf_mutex zzuf_mutex_t;
+
+struct zzuf_mutex
+{
 #if _WIN32
-typedef volatile LONG zzuf_mutex_t;
-#elif __GNUC__ || __clang__
-typedef volatile int zzuf_mutex_t;
+    volatile LONG lock;
 #else
-#   error "No known atomic operations for this platform"
+    volatile int lock;
 #endif
+    char const *name;
+    /* Contention statistics, see zzuf_mutex_next_contended() */
+    volatile int contended, waits;
+    zzuf_mutex_t *volatile next;
+};
+
+#define ZZUF_MUTEX_INIT(name) { 0, name, 0, 0, NULL }
+
+extern void zzuf_mutex_wait(zzuf_mutex_t *);
+extern void zzuf_mutex_wake(zzuf_mutex_t *);
+extern zzuf_mutex_t *zzuf_mutex_next_contended(zzuf_mutex_t *);
 
 static inline void zzuf_mutex_lock(zzuf_mutex_t *l)
 {
 #if _WIN32
-    do {}
-    while (InterlockedExchange(l, 1));
+    if (InterlockedCompareExchange(&l->lock, 1, 0) != 0)
+        zzuf_mutex_wait(l);
 #elif __GNUC__ || __clang__
-    do {}
-    while (__sync_lock_test_and_set(l, 1));
+    if (__sync_val_compare_and_swap(&l->lock, 0, 1) != 0)
+        zzuf_mutex_wait(l);
 #endif
 }
 
 static inline void zzuf_mutex_unlock(zzuf_mutex_t *l)
 {
 #if _WIN32
-    InterlockedExchange(l, 0);
+    if (InterlockedExchange(&l->lock, 0) == 2)
+        zzuf_mutex_wake(l);
+#elif defined __ATOMIC_RELEASE
+    if (__atomic_exchange_n(&l->lock, 0, __ATOMIC_RELEASE) == 2)
+        zzuf_mutex_wake(l);
+#elif __GNUC__ || __clang__
+    __sync_synchronize();
+    if (__sync_lock_test_and_set(&l->lock, 0) == 2)
+        zzuf_mutex_wake(l);
+#endif
+}
+
+/* Lock-free publication of pointers: a writer fully initialises the data
+ * before storing its address, and readers loading the address are
+ * guaranteed to see the initialised data. */
+static inline void *zzuf_atomic_load_ptr(void *volatile *p)
+{
+#if _WIN32
+    return *p; /* volatile reads have acquire semantics */
+#elif defined __ATOMIC_ACQUIRE
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif __GNUC__ || __clang__
+    void *ret = *p;
+    __sync_synchronize();
+    return ret;
+#endif
+}
+
+static inline void zzuf_atomic_store_ptr(void *volatile *p, void *v)
+{
+#if _WIN32
+    InterlockedExchangePointer(p, v);
+#elif defined __ATOMIC_RELEASE
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#elif __GNUC__ || __clang__
+    __sync_synchronize();
+    *p = v;
+#endif
+}
+
+/* The same for flags guarding data that is set up once */
+static inline int zzuf_atomic_load_int(volatile int *p)
+{
+#if _WIN32
+    return *p; /* volatile reads have acquire semantics */
+#elif defined __ATOMIC_ACQUIRE
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif __GNUC__ || __clang__
+    int ret = *p;
+    __sync_synchronize();
+    return ret;
+#endif
+}
+
+static inline void zzuf_atomic_store_int(volatile int *p, int v)
+{
+#if _WIN32
+    InterlockedExchange((volatile LONG *)p, v);
+#elif defined __ATOMIC_RELEASE
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
 #elif __GNUC__ || __clang__
-    *l = 0;
     __sync_synchronize();
+    *p = v;
+#endif
+}
+
+static inline int zzuf_atomic_add(volatile int *p, int n)
+{
+#if _WIN32
+    return InterlockedExchangeAdd((volatile LONG *)p, n) + n;
+#elif __GNUC__ || __clang__
+    return __sync_add_and_fetch(p, n);
+#endif
+}
+
+static inline int64_t zzuf_atomic_add64(volatile int64_t *p, int64_t n)
+{
+#if _WIN32
+    return InterlockedExchangeAdd64((volatile LONGLONG *)p, n) + n;
+#elif __GNUC__ || __clang__
+    return __sync_add_and_fetch(p, n);
+#endif
+}
+
+static inline int64_t zzuf_atomic_cas64(volatile int64_t *p,
+                                        int64_t old, int64_t val)
+{
+#if _WIN32
+    return InterlockedCompareExchange64((volatile LONGLONG *)p, val, old);
+#elif __GNUC__ || __clang__
+    return __sync_val_compare_and_swap(p, old, val);
 #endif
 }
 
@@ -51,12 +51,6 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
-//#include <libgen.h>
-#if defined HAVE_ALLOCA_H
-#   include <alloca.h>
-#else
-#   define alloca _alloca
-#endif
 #if defined HAVE_SYS_TIME_H
 #   include <sys/time.h>
 #endif
@@ -66,12 +60,21 @@
 #if defined HAVE_SYS_RESOURCE_H
 #   include <sys/resource.h> /* for RLIMIT_AS */
 #endif
+#if defined HAVE_SYS_EPOLL_H
+#   include <sys/epoll.h>
+#endif
+#if defined HAVE_SYS_TIMERFD_H
+#   include <sys/timerfd.h>
+#endif
 
 #include "common.h"
 #include "opts.h"
 #include "random.h"
 #include "fd.h"
 #include "fuzz.h"
+#include "copy.h"
+#include "corpus.h"
+#include "shard.h"
 #include "myfork.h"
 #include "timer.h"
 #include "util/getopt.h"
@@ -101,9 +104,22 @@
 
 static void loop_stdin(zzuf_opts_t *);
 
+static int resume_slot(zzuf_opts_t *);
 static void spawn_children(zzuf_opts_t *);
+static int spawn_child(zzuf_opts_t *);
 static void clean_children(zzuf_opts_t *);
+static void collect_child(zzuf_opts_t *, int);
+#if defined ZZUF_FORKSERVER
+static void server_ready(zzuf_opts_t *, int);
+#endif
 static void read_children(zzuf_opts_t *);
+#if !defined _WIN32
+static int read_channel(zzuf_opts_t *, int, int);
+#endif
+#if defined ZZUF_EPOLL
+static int64_t next_deadline(zzuf_opts_t *);
+static int arm_timer(zzuf_opts_t *);
+#endif
 
 #if !defined HAVE_SETENV
 static void setenv(char const *, char const *, int);
@@ -111,7 +127,7 @@ static void setenv(char const *, char const *, int);
 #if defined HAVE_WAITPID
 static char const *sig2name(int);
 #endif
-static void finfo(FILE *, zzuf_opts_t *, uint32_t);
+static void finfo(FILE *, zzuf_opts_t *, int, uint32_t);
 #if defined HAVE_REGEX_H
 static char *merge_regex(char *, char *);
 static char *merge_file(char *, char *);
@@ -131,7 +147,7 @@ static void usage(void);
     ((fd >= 0) && (FD_ISSET(fd, p_fdset)))
 
 #if defined _WIN32
-static zzuf_mutex_t pipe_mutex = 0;
+static zzuf_mutex_t pipe_mutex = ZZUF_MUTEX_INIT("pipe");
 #endif
 
 int main(int argc, char *argv[])
@@ -141,6 +157,7 @@ int main(int argc, char *argv[])
     char *include = NULL, *exclude = NULL;
     int b_cmdline = 0;
 #endif
+    char const *corpus = NULL, *queue = NULL;
     int debug = 0, b_network = 0;
 
     zzuf_opts_t *opts = zzuf_create_opts();
@@ -162,8 +179,24 @@ int main(int argc, char *argv[])
 #else
 #   define OPTSTR_RLIMIT_CPU ""
 #endif
+#if defined ZZUF_FORKSERVER
+#   define OPTSTR_FORKSERVER "z:Z"
+#else
+#   define OPTSTR_FORKSERVER ""
+#endif
+#if defined ZZUF_PERSISTENT
+#   define OPTSTR_PERSISTENT "N:"
+#else
+#   define OPTSTR_PERSISTENT ""
+#endif
+#if defined ZZUF_QUEUE
+#   define OPTSTR_QUEUE "Q:"
+#else
+#   define OPTSTR_QUEUE ""
+#endif
 #define OPTSTR "+" OPTSTR_REGEX OPTSTR_RLIMIT_MEM OPTSTR_RLIMIT_CPU \
-                "a:Ab:B:C:dD:e:f:F:ij:l:mnO:p:P:qr:R:s:St:U:vxXhV"
+                OPTSTR_FORKSERVER OPTSTR_PERSISTENT OPTSTR_QUEUE \
+                "a:Ab:B:C:dD:e:f:F:g:H:ij:k:K:l:LmnO:p:P:qr:R:s:St:U:vxXhV"
 #define MOREINFO "Try `%s --help' for more information.\n"
         int option_index = 0;
         static zzuf_option_t long_options[] =
@@ -183,20 +216,31 @@ int main(int argc, char *argv[])
             { "exclude",      1, NULL, 'E' },
 #endif
             { "fuzzing",      1, NULL, 'f' },
+            { "generator",    1, NULL, 'g' },
+            { "shard",        1, NULL, 'H' },
             { "stdin",        0, NULL, 'i' },
 #if defined HAVE_REGEX_H
             { "include",      1, NULL, 'I' },
 #endif
             { "jobs",         1, NULL, 'j' },
+            { "chunk-cache",  1, NULL, 'k' },
+            { "corpus",       1, NULL, 'K' },
             { "list",         1, NULL, 'l' },
+            { "lazy-mmap",    0, NULL, 'L' },
             { "md5",          0, NULL, 'm' },
 #if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
             { "max-memory",   1, NULL, 'M' },
 #endif
             { "network",      0, NULL, 'n' },
+#if defined ZZUF_PERSISTENT
+            { "persistent",   1, NULL, 'N' },
+#endif
             { "opmode",       1, NULL, 'O' },
             { "ports",        1, NULL, 'p' },
             { "protect",      1, NULL, 'P' },
+#if defined ZZUF_QUEUE
+            { "queue",        1, NULL, 'Q' },
+#endif
             { "quiet",        0, NULL, 'q' },
             { "ratio",        1, NULL, 'r' },
             { "refuse",       1, NULL, 'R' },
@@ -210,6 +254,10 @@ int main(int argc, char *argv[])
             { "verbose",      0, NULL, 'v' },
             { "check-exit",   0, NULL, 'x' },
             { "hex",          0, NULL, 'X' },
+#if defined ZZUF_FORKSERVER
+            { "fork-point",   1, NULL, 'z' },
+            { "fork-server",  0, NULL, 'Z' },
+#endif
             { "help",         0, NULL, 'h' },
             { "version",      0, NULL, 'V' },
             { NULL,           0, NULL,  0  }
@@ -270,6 +318,9 @@ int main(int argc, char *argv[])
         case 'f': /* --fuzzing */
             opts->fuzzing = zz_optarg;
             break;
+        case 'g': /* --generator */
+            opts->generator = zz_optarg;
+            break;
         case 'F':
             fprintf(stderr, "%s: `-F' is deprecated, use `-j'\n", argv[0]);
             zzuf_destroy_opts(opts);
@@ -294,9 +345,36 @@ int main(int argc, char *argv[])
                 zz_optarg++;
             opts->maxchild = atoi(zz_optarg) > 1 ? atoi(zz_optarg) : 1;
             break;
+        case 'k': /* --chunk-cache */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            opts->chunkcache = atoi(zz_optarg) > 1 ? atoi(zz_optarg) : 1;
+            break;
+        case 'H': /* --shard */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            tmp = strchr(zz_optarg, '/');
+            opts->shard = atoi(zz_optarg);
+            opts->nshards = tmp ? atoi(tmp + 1) : 0;
+            if (opts->shard < 0 || opts->shard >= opts->nshards)
+            {
+                fprintf(stderr, "%s: invalid shard -- `%s'\n",
+                        argv[0], zz_optarg);
+                zzuf_destroy_opts(opts);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'K': /* --corpus */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            corpus = zz_optarg;
+            break;
         case 'l': /* --list */
             opts->list = zz_optarg;
             break;
+        case 'L': /* --lazy-mmap */
+            setenv("ZZUF_LAZYMMAP", "1", 1);
+            break;
         case 'm': /* --md5 */
             opts->b_md5 = 1;
             break;
@@ -311,6 +389,15 @@ int main(int argc, char *argv[])
             setenv("ZZUF_NETWORK", "1", 1);
             b_network = 1;
             break;
+#if defined ZZUF_PERSISTENT
+        case 'N': /* --persistent */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            opts->persistent = atoi(zz_optarg);
+            if (opts->persistent <= 0)
+                opts->persistent = 0;
+            break;
+#endif
         case 'O': /* --opmode */
             if (zz_optarg[0] == '=')
                 zz_optarg++;
@@ -334,6 +421,13 @@ int main(int argc, char *argv[])
         case 'P': /* --protect */
             opts->protect = zz_optarg;
             break;
+#if defined ZZUF_QUEUE
+        case 'Q': /* --queue */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            queue = zz_optarg;
+            break;
+#endif
         case 'q': /* --quiet */
             opts->b_quiet = 1;
             break;
@@ -385,6 +479,24 @@ int main(int argc, char *argv[])
         case 'v': /* --verbose */
             opts->b_verbose = 1;
             break;
+#if defined ZZUF_FORKSERVER
+        case 'z': /* --fork-point */
+            if (zz_optarg[0] == '=')
+                zz_optarg++;
+            if (strcmp(zz_optarg, "init") && strcmp(zz_optarg, "open"))
+            {
+                fprintf(stderr, "%s: invalid fork point -- `%s'\n",
+                        argv[0], zz_optarg);
+                zzuf_destroy_opts(opts);
+                return EXIT_FAILURE;
+            }
+            setenv("ZZUF_FORKPOINT", zz_optarg, 1);
+            opts->b_forkserver = 1;
+            break;
+        case 'Z': /* --fork-server */
+            opts->b_forkserver = 1;
+            break;
+#endif
         case 'h': /* --help */
             usage();
             zzuf_destroy_opts(opts);
@@ -428,11 +540,84 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (opts->b_forkserver && opts->opmode != OPMODE_PRELOAD)
+    {
+        fprintf(stderr, "%s: fork server (-Z) requires preload operating "
+                        "mode\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (opts->persistent && opts->opmode != OPMODE_PRELOAD)
+    {
+        fprintf(stderr, "%s: persistent mode (-N) requires preload operating "
+                        "mode\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (opts->persistent && opts->b_forkserver)
+    {
+        fprintf(stderr, "%s: persistent mode (-N) and fork server (-Z) are "
+                        "incompatible\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (corpus && zz_optind >= argc)
+    {
+        fprintf(stderr, "%s: corpus mode (-K) requires a program\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if ((opts->nshards > 1 || queue) && zz_optind >= argc)
+    {
+        fprintf(stderr, "%s: sharding (-H) and seed queue (-Q) require a "
+                        "program\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (opts->nshards > 1 && queue)
+    {
+        fprintf(stderr, "%s: sharding (-H) and seed queue (-Q) are "
+                        "incompatible\n", argv[0]);
+        printf(MOREINFO, argv[0]);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (corpus && corpus_load(opts, corpus) < 0)
+    {
+        fprintf(stderr, "%s: cannot read corpus `%s'\n", argv[0], corpus);
+        corpus_free(opts);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
+    if (shard_init(opts, queue) < 0)
+    {
+        fprintf(stderr, "%s: cannot open seed queue `%s'\n", argv[0], queue);
+        corpus_free(opts);
+        zzuf_destroy_opts(opts);
+        return EXIT_FAILURE;
+    }
+
     zzuf_set_ratio(opts->minratio, opts->maxratio);
     zzuf_set_seed(opts->seed);
 
     if (opts->fuzzing)
         _zz_fuzzing(opts->fuzzing);
+    if (opts->generator)
+        _zz_generator(opts->generator);
+    if (opts->chunkcache)
+        _zz_chunk_cache(opts->chunkcache);
     if (opts->bytes)
         _zz_bytes(opts->bytes);
     if (opts->list)
@@ -452,7 +637,7 @@ int main(int argc, char *argv[])
     {
         if (opts->b_verbose)
         {
-            finfo(stderr, opts, opts->seed);
+            finfo(stderr, opts, 0, opts->seed);
             fprintf(stderr, "reading from stdin\n");
         }
 
@@ -498,6 +683,8 @@ int main(int argc, char *argv[])
 
         if (opts->fuzzing)
             setenv("ZZUF_FUZZING", opts->fuzzing, 1);
+        if (opts->generator)
+            setenv("ZZUF_GENERATOR", opts->generator, 1);
         if (opts->bytes)
             setenv("ZZUF_BYTES", opts->bytes, 1);
         if (opts->list)
@@ -512,6 +699,12 @@ int main(int argc, char *argv[])
             setenv("ZZUF_PROTECT", opts->protect, 1);
         if (opts->refuse)
             setenv("ZZUF_REFUSE", opts->refuse, 1);
+        if (opts->chunkcache)
+        {
+            char buf[32];
+            snprintf(buf, 32, "%i", opts->chunkcache);
+            setenv("ZZUF_CHUNKCACHE", buf, 1);
+        }
 #if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
         if (opts->maxmem >= 0)
         {
@@ -520,6 +713,14 @@ int main(int argc, char *argv[])
             setenv("ZZUF_MEMORY", buf, 1);
         }
 #endif
+#if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_CPU
+        if (opts->maxcpu >= 0)
+        {
+            char buf[32];
+            snprintf(buf, 32, "%i", opts->maxcpu);
+            setenv("ZZUF_CPUTIME", buf, 1);
+        }
+#endif
 
         /* Allocate memory for children handling */
         opts->child = malloc(opts->maxchild * sizeof(zzuf_child_t));
@@ -527,23 +728,67 @@ int main(int argc, char *argv[])
         {
             opts->child[i].status = STATUS_FREE;
             memset(opts->child[i].fd, -1, sizeof(opts->child->fd));
+            opts->child[i].server_fd = -1;
+            opts->child[i].server_pid = 0;
+            opts->child[i].persist_fd = -1;
+            opts->child[i].exit_fd = -1;
+            opts->child[i].entry = 0;
+            opts->child[i].seed = opts->child[i].endseed = 0;
+            opts->child[i].job = NULL;
         }
         opts->nchild = 0;
 
-        /* Create new argv */
+#if defined ZZUF_EPOLL
+        /* If this fails, read_children() falls back to select() */
+        opts->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+#if defined ZZUF_TIMERFD
+        /* If this fails, read_children() uses the epoll_wait() timeout */
+        if (opts->epoll_fd >= 0)
+            opts->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                            TFD_NONBLOCK | TFD_CLOEXEC);
+        if (opts->timer_fd >= 0)
+        {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u64 = EVENT_TIMER;
+            if (epoll_ctl(opts->epoll_fd, EPOLL_CTL_ADD, opts->timer_fd, &ev))
+            {
+                close(opts->timer_fd);
+                opts->timer_fd = -1;
+            }
+        }
+#endif
+
+        /* Create new argv. In corpus mode, the input replaces the first
+         * {} argument, or is appended to the arguments. */
         opts->oldargc = argc;
         opts->oldargv = argv;
+        int len = argc - zz_optind;
+        if (opts->ncorpus)
+        {
+            opts->corpus_arg = 1;
+            while (opts->corpus_arg < len
+                    && strcmp(argv[zz_optind + opts->corpus_arg], "{}"))
+                ++opts->corpus_arg;
+        }
         for (int i = 0; i < opts->maxchild; ++i)
         {
-            int len = argc - zz_optind;
-            opts->child[i].newargv = malloc((len + 1) * sizeof(char *));
+            opts->child[i].newargv = malloc((len + 2) * sizeof(char *));
             memcpy(opts->child[i].newargv, argv + zz_optind,
                    len * sizeof(char *));
             opts->child[i].newargv[len] = (char *)NULL;
+            opts->child[i].newargv[len + 1] = (char *)NULL;
         }
 
+        shard_start(opts, &opts->next);
+        if (opts->opmode == OPMODE_COPY)
+            copy_init(opts);
+
         /* Main loop */
-        while (opts->nchild || opts->seed < opts->endseed)
+        while (opts->nchild || opts->next.seed < opts->endseed
+                || resume_slot(opts) >= 0)
         {
             /* Spawn new children, if necessary */
             spawn_children(opts);
@@ -554,8 +799,8 @@ int main(int argc, char *argv[])
             /* Read data from children */
             read_children(opts);
 
-            if (opts->maxcrashes && opts->crashes >= opts->maxcrashes
-                 && opts->nchild == 0)
+            if (!opts->ncorpus && opts->maxcrashes
+                 && opts->crashes >= opts->maxcrashes && opts->nchild == 0)
             {
                 if (opts->b_verbose)
                     fprintf(stderr,
@@ -572,12 +817,46 @@ int main(int argc, char *argv[])
                 break;
             }
         }
+
+        if (opts->b_verbose)
+        {
+            double elapsed = (double)(zzuf_time() - opts->starttime)
+                           / 1000000.0;
+            double busy = (double)opts->busytime / 1000000.0;
+
+            if (elapsed > 0.0)
+                fprintf(stderr, "zzuf: launched %i children in %.2f s "
+                        "(%.1f/s), slots %.1f%% busy\n", opts->launches,
+                        elapsed, (double)opts->launches / elapsed,
+                        100.0 * busy / (elapsed * opts->maxchild));
+
+            for (int e = 0; e < opts->ncorpus; ++e)
+                if (opts->corpus[e].crashes)
+                    fprintf(stderr, "zzuf: %i crashes with `%s'\n",
+                            opts->corpus[e].crashes, opts->corpus[e].path);
+        }
+
+#if defined HAVE_WAITPID
+        for (int i = 0; i < opts->maxchild; ++i)
+            myfork_stop(&opts->child[i], opts);
+#endif
+        if (opts->opmode == OPMODE_COPY)
+            copy_fini(opts);
+
+#if defined ZZUF_EPOLL
+        if (opts->timer_fd >= 0)
+            close(opts->timer_fd);
+        if (opts->epoll_fd >= 0)
+            close(opts->epoll_fd);
+#endif
     }
 
     int ret = opts->crashes ? EXIT_FAILURE : EXIT_SUCCESS;
 
     /* Clean up */
     _zz_fd_fini();
+    shard_fini(opts);
+    corpus_free(opts);
     zzuf_destroy_opts(opts);
 
     return ret;
@@ -635,7 +914,7 @@ static void loop_stdin(zzuf_opts_t *opts)
     {
         uint8_t md5sum[16];
         zzuf_destroy_md5(md5sum, md5);
-        finfo(stdout, opts, opts->seed);
+        finfo(stdout, opts, 0, opts->seed);
         fprintf(stdout, "%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x"
                 "%.02x%.02x%.02x%.02x%.02x%.02x\n", md5sum[0], md5sum[1],
                 md5sum[2], md5sum[3], md5sum[4], md5sum[5], md5sum[6],
@@ -651,20 +930,24 @@ static void loop_stdin(zzuf_opts_t *opts)
     _zz_unregister(0);
 }
 
-static void finfo(FILE *fp, zzuf_opts_t *opts, uint32_t seed)
+static void finfo(FILE *fp, zzuf_opts_t *opts, int entry, uint32_t seed)
 {
     if (opts->minratio == opts->maxratio)
 #if defined HAVE_INTTYPES_H
-        fprintf(fp, "zzuf[s=%"PRIu32",r=%g]: ", seed, opts->minratio);
+        fprintf(fp, "zzuf[s=%"PRIu32",r=%g", seed, opts->minratio);
     else
-        fprintf(fp, "zzuf[s=%"PRIu32",r=%g:%g]: ", seed,
+        fprintf(fp, "zzuf[s=%"PRIu32",r=%g:%g", seed,
                 opts->minratio, opts->maxratio);
 #else
-        fprintf(fp, "zzuf[s=%u,r=%g]: ", seed, opts->minratio);
+        fprintf(fp, "zzuf[s=%u,r=%g", seed, opts->minratio);
     else
-        fprintf(fp, "zzuf[s=%u,r=%g:%g]: ", seed,
+        fprintf(fp, "zzuf[s=%u,r=%g:%g", seed,
                 opts->minratio, opts->maxratio);
 #endif
+
+    if (opts->ncorpus)
+        fprintf(fp, ",f=%s", opts->corpus[entry].path);
+    fprintf(fp, "]: ");
 }
 
 #if defined HAVE_REGEX_H
@@ -717,113 +1000,111 @@ static char *merge_regex(char *regex, char *string)
 }
 #endif
 
+/*
+ * Find a free slot whose last process did not run all its seeds, which
+ * happens when a persistent mode child crashes or is killed. The seeds
+ * of corpus inputs that crashed too often are dropped.
+ */
+static int resume_slot(zzuf_opts_t *opts)
+{
+    for (int i = 0; i < opts->maxchild; ++i)
+        if (opts->child[i].status == STATUS_FREE
+             && opts->child[i].seed < opts->child[i].endseed
+             && !corpus_crashed(opts, opts->child[i].entry))
+            return i;
+
+    return -1;
+}
+
+/*
+ * Launch children into all the free slots at once, unless the delay
+ * between launches (-D) only lets us launch one.
+ */
 static void spawn_children(zzuf_opts_t *opts)
+{
+    while (spawn_child(opts) == 0)
+        ;
+}
+
+/*
+ * Launch one child. Returns 0 on success, -1 if there is nothing to
+ * launch right now or if the launch failed.
+ */
+static int spawn_child(zzuf_opts_t *opts)
 {
     int64_t now = zzuf_time();
 
     if (opts->nchild == opts->maxchild)
-        return; /* no slot */
+        return -1; /* no slot */
+
+    /* Seeds left over by a previous process go first */
+    int slot = resume_slot(opts);
 
-    if (opts->seed == opts->endseed)
-        return; /* job finished */
+    if (slot < 0 && opts->next.seed == opts->endseed)
+        return -1; /* job finished */
 
-    if (opts->maxcrashes && opts->crashes >= opts->maxcrashes)
-        return; /* all jobs crashed */
+    if (!opts->ncorpus && opts->maxcrashes
+         && opts->crashes >= opts->maxcrashes)
+        return -1; /* all jobs crashed */
 
     if (opts->maxtime && now - opts->starttime >= opts->maxtime)
-        return; /* run time exceeded */
+        return -1; /* run time exceeded */
 
     if (opts->delay > 0 && opts->lastlaunch + opts->delay > now)
-        return; /* too early */
+        return -1; /* too early */
 
-    /* Find the empty slot */
-    int slot = 0;
-    while (slot < opts->maxchild && opts->child[slot].status != STATUS_FREE)
-        ++slot;
+    if (opts->opmode == OPMODE_COPY
+         && (slot < 0 ? copy_pending(opts, opts->next.entry, opts->next.seed)
+                      : copy_pending(opts, opts->child[slot].entry,
+                                     opts->child[slot].seed)))
+        return -1; /* inputs not ready */
 
-    /* Prepare required files, if necessary */
-    if (opts->opmode == OPMODE_COPY)
+    if (slot < 0)
     {
-        char tmpname[4096];
-        char *tmpdir;
-        tmpdir = getenv("TEMP");
-        if (!tmpdir || !*tmpdir)
-            tmpdir = "/tmp";
-
-        int k = 0, extlen;
-
-        for (int j = zz_optind + 1; j < opts->oldargc; ++j)
-        {
-            FILE *fpin = fopen(opts->oldargv[j], "r");
-            if (!fpin)
-                continue;
-
-            // Copy the path name since basename() might clobber it
-            char *tmpcopy = alloca(strlen(opts->oldargv[j])+1);
-            strcpy(tmpcopy, opts->oldargv[j]);
-#if _WIN32
-            char extension[MAX_PATH];
-            _splitpath(tmpcopy, NULL, NULL, NULL, extension);
-            extlen = strlen(extension);
-#else
-            char *fbasename = basename(tmpcopy);
-            char *extension = strrchr(fbasename, '.');
-            if (!extension) {
-                extlen = 0;
-                extension = "";
-            }
-            else
-                extlen = strlen(extension);
-#endif
-
-#ifdef _WIN32
-            sprintf(tmpname, "%s/zzuf.%i.XXXXXX", tmpdir, GetCurrentProcessId());
-            int fdout = _open(mktemp(tmpname), _O_RDWR, 0600);
-#else
-            sprintf(tmpname, "%s/zzuf.%i.XXXXXX%s", tmpdir, (int)getpid(), extension);
-            int fdout = mkstemps(tmpname, extlen);
-#endif
-            if (fdout < 0)
-            {
-                fclose(fpin);
-                continue;
-            }
-
-            opts->child[slot].newargv[j - zz_optind] = strdup(tmpname);
+        /* Find the empty slot and give it the next seeds */
+        slot = 0;
+        while (slot < opts->maxchild
+                && opts->child[slot].status != STATUS_FREE)
+            ++slot;
+
+        uint32_t count = shard_count(opts, &opts->next,
+                                     opts->persistent ? opts->persistent : 1);
+
+        opts->child[slot].entry = opts->next.entry;
+        opts->child[slot].seed = opts->next.seed;
+        opts->child[slot].endseed = opts->next.seed + count;
+        shard_skip(opts, &opts->next, count);
+    }
 
-            _zz_register(k);
-            while (!feof(fpin))
-            {
-                uint8_t buf[BUFSIZ];
-                size_t n = fread(buf, 1, BUFSIZ, fpin);
-                if (n <= 0)
-                    break;
-                _zz_fuzz(k, buf, n);
-                _zz_addpos(k, n);
-                write(fdout, buf, n);
-            }
-            _zz_unregister(k);
+    if (opts->ncorpus)
+        opts->child[slot].newargv[opts->corpus_arg]
+            = opts->corpus[opts->child[slot].entry].path;
 
-            fclose(fpin);
-            close(fdout);
+    /* Prepare required files, if necessary */
+    if (opts->opmode == OPMODE_COPY
+         && copy_prepare(opts, &opts->child[slot]) < 0)
+        return -1;
 
-            ++k;
-        }
-    }
+    zzuf_set_seed(opts->child[slot].seed);
 
     /* Launch process */
     if (myfork(&opts->child[slot], opts) < 0)
     {
         fprintf(stderr, "error launching `%s'\n", opts->child[slot].newargv[0]);
-        opts->seed++;
-        /* FIXME: clean up OPMODE_COPY files here */
-        return;
+        if (opts->child[slot].persist_fd >= 0)
+        {
+            close(opts->child[slot].persist_fd);
+            opts->child[slot].persist_fd = -1;
+        }
+        opts->child[slot].seed++;
+        if (opts->opmode == OPMODE_COPY)
+            copy_release(opts, &opts->child[slot]);
+        return -1;
     }
 
     /* We’re the parent, acknowledge spawn */
     opts->child[slot].date = now;
     opts->child[slot].bytes = 0;
-    opts->child[slot].seed = opts->seed;
     opts->child[slot].ratio = zzuf_get_ratio();
     opts->child[slot].status = STATUS_RUNNING;
     if (opts->b_md5)
@@ -833,15 +1114,16 @@ static void spawn_children(zzuf_opts_t *opts)
 
     if (opts->b_verbose)
     {
-        finfo(stderr, opts, opts->child[slot].seed);
+        finfo(stderr, opts, opts->child[slot].entry, opts->child[slot].seed);
         fprintf(stderr, "launched `%s'\n", opts->child[slot].newargv[0]);
     }
 
     opts->lastlaunch = now;
+    opts->launches++;
+    opts->busytime -= now; /* the exit date is added in collect_child() */
     opts->nchild++;
-    opts->seed++;
 
-    zzuf_set_seed(opts->seed);
+    return 0;
 }
 
 static void clean_children(zzuf_opts_t *opts)
@@ -850,6 +1132,25 @@ static void clean_children(zzuf_opts_t *opts)
     int64_t now = zzuf_time();
 #endif
 
+#if defined ZZUF_PERSISTENT
+    /* Persistent mode children run several seeds: each new seed gets its
+     * own output and running time budget */
+    for (int i = 0; i < opts->maxchild; ++i)
+    {
+        if (opts->child[i].status != STATUS_RUNNING
+             || opts->child[i].persist_fd < 0)
+            continue;
+
+        uint32_t seed = myfork_seed(&opts->child[i]);
+        if (seed != opts->child[i].seed)
+        {
+            opts->child[i].seed = seed;
+            opts->child[i].bytes = 0;
+            opts->child[i].date = now;
+        }
+    }
+#endif
+
 #if defined HAVE_KILL || defined HAVE_WINDOWS_H
     /* Terminate children if necessary */
     for (int i = 0; i < opts->maxchild; ++i)
@@ -860,7 +1161,7 @@ static void clean_children(zzuf_opts_t *opts)
         {
             if (opts->b_verbose)
             {
-                finfo(stderr, opts, opts->child[i].seed);
+                finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
                 fprintf(stderr, "data output exceeded, sending SIGTERM\n");
             }
 #if defined HAVE_KILL
@@ -880,7 +1181,7 @@ static void clean_children(zzuf_opts_t *opts)
         {
             if (opts->b_verbose)
             {
-                finfo(stderr, opts, opts->child[i].seed);
+                finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
                 fprintf(stderr, "running time exceeded, sending SIGTERM\n");
             }
 #if defined HAVE_KILL
@@ -903,7 +1204,7 @@ static void clean_children(zzuf_opts_t *opts)
         {
             if (opts->b_verbose)
             {
-                finfo(stderr, opts, opts->child[i].seed);
+                finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
                 fprintf(stderr, "not responding, sending SIGKILL\n");
             }
 #if defined HAVE_KILL
@@ -919,121 +1220,217 @@ static void clean_children(zzuf_opts_t *opts)
     /* Collect dead children */
     for (int i = 0; i < opts->maxchild; ++i)
     {
-        uint8_t md5sum[16];
-#if defined HAVE_WAITPID
-        int status;
-        pid_t pid;
-#endif
-
         if (opts->child[i].status != STATUS_SIGKILL
             && opts->child[i].status != STATUS_SIGTERM
             && opts->child[i].status != STATUS_EOF)
             continue;
 
-#if defined HAVE_WAITPID
-        pid = waitpid(opts->child[i].pid, &status, WNOHANG);
-        if (pid <= 0)
+#if defined ZZUF_EPOLL
+        /* No need to poll children that send an event when they exit */
+        if (opts->epoll_fd >= 0 && (opts->child[i].exit_fd >= 0
+                                     || opts->child[i].server_fd >= 0))
             continue;
+#endif
 
-        if (opts->b_checkexit && WIFEXITED(status) && WEXITSTATUS(status))
-        {
-            finfo(stderr, opts, opts->child[i].seed);
-            fprintf(stderr, "exit %i\n", WEXITSTATUS(status));
-            opts->crashes++;
-        }
-        else if (WIFSIGNALED(status)
-                 && !(WTERMSIG(status) == SIGTERM
-                       && opts->child[i].status == STATUS_SIGTERM))
-        {
-            char const *message = "";
+        collect_child(opts, i);
+    }
+}
 
-            if (WTERMSIG(status) == SIGKILL && opts->maxmem >= 0)
-                message = " (memory exceeded?)";
-#   if defined SIGXCPU
-            else if (WTERMSIG(status) == SIGXCPU && opts->maxcpu >= 0)
-                message = " (CPU time exceeded?)";
+/*
+ * Get the exit status of a child, if it is available, report it and free
+ * the child's slot.
+ */
+static void collect_child(zzuf_opts_t *opts, int i)
+{
+    uint8_t md5sum[16];
+
+#if defined HAVE_WAITPID
+    int status;
+    pid_t pid = mywait(&opts->child[i], opts, &status);
+    if (pid <= 0)
+        return;
+
+#   if defined ZZUF_PERSISTENT
+    /* Report the seed that was running when the child died */
+    opts->child[i].seed = myfork_seed(&opts->child[i]);
 #   endif
-            else if (WTERMSIG(status) == SIGKILL && opts->maxcpu >= 0)
-                message = " (CPU time exceeded?)";
 
-            finfo(stderr, opts, opts->child[i].seed);
-            fprintf(stderr, "signal %i%s%s\n",
-                    WTERMSIG(status), sig2name(WTERMSIG(status)), message);
-            opts->crashes++;
-        }
-        else if (opts->b_verbose)
-        {
-            finfo(stderr, opts, opts->child[i].seed);
-            if (WIFSIGNALED(status))
-                fprintf(stderr, "signal %i%s\n",
-                        WTERMSIG(status), sig2name(WTERMSIG(status)));
-            else
-                fprintf(stderr, "exit %i\n", WEXITSTATUS(status));
-        }
+    if (opts->b_checkexit && WIFEXITED(status) && WEXITSTATUS(status))
+    {
+        finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
+        fprintf(stderr, "exit %i\n", WEXITSTATUS(status));
+        opts->crashes++;
+        if (opts->ncorpus)
+            opts->corpus[opts->child[i].entry].crashes++;
+    }
+    else if (WIFSIGNALED(status)
+             && !(WTERMSIG(status) == SIGTERM
+                   && opts->child[i].status == STATUS_SIGTERM))
+    {
+        char const *message = "";
+
+        if (WTERMSIG(status) == SIGKILL && opts->maxmem >= 0)
+            message = " (memory exceeded?)";
+#   if defined SIGXCPU
+        else if (WTERMSIG(status) == SIGXCPU && opts->maxcpu >= 0)
+            message = " (CPU time exceeded?)";
+#   endif
+        else if (WTERMSIG(status) == SIGKILL && opts->maxcpu >= 0)
+            message = " (CPU time exceeded?)";
+
+        finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
+        fprintf(stderr, "signal %i%s%s\n",
+                WTERMSIG(status), sig2name(WTERMSIG(status)), message);
+        opts->crashes++;
+        if (opts->ncorpus)
+            opts->corpus[opts->child[i].entry].crashes++;
+    }
+    else if (opts->b_verbose)
+    {
+        finfo(stderr, opts, opts->child[i].entry, opts->child[i].seed);
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "signal %i%s\n",
+                    WTERMSIG(status), sig2name(WTERMSIG(status)));
+        else
+            fprintf(stderr, "exit %i\n", WEXITSTATUS(status));
+    }
 #elif defined _WIN32
+    {
+        DWORD exit_code;
+        if (GetExitCodeProcess(opts->child[i].process_handle, &exit_code))
         {
-            DWORD exit_code;
-            if (GetExitCodeProcess(opts->child[i].process_handle, &exit_code))
-            {
-                if (exit_code == STILL_ACTIVE) continue; /* The process is still active, we don't do anything */
-
-                /*
-                 * The main problem with GetExitCodeProcess is it returns either returned parameter value of
-                 * ExitProcess/TerminateProcess, or the unhandled exception (which is what we're looking for)
-                 */
-                switch (exit_code)
-                {
-                case EXCEPTION_ACCESS_VIOLATION: fprintf(stderr, "child(%d) unhandled exception: Access Violation\n", opts->child[i].pid); break;
-                default: fprintf(stderr, "child(%d) exited with code %#08x\n", opts->child[i].pid, exit_code); break;
-                }
-            }
+            if (exit_code == STILL_ACTIVE) return; /* The process is still active, we don't do anything */
 
-            if (opts->child[i].status != STATUS_RUNNING)
+            /*
+             * The main problem with GetExitCodeProcess is it returns either returned parameter value of
+             * ExitProcess/TerminateProcess, or the unhandled exception (which is what we're looking for)
+             */
+            switch (exit_code)
             {
-                TerminateProcess(opts->child[i].process_handle, 0);
+            case EXCEPTION_ACCESS_VIOLATION: fprintf(stderr, "child(%d) unhandled exception: Access Violation\n", opts->child[i].pid); break;
+            default: fprintf(stderr, "child(%d) exited with code %#08x\n", opts->child[i].pid, exit_code); break;
             }
         }
+
+        if (opts->child[i].status != STATUS_RUNNING)
+        {
+            TerminateProcess(opts->child[i].process_handle, 0);
+        }
+    }
 #else
-        /* waitpid() is not available. Don't kill the process. */
-        continue;
+    /* waitpid() is not available. Don't kill the process. */
+    return;
 #endif
 
-        for (int j = 0; j < 3; ++j)
-            if (opts->child[i].fd[j] >= 0)
-                close(opts->child[i].fd[j]);
+    for (int j = 0; j < 3; ++j)
+    {
+        if (opts->child[i].fd[j] < 0)
+            continue;
+#if defined ZZUF_EPOLL
+        myfork_watch(&opts->child[i], opts, j, EPOLL_CTL_DEL, 0);
+#endif
+        close(opts->child[i].fd[j]);
+        opts->child[i].fd[j] = -1;
+    }
 
-        if (opts->opmode == OPMODE_COPY)
-        {
-            for (int j = zz_optind + 1; j < opts->oldargc; ++j)
-            {
-                if (opts->child[i].newargv[j - zz_optind] != opts->oldargv[j])
-                {
-                    unlink(opts->child[i].newargv[j - zz_optind]);
-                    free(opts->child[i].newargv[j - zz_optind]);
-                    opts->child[i].newargv[j - zz_optind] = opts->oldargv[j];
-                }
-            }
-        }
+    if (opts->opmode == OPMODE_COPY)
+        copy_release(opts, &opts->child[i]);
+
+    if (opts->b_md5)
+    {
+        zzuf_destroy_md5(md5sum, opts->child[i].md5);
+        finfo(stdout, opts, opts->child[i].entry, opts->child[i].seed);
+        fprintf(stdout, "%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x"
+                "%.02x%.02x%.02x%.02x%.02x%.02x%.02x\n", md5sum[0],
+                md5sum[1], md5sum[2], md5sum[3], md5sum[4], md5sum[5],
+                md5sum[6], md5sum[7], md5sum[8], md5sum[9], md5sum[10],
+                md5sum[11], md5sum[12], md5sum[13], md5sum[14], md5sum[15]);
+        fflush(stdout);
+    }
+    else if (opts->b_hex)
+    {
+        zzuf_destroy_hex(opts->child[i].hex);
+    }
+
+    if (opts->child[i].persist_fd >= 0)
+    {
+        close(opts->child[i].persist_fd);
+        opts->child[i].persist_fd = -1;
+    }
+
+    if (opts->child[i].exit_fd >= 0)
+    {
+#if defined ZZUF_EPOLL
+        myfork_watch(&opts->child[i], opts, CHANNEL_EXIT, EPOLL_CTL_DEL, 0);
+#endif
+        close(opts->child[i].exit_fd);
+        opts->child[i].exit_fd = -1;
+    }
+
+    /* Seeds this process did not reach are left for the next one, and
+     * those of a corpus input that crashed too often are skipped */
+    opts->child[i].seed++;
+    shard_skip(opts, &opts->next, 0);
+    opts->child[i].status = STATUS_FREE;
+    opts->busytime += zzuf_time();
+    opts->nchild--;
+}
+
+#if defined ZZUF_FORKSERVER
+/*
+ * The fork server a slot was starting has reached its fork point, or has
+ * exited. In the first case, what it wrote so far is the beginning of the
+ * slot's current run, which goes on in a forked child.
+ */
+static void server_ready(zzuf_opts_t *opts, int i)
+{
+    zzuf_child_t *child = &opts->child[i];
+
+    if (myfork_ready(child, opts) < 0)
+    {
+        /* It is now a normal child, which may have closed its output
+         * channels already */
+        if (child->status == STATUS_RUNNING && child->fd[0] == -1
+             && child->fd[1] == -1 && child->fd[2] == -1)
+            child->status = STATUS_EOF;
+        return;
+    }
 
+    /* The server no longer writes to its output channels */
+    for (int j = 0; j < 3; ++j)
+    {
+        while (child->fd[j] >= 0 && read_channel(opts, i, j) > 0)
+            ;
+        if (child->fd[j] < 0)
+            continue;
+#   if defined ZZUF_EPOLL
+        myfork_watch(child, opts, j, EPOLL_CTL_DEL, 0);
+#   endif
+        close(child->fd[j]);
+        child->fd[j] = -1;
+    }
+
+    if (myfork(child, opts) < 0)
+    {
+        fprintf(stderr, "error launching `%s'\n", child->newargv[0]);
         if (opts->b_md5)
         {
-            zzuf_destroy_md5(md5sum, opts->child[i].md5);
-            finfo(stdout, opts, opts->child[i].seed);
-            fprintf(stdout, "%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x%.02x"
-                    "%.02x%.02x%.02x%.02x%.02x%.02x%.02x\n", md5sum[0],
-                    md5sum[1], md5sum[2], md5sum[3], md5sum[4], md5sum[5],
-                    md5sum[6], md5sum[7], md5sum[8], md5sum[9], md5sum[10],
-                    md5sum[11], md5sum[12], md5sum[13], md5sum[14], md5sum[15]);
-            fflush(stdout);
+            uint8_t md5sum[16];
+            zzuf_destroy_md5(md5sum, child->md5);
         }
         else if (opts->b_hex)
-        {
-            zzuf_destroy_hex(opts->child[i].hex);
-        }
-        opts->child[i].status = STATUS_FREE;
+            zzuf_destroy_hex(child->hex);
+        child->seed++;
+        child->status = STATUS_FREE;
+        opts->busytime += zzuf_time();
         opts->nchild--;
+        return;
     }
+
+    /* The time the server took to start is not the child's */
+    child->date = zzuf_time();
 }
+#endif
 
 #ifdef _WIN32
 
@@ -1137,6 +1534,70 @@ static void read_children(zzuf_opts_t *opts)
 #else
 static void read_children(zzuf_opts_t *opts)
 {
+#if defined ZZUF_EPOLL
+    if (opts->epoll_fd >= 0)
+    {
+        /* Sleep until a descriptor is ready or a deadline is reached */
+        struct epoll_event events[256];
+        int ret = epoll_wait(opts->epoll_fd, events, 256, arm_timer(opts));
+        if (ret < 0 && errno != EINTR)
+            perror("epoll_wait");
+
+        for (int n = 0; n < ret; ++n)
+        {
+            if (events[n].data.u64 == EVENT_TIMER)
+            {
+                uint64_t expirations;
+                read(opts->timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+
+            if (events[n].data.u64 == EVENT_COPY)
+            {
+                copy_wakeup(opts);
+                continue;
+            }
+
+            int i = EVENT_SLOT(events[n].data.u64);
+            int j = EVENT_CHANNEL(events[n].data.u64);
+
+            if (opts->child[i].status == STATUS_FREE)
+            {
+                /* A fork server with no child can only be telling us
+                 * that it died; events for reaped children are stale */
+                if (j == CHANNEL_SERVER)
+                    myfork_stop(&opts->child[i], opts);
+            }
+#   if defined ZZUF_FORKSERVER
+            else if (j == CHANNEL_SERVER && opts->child[i].server_pid == 0)
+                server_ready(opts, i);
+#   endif
+            else if (j == CHANNEL_SERVER || j == CHANNEL_EXIT)
+            {
+                /* The child exited: get what it wrote before it died,
+                 * and free its slot right away */
+                for (int k = 0; k < 3; ++k)
+                    while (opts->child[i].status == STATUS_RUNNING
+                            && opts->child[i].fd[k] >= 0
+                            && read_channel(opts, i, k) > 0)
+                        ;
+                collect_child(opts, i);
+            }
+            else if (opts->child[i].fd[j] < 0)
+                continue;
+            else if (opts->child[i].status != STATUS_RUNNING)
+            {
+                /* Dying children are no longer read */
+                myfork_watch(&opts->child[i], opts, j, EPOLL_CTL_DEL, 0);
+            }
+            else
+                read_channel(opts, i, j);
+        }
+
+        return;
+    }
+#endif
+
     struct timeval tv;
     fd_set fdset;
     int maxfd = 0;
@@ -1145,6 +1606,15 @@ static void read_children(zzuf_opts_t *opts)
     FD_ZERO(&fdset);
     for (int i = 0; i < opts->maxchild; ++i)
     {
+#if defined ZZUF_FORKSERVER
+        /* Wake up as soon as a fork server sends an exit status, or
+         * reaches its fork point */
+        if (opts->child[i].status != STATUS_FREE
+             && (opts->child[i].status != STATUS_RUNNING
+                  || opts->child[i].server_pid == 0))
+            ZZUF_FD_SET(opts->child[i].server_fd, &fdset, maxfd);
+#endif
+
         if (opts->child[i].status != STATUS_RUNNING)
             continue;
 
@@ -1161,44 +1631,157 @@ static void read_children(zzuf_opts_t *opts)
     if (ret <= 0)
         return;
 
+#if defined ZZUF_FORKSERVER
+    for (int i = 0; i < opts->maxchild; ++i)
+        if (opts->child[i].status == STATUS_RUNNING
+             && opts->child[i].server_pid == 0
+             && ZZUF_FD_ISSET(opts->child[i].server_fd, &fdset))
+            server_ready(opts, i);
+#endif
+
     for (int i = 0; i < opts->maxchild; ++i)
     for (int j = 0; j < 3; ++j)
     {
-        uint8_t buf[BUFSIZ];
-
         if (opts->child[i].status != STATUS_RUNNING)
             continue;
 
         if (!ZZUF_FD_ISSET(opts->child[i].fd[j], &fdset))
             continue;
 
-        ret = read(opts->child[i].fd[j], buf, BUFSIZ - 1);
-        if (ret > 0)
-        {
-            /* We got data */
-            if (j != 0)
-                opts->child[i].bytes += ret;
-
-            if (opts->b_md5 && j == 2)
-                zz_md5_add(opts->child[i].md5, buf, ret);
-            else if (opts->b_hex && j == 2)
-                zz_hex_add(opts->child[i].hex, buf, ret);
-            else if (!opts->b_quiet || j == 0)
-                write((j < 2) ? STDERR_FILENO : STDOUT_FILENO, buf, ret);
-        }
-        else if (ret == 0)
-        {
-            /* End of file reached */
-            close(opts->child[i].fd[j]);
-            opts->child[i].fd[j] = -1;
+        read_channel(opts, i, j);
+    }
+}
 
-            if (opts->child[i].fd[0] == -1
-                && opts->child[i].fd[1] == -1
-                && opts->child[i].fd[2] == -1)
-                opts->child[i].status = STATUS_EOF;
-        }
+/*
+ * Read data from one of a child's channels, and close it at EOF. Returns
+ * the value returned by read().
+ */
+static int read_channel(zzuf_opts_t *opts, int i, int j)
+{
+    uint8_t buf[BUFSIZ];
+
+    int ret = read(opts->child[i].fd[j], buf, BUFSIZ - 1);
+    if (ret > 0)
+    {
+        /* We got data */
+        if (j != 0)
+            opts->child[i].bytes += ret;
+
+        if (opts->b_md5 && j == 2)
+            zz_md5_add(opts->child[i].md5, buf, ret);
+        else if (opts->b_hex && j == 2)
+            zz_hex_add(opts->child[i].hex, buf, ret);
+        else if (!opts->b_quiet || j == 0)
+            write((j < 2) ? STDERR_FILENO : STDOUT_FILENO, buf, ret);
+    }
+    else if (ret == 0)
+    {
+        /* End of file reached */
+#if defined ZZUF_EPOLL
+        myfork_watch(&opts->child[i], opts, j, EPOLL_CTL_DEL, 0);
+#endif
+        close(opts->child[i].fd[j]);
+        opts->child[i].fd[j] = -1;
+
+        /* A fork server also closes them when it reaches its fork point,
+         * which we may learn about afterwards */
+        if (opts->child[i].fd[0] == -1
+            && opts->child[i].fd[1] == -1
+            && opts->child[i].fd[2] == -1
+            && !(opts->child[i].server_fd >= 0
+                  && opts->child[i].server_pid == 0))
+            opts->child[i].status = STATUS_EOF;
+    }
+
+    return ret;
+}
+
+#if defined ZZUF_EPOLL
+/*
+ * Find the date, in microseconds, at which the main loop has something
+ * to do other than handling child events: launching a child, or sending
+ * a signal to one. Returns -1 if there is no such date.
+ */
+static int64_t next_deadline(zzuf_opts_t *opts)
+{
+    int64_t now = zzuf_time(), deadline = -1;
+    int slot = resume_slot(opts);
+
+    if (opts->nchild < opts->maxchild
+         && (opts->next.seed < opts->endseed || slot >= 0)
+         && !(!opts->ncorpus && opts->maxcrashes
+               && opts->crashes >= opts->maxcrashes)
+         && !(opts->maxtime && now - opts->starttime >= opts->maxtime))
+    {
+        /* Copy mode workers wake us up when the inputs are ready */
+        if (opts->opmode != OPMODE_COPY
+             || !(slot < 0 ? copy_pending(opts, opts->next.entry,
+                                          opts->next.seed)
+                           : copy_pending(opts, opts->child[slot].entry,
+                                          opts->child[slot].seed)))
+            deadline = opts->delay > 0 ? opts->lastlaunch + opts->delay
+                                       : now;
+    }
+    else if (opts->nchild == 0)
+        return now; /* the main loop is about to exit */
+
+    for (int i = 0; i < opts->maxchild; ++i)
+    {
+        int64_t date = -1;
+
+        if (opts->child[i].status == STATUS_FREE)
+            continue;
+
+        /* Without a pidfd, we can only poll for the child's exit */
+        if (opts->child[i].status != STATUS_RUNNING
+             && opts->child[i].exit_fd < 0 && opts->child[i].server_fd < 0)
+            date = now + 1000;
+        /* A persistent mode child may have started a new seed since we
+         * last looked, in which case this date is pushed back */
+        else if (opts->child[i].status == STATUS_RUNNING
+                  && opts->maxusertime >= 0)
+            date = opts->child[i].date + opts->maxusertime;
+        else if (opts->child[i].status == STATUS_SIGTERM)
+            date = opts->child[i].date + 2000000;
+
+        if (date >= 0 && (deadline < 0 || date < deadline))
+            deadline = date;
     }
+
+    return deadline;
 }
+
+/*
+ * Make sure we wake up at the next deadline, using the timerfd if there
+ * is one. Returns the timeout for epoll_wait(), in milliseconds.
+ */
+static int arm_timer(zzuf_opts_t *opts)
+{
+    int64_t deadline = next_deadline(opts);
+    if (deadline < 0)
+        return -1;
+
+    /* Deadlines are checked with ">", so wake up just after them */
+    int64_t delay = deadline + 1 - zzuf_time();
+    if (delay <= 0)
+        return 0;
+
+#   if defined ZZUF_TIMERFD
+    if (opts->timer_fd >= 0)
+    {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = delay / 1000000;
+        its.it_value.tv_nsec = delay % 1000000 * 1000;
+        if (timerfd_settime(opts->timer_fd, 0, &its, NULL) == 0)
+            return -1;
+    }
+#   endif
+
+    /* Round up, so that we do not wake up too early */
+    return delay > 60000000 ? 60000 : (int)((delay + 999) / 1000);
+}
+#endif
 #endif
 
 #if !defined HAVE_SETENV
@@ -1265,9 +1848,9 @@ static void version(void)
 static void usage(void)
 {
 #if defined HAVE_REGEX_H
-    printf("Usage: zzuf [-aAcdimnqSvx] [-s seed|-s start:stop] [-r ratio|-r min:max]\n");
+    printf("Usage: zzuf [-aAcdiLmnqSvxZ] [-s seed|-s start:stop] [-r ratio|-r min:max]\n");
 #else
-    printf("Usage: zzuf [-aAdimnqSvx] [-s seed|-s start:stop] [-r ratio|-r min:max]\n");
+    printf("Usage: zzuf [-aAdiLmnqSvxZ] [-s seed|-s start:stop] [-r ratio|-r min:max]\n");
 #endif
     printf("            [-f mode] [-D delay] [-j jobs] [-C crashes] [-B bytes] [-a list]\n");
     printf("            [-t seconds]");
@@ -1283,7 +1866,20 @@ static void usage(void)
     printf(                                                " [-I include] [-E exclude]");
 #endif
     printf("\n");
-    printf("            [-O mode] [PROGRAM [--] [ARGS]...]\n");
+    printf("            [-O mode] [-g generator] [-k chunks] [-K corpus]");
+#if defined ZZUF_FORKSERVER
+    printf(                                                " [-z point]");
+#endif
+#if defined ZZUF_PERSISTENT
+    printf(                                                " [-N seeds]");
+#endif
+    printf("\n");
+    printf("            [-H shard/shards]");
+#if defined ZZUF_QUEUE
+    printf(                             " [-Q file]");
+#endif
+    printf("\n");
+    printf("            [PROGRAM [--] [ARGS]...]\n");
     printf("       zzuf -h | --help\n");
     printf("       zzuf -V | --version\n");
     printf("Run PROGRAM with optional arguments ARGS and fuzz its input.\n");
@@ -1304,21 +1900,32 @@ static void usage(void)
     printf("  -E, --exclude <regex>     do not fuzz files matching <regex>\n");
 #endif
     printf("  -f, --fuzzing <mode>      use fuzzing mode <mode> ([xor] set unset)\n");
+    printf("  -g, --generator <gen>     use mask generator <gen> ([legacy] counter)\n");
+    printf("  -H, --shard <i/n>         only run the ith of every n blocks of seeds\n");
     printf("  -i, --stdin               fuzz standard input\n");
 #if defined HAVE_REGEX_H
     printf("  -I, --include <regex>     only fuzz files matching <regex>\n");
 #endif
     printf("  -j, --jobs <n>            number of simultaneous jobs (default 1)\n");
+    printf("  -k, --chunk-cache <n>     cache <n> chunk bitmasks per file (default %i)\n", DEFAULT_CHUNK_CACHE);
+    printf("  -K, --corpus <path>       run each input in directory or list file <path>\n");
     printf("  -l, --list <list>         only fuzz Nth descriptor with N in <list>\n");
+    printf("  -L, --lazy-mmap           only fuzz memory mapped pages when accessed\n");
     printf("  -m, --md5                 compute the output's MD5 hash\n");
 #if defined HAVE_SETRLIMIT && defined ZZUF_RLIMIT_MEM
     printf("  -M, --max-memory <n>      maximum child virtual memory in MiB (default %u)\n", DEFAULT_MEM);
 #endif
     printf("  -n, --network             fuzz network input\n");
+#if defined ZZUF_PERSISTENT
+    printf("  -N, --persistent <n>      run up to <n> seeds in each persistent process\n");
+#endif
     printf("  -O, --opmode <mode>       use operating mode <mode> ([preload] copy null)\n");
     printf("  -p, --ports <list>        only fuzz network destination ports in <list>\n");
     printf("  -P, --protect <list>      protect bytes and characters in <list>\n");
     printf("  -q, --quiet               do not print children's messages\n");
+#if defined ZZUF_QUEUE
+    printf("  -Q, --queue <file>        share seeds with other processes through <file>\n");
+#endif
     printf("  -r, --ratio <ratio>       bit fuzzing ratio (default %g)\n", DEFAULT_RATIO);
     printf("          ... <start:stop>  specify a ratio range\n");
     printf("  -R, --refuse <list>       refuse bytes and characters in <list>\n");
@@ -1331,6 +1938,10 @@ static void usage(void)
     printf("  -v, --verbose             print information during the run\n");
     printf("  -x, --check-exit          report processes that exit with a non-zero status\n");
     printf("  -X, --hex                 convert program output to hexadecimal\n");
+#if defined ZZUF_FORKSERVER
+    printf("  -z, --fork-point <point>  fork server stops at <point> ([init] open)\n");
+    printf("  -Z, --fork-server         fork children from an initialised process\n");
+#endif
     printf("  -h, --help                display this help and exit\n");
     printf("  -V, --version             output version information and exit\n");
     printf("\n");
@@ -0,0 +1,187 @@
+/*
+ *  bug-threads - read the same file from several threads at once
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+/* Needed for pread() */
+#define _GNU_SOURCE
+
+#if HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+#if HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#if HAVE_SYS_STAT_H
+#   include <sys/stat.h>
+#endif
+#if HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 8
+#define PASSES 20
+#define MAXSIZE (1024 * 1024)
+
+/* Every thread reads the whole file several times, using a different
+ * block size, and must always get the same data as the other threads.
+ * With -p, the threads share a single descriptor and use pread(). With
+ * -m, they copy the data from a single memory map of the file, so that
+ * they fault on the same pages at the same time with lazy fuzzing. */
+struct job
+{
+    char const *name;
+    int blocksize;
+    size_t len;
+    int error;
+    unsigned char data[MAXSIZE];
+};
+
+static struct job jobs[THREADS];
+static int shared_fd = -1;
+static char const *shared_map = NULL;
+static size_t shared_size = 0;
+
+static void *run(void *arg)
+{
+    struct job *job = arg;
+    static unsigned char tmp[THREADS][MAXSIZE];
+    unsigned char *buf = tmp[job - jobs];
+
+    for (int pass = 0; pass < PASSES; ++pass)
+    {
+        size_t len = 0;
+        int fd = shared_map ? -1
+               : shared_fd >= 0 ? shared_fd : open(job->name, O_RDONLY);
+
+        if (!shared_map && fd < 0)
+        {
+            job->error = 1;
+            return NULL;
+        }
+
+        while (len < MAXSIZE)
+        {
+            size_t n = MAXSIZE - len < (size_t)job->blocksize
+                     ? MAXSIZE - len : (size_t)job->blocksize;
+            ssize_t ret;
+            if (shared_map)
+            {
+                ret = shared_size - len < n ? (ssize_t)(shared_size - len)
+                                            : (ssize_t)n;
+                memcpy(buf + len, shared_map + len, ret);
+            }
+            else
+                ret = shared_fd >= 0 ? pread(fd, buf + len, n, len)
+                                     : read(fd, buf + len, n);
+            if (ret <= 0)
+                break;
+            len += ret;
+        }
+
+        if (fd >= 0 && fd != shared_fd)
+            close(fd);
+
+        if (pass == 0)
+        {
+            memcpy(job->data, buf, len);
+            job->len = len;
+        }
+        else if (len != job->len || memcmp(job->data, buf, len))
+            job->error = 1;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "-p"))
+    {
+        shared_fd = open(argv[2], O_RDONLY);
+        if (shared_fd < 0)
+        {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+        --argc;
+        ++argv;
+    }
+#if HAVE_MMAP
+    else if (argc == 3 && !strcmp(argv[1], "-m"))
+    {
+        struct stat st;
+        int fd = open(argv[2], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+        shared_size = st.st_size < MAXSIZE ? (size_t)st.st_size : MAXSIZE;
+        shared_map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                          fd, 0);
+        close(fd);
+        if (shared_map == MAP_FAILED)
+        {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+        --argc;
+        ++argv;
+    }
+#endif
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: bug-threads [-p|-m] <file>\n");
+        return EXIT_FAILURE;
+    }
+
+#if HAVE_PTHREAD_H
+    pthread_t threads[THREADS];
+
+    for (int i = 0; i < THREADS; ++i)
+    {
+        jobs[i].name = argv[1];
+        jobs[i].blocksize = 1 + i * 397;
+        pthread_create(&threads[i], NULL, run, &jobs[i]);
+    }
+
+    for (int i = 0; i < THREADS; ++i)
+        pthread_join(threads[i], NULL);
+#else
+    jobs[0].name = argv[1];
+    jobs[0].blocksize = 1;
+    run(&jobs[0]);
+#endif
+
+    for (int i = 0; i < THREADS; ++i)
+    {
+        if (jobs[i].error || jobs[i].len != jobs[0].len
+             || memcmp(jobs[i].data, jobs[0].data, jobs[0].len))
+        {
+            fprintf(stderr, "bug-threads: thread %i got different data\n", i);
+            return EXIT_FAILURE;
+        }
+#if !HAVE_PTHREAD_H
+        break;
+#endif
+    }
+
+    fwrite(jobs[0].data, 1, jobs[0].len, stdout);
+
+    return EXIT_SUCCESS;
+}
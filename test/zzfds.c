@@ -0,0 +1,141 @@
+/*
+ *  zzfds - register and unregister lots of file descriptors
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+/* Needed for pread() */
+#define _GNU_SOURCE
+
+#if HAVE_SYS_TYPES_H
+#   include <sys/types.h>
+#endif
+#if HAVE_SYS_TIME_H
+#   include <sys/time.h>
+#endif
+#if HAVE_SYS_RESOURCE_H
+#   include <sys/resource.h>
+#endif
+#if HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK 64
+
+/* Open a file, then duplicate its file descriptor as many times as the
+ * system allows, including at the highest possible number, and close the
+ * duplicates, until <count> descriptors were created. Every descriptor
+ * must read the same data as the original one, which is then output.
+ * With -t, also print the time spent creating and closing descriptors. */
+int main(int argc, char *argv[])
+{
+    int timing = argc > 1 && !strcmp(argv[1], "-t");
+
+    if (argc != 2 + timing && argc != 3 + timing)
+    {
+        fprintf(stderr, "usage: zzfds [-t] <file> [<count>]\n");
+        return EXIT_FAILURE;
+    }
+
+#if HAVE_PREAD && HAVE_DUP && HAVE_DUP2
+    int count = argc == 3 + timing ? atoi(argv[2 + timing]) : 100000;
+    int maxfd = 1024;
+
+#   if HAVE_SYS_RESOURCE_H
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0)
+    {
+        if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_cur < rlim.rlim_max)
+        {
+            rlim.rlim_cur = rlim.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rlim);
+            getrlimit(RLIMIT_NOFILE, &rlim);
+        }
+        if (rlim.rlim_cur != RLIM_INFINITY)
+            maxfd = rlim.rlim_cur < 1 << 20 ? (int)rlim.rlim_cur : 1 << 20;
+    }
+#   endif
+
+    int fd = open(argv[1 + timing], O_RDONLY);
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    char ref[BLOCK], buf[BLOCK];
+    ssize_t len = pread(fd, ref, BLOCK, 0);
+    if (len <= 0)
+        return EXIT_FAILURE;
+
+    int *fds = malloc(maxfd * sizeof(*fds));
+
+#   if HAVE_GETTIMEOFDAY
+    struct timeval tv0, tv1;
+    gettimeofday(&tv0, NULL);
+#   endif
+
+    int done = 0, error = 0;
+    while (done < count && !error)
+    {
+        /* The highest descriptor first, then as many as possible */
+        int n = 0, newfd = dup2(fd, maxfd - 1);
+        if (newfd >= 0)
+        {
+            fds[n++] = newfd;
+            ++done;
+        }
+
+        while (done < count && n < maxfd && (newfd = dup(fd)) >= 0)
+        {
+            fds[n++] = newfd;
+            ++done;
+        }
+
+        if (n < 2)
+            error = 1;
+
+        for (int i = 0; i < n; ++i)
+        {
+            if ((i % 997 == 0 || i == n - 1)
+                 && (pread(fds[i], buf, BLOCK, 0) != len
+                      || memcmp(buf, ref, len)))
+            {
+                fprintf(stderr, "zzfds: descriptor %i got different data\n",
+                        fds[i]);
+                error = 1;
+            }
+            close(fds[i]);
+        }
+    }
+
+#   if HAVE_GETTIMEOFDAY
+    gettimeofday(&tv1, NULL);
+    if (timing)
+        fprintf(stderr, "%i descriptors in %.3f s\n", done,
+                (double)(tv1.tv_sec - tv0.tv_sec)
+                  + 1e-6 * (double)(tv1.tv_usec - tv0.tv_usec));
+#   endif
+
+    free(fds);
+    if (error)
+        return EXIT_FAILURE;
+
+    for (off_t off = 0; (len = pread(fd, buf, BLOCK, off)) > 0; off += len)
+        fwrite(buf, len, 1, stdout);
+
+    close(fd);
+#endif
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,82 @@
+/*
+ *  zzloop - copy a file to stdout once per seed in persistent mode
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE /* for RTLD_DEFAULT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#if defined HAVE_DLFCN_H
+#   include <dlfcn.h>
+#endif
+
+#include "zzuf.h"
+
+static int crash = 0;
+volatile int buf[1];
+
+/* The harness: copy the file to stdout, or crash on any non-zero byte */
+static int harness(void *data)
+{
+    FILE *fp = fopen((char const *)data, "rb");
+    if (!fp)
+        return -1;
+
+    int ch;
+    while ((ch = getc(fp)) != EOF)
+    {
+        if (crash)
+        {
+            buf[0] = 1 / !ch;
+            if (ch)
+                raise(SIGFPE);
+        }
+        else
+            putchar(ch);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "-c"))
+    {
+        crash = 1;
+        --argc;
+        ++argv;
+    }
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: zzloop [-c] <file>\n");
+        return EXIT_FAILURE;
+    }
+
+    /* libzzuf is only there when running under zzuf */
+    int (*loop)(zzuf_harness_t, void *) = NULL;
+#if defined HAVE_DLFCN_H && defined RTLD_DEFAULT
+    *(void **)&loop = dlsym(RTLD_DEFAULT, "zzuf_persistent");
+#endif
+
+    if (loop)
+        loop(harness, argv[1]);
+    else
+        harness(argv[1]);
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,189 @@
+/*
+ *  zzmap - output part of a file using mmap()
+ *
+ *  Copyright © 2002—2015 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This program is free software. It comes without any warranty, to
+ *  the extent permitted by applicable law. You can redistribute it
+ *  and/or modify it under the terms of the Do What the Fuck You Want
+ *  to Public License, Version 2, as published by the WTFPL Task Force.
+ *  See http://www.wtfpl.net/ for more details.
+ */
+
+#include "config.h"
+
+/* Needed for sigaction() and MAP_ANONYMOUS */
+#define _BSD_SOURCE 1
+#define _DEFAULT_SOURCE
+
+#if HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#   include <sys/types.h>
+#endif
+#if HAVE_SYS_STAT_H
+#   include <sys/stat.h>
+#endif
+#if HAVE_SYS_RESOURCE_H
+#   include <sys/resource.h>
+#endif
+#if HAVE_SYS_WAIT_H
+#   include <sys/wait.h>
+#endif
+#if HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_MMAP && HAVE_SIGACTION && HAVE_FORK && HAVE_WAITPID
+#   if !defined MAP_ANONYMOUS
+#       define MAP_ANONYMOUS MAP_ANON
+#   endif
+
+static sigjmp_buf env;
+static int calls = 0;
+
+static void handler(int signum)
+{
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    /* The signal and the handler's mask must be blocked, and a one-shot
+     * handler must not be called again */
+    if (++calls > 1 || !sigismember(&mask, signum)
+         || !sigismember(&mask, SIGUSR1))
+        _exit(EXIT_FAILURE);
+    siglongjmp(env, 1);
+}
+
+/* Install a one-shot SIGSEGV handler in a child process, then fault twice
+ * outside the map: the handler must be called once, with the right
+ * signal mask, and the child then killed. Print the result, since zzuf
+ * does not pass on exit codes. */
+static int check_handler(void)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char *page = mmap(NULL, 4096, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sigemptyset(&sa.sa_mask);
+        sigaddset(&sa.sa_mask, SIGUSR1);
+        sa.sa_handler = handler;
+        sa.sa_flags = SA_RESETHAND;
+        sigaction(SIGSEGV, &sa, NULL);
+        sigaction(SIGBUS, &sa, NULL);
+
+        sigsetjmp(env, 1);
+        *(volatile char *)page = 0;
+        _exit(EXIT_FAILURE);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return EXIT_FAILURE;
+
+    int ok = WIFSIGNALED(status)
+              && (WTERMSIG(status) == SIGSEGV || WTERMSIG(status) == SIGBUS);
+    printf("%s\n", ok ? "ok" : "failed");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+/* Map the whole file, close it, then copy the requested bytes backwards,
+ * one kilobyte at a time, so that pages are not accessed in order. With
+ * -r, also print the maximum resident set size in kilobytes. With -f,
+ * the copy is done by a child process forked after mapping the file. With
+ * -s, check that our SIGSEGV handler lets the program's handlers behave
+ * as expected instead. */
+int main(int argc, char *argv[])
+{
+    int rss = 0, child = 0, segv = 0, n = 1;
+
+    for ( ; n < argc; ++n)
+    {
+        if (!strcmp(argv[n], "-r"))
+            rss = 1;
+        else if (!strcmp(argv[n], "-f"))
+            child = 1;
+        else if (!strcmp(argv[n], "-s"))
+            segv = 1;
+        else
+            break;
+    }
+
+    if (argc != n + 1 && argc != n + 3)
+    {
+        fprintf(stderr, "usage: zzmap [-r] [-f] [-s] <file> [<offset> <length>]\n");
+        return EXIT_FAILURE;
+    }
+
+#if HAVE_MMAP
+    char const *name = argv[n];
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    struct stat st;
+    fstat(fd, &st);
+    long long int offset = 0, length = st.st_size;
+    if (argc == n + 3)
+    {
+        offset = atoll(argv[n + 1]);
+        length = atoll(argv[n + 2]);
+    }
+
+    char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return EXIT_FAILURE;
+
+#   if HAVE_FORK && HAVE_WAITPID
+    if (child)
+    {
+        int status;
+        pid_t pid = fork();
+        if (pid < 0 || (pid > 0 && waitpid(pid, &status, 0) != pid))
+            return EXIT_FAILURE;
+        if (pid > 0)
+            return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+    }
+#   else
+    (void)child;
+#   endif
+
+#   if HAVE_SIGACTION && HAVE_FORK && HAVE_WAITPID
+    if (segv)
+        return check_handler();
+#   else
+    (void)segv;
+#   endif
+
+    char *buf = malloc(length);
+    for (long long int i = (length - 1) / 1024 * 1024; i >= 0; i -= 1024)
+        memcpy(buf + i, map + offset + i, length - i < 1024 ? length - i : 1024);
+    fwrite(buf, length, 1, stdout);
+
+    munmap(map, (size_t)st.st_size);
+    free(buf);
+
+#   if HAVE_SYS_RESOURCE_H
+    if (rss)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "%li\n", (long int)usage.ru_maxrss);
+    }
+#   endif
+#endif
+
+    return EXIT_SUCCESS;
+}
+